@@ -0,0 +1,619 @@
+#include "batchio.h"
+#include "filedescriptor.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+	#include <liburing.h>
+#endif
+
+namespace {
+// Large transfers are split so a single file does not monopolize the queue
+const std::size_t ChunkSize = 4 << 20;
+
+std::system_error MakeError (const std::string& path)
+{
+	return std::system_error (errno, std::generic_category (), path);
+}
+
+int OpenForRead (const std::string& path, std::size_t& size)
+{
+	FileDescriptor fd (open (path.c_str (), O_RDONLY | O_CLOEXEC));
+	if (fd.Get () < 0) {
+		throw MakeError (path);
+	}
+
+	struct stat info;
+	if (fstat (fd.Get (), &info) != 0) {
+		throw MakeError (path);
+	}
+
+	size = info.st_size;
+	return fd.Release ();
+}
+
+int OpenForWrite (const std::string& path)
+{
+	const int fd = open (path.c_str (),
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw MakeError (path);
+	}
+
+	return fd;
+}
+
+// Strips the header from a complete PPM file in place
+Image DecodePPM (PixelBuffer data, const std::string& path)
+{
+	int width = 0, height = 0;
+	std::size_t headerSize = 0;
+	if (!ParsePPMHeader (data.data (), data.size (), width, height, headerSize)) {
+		throw std::runtime_error (path + ": not an 8 bit binary PPM");
+	}
+
+	const std::size_t payload = std::size_t (width) * height * 3;
+	if (data.size () - headerSize < payload) {
+		throw std::runtime_error (path + ": truncated pixel data");
+	}
+
+	data.erase (data.begin (), data.begin () + headerSize);
+	data.resize (payload);
+
+	Image img;
+	img.pixel = std::move (data);
+	img.width = width;
+	img.height = height;
+	return img;
+}
+
+void PReadAll (int fd, char* data, std::size_t size, off_t offset,
+	const std::string& path)
+{
+	while (size > 0) {
+		const ssize_t n = pread (fd, data, std::min (size, ChunkSize), offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			throw MakeError (path);
+		} else if (n == 0) {
+			throw std::runtime_error (path + ": unexpected end of file");
+		}
+
+		data += n;
+		size -= n;
+		offset += n;
+	}
+}
+
+void PWriteAll (int fd, const char* data, std::size_t size, off_t offset,
+	const std::string& path)
+{
+	while (size > 0) {
+		const ssize_t n = pwrite (fd, data, std::min (size, ChunkSize), offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			throw MakeError (path);
+		}
+
+		data += n;
+		size -= n;
+		offset += n;
+	}
+}
+
+// Number of pixels converted per step, small enough to stay in L2
+const std::size_t ConvertBlock = 64 * 1024;
+
+// Rows handed to one task when splitting a single large image
+std::size_t RowsPerBand (const int width, const int height, ThreadPool& pool)
+{
+	// A few bands per thread, but at least ChunkSize bytes each
+	const std::size_t rowBytes = std::size_t (width) * 3;
+	std::size_t rows = height / (4 * pool.Size ()) + 1;
+	if (rows * rowBytes < ChunkSize) {
+		rows = ChunkSize / rowBytes + 1;
+	}
+
+	return rows;
+}
+
+// Waits for every task before reporting the first failure, since the tasks
+// reference the caller's file descriptor and buffers
+void WaitAll (std::vector<std::future<void>>& tasks)
+{
+	std::exception_ptr error;
+	for (auto& task : tasks) {
+		try {
+			task.get ();
+		} catch (...) {
+			if (!error) {
+				error = std::current_exception ();
+			}
+		}
+	}
+
+	if (error) {
+		std::rethrow_exception (error);
+	}
+}
+
+// Blocking pread/pwrite on a thread pool, one file per worker
+class ThreadPoolBatchIO : public BatchIO
+{
+public:
+	explicit ThreadPoolBatchIO (std::size_t queueDepth)
+		: pool_ (queueDepth)
+	{
+	}
+
+	std::future<Image> Read (const std::string& path) override
+	{
+		return pool_.Submit ([path] () {
+			TraceSpan span ("ReadFile");
+			std::size_t size = 0;
+			FileDescriptor fd (OpenForRead (path, size));
+
+			PixelBuffer data (size);
+			PReadAll (fd.Get (), data.data (), size, 0, path);
+
+			return DecodePPM (std::move (data), path);
+		});
+	}
+
+	std::future<void> Write (const std::string& path, Image image) override
+	{
+		auto shared = std::make_shared<Image> (std::move (image));
+		return pool_.Submit ([path, shared] () {
+			TraceSpan span ("WriteFile");
+			FileDescriptor fd (OpenForWrite (path));
+
+			const std::string header = FormatPPMHeader (shared->width, shared->height);
+			PWriteAll (fd.Get (), header.data (), header.size (), 0, path);
+			PWriteAll (fd.Get (), shared->pixel.data (), shared->pixel.size (),
+				header.size (), path);
+		});
+	}
+
+	const char* Name () const override
+	{
+		return "thread pool";
+	}
+
+private:
+	ThreadPool pool_;
+};
+
+#ifdef HAVE_LIBURING
+// Single ring shared by all files. Callers submit, a dedicated thread reaps
+// completions, resubmits short transfers and fulfills the promises.
+class UringBatchIO : public BatchIO
+{
+public:
+	explicit UringBatchIO (std::size_t queueDepth)
+		: depth_ (queueDepth), inFlight_ (0), initialized_ (false)
+	{
+	}
+
+	~UringBatchIO ()
+	{
+		if (!initialized_) {
+			return;
+		}
+
+		{
+			std::unique_lock<std::mutex> lock (mutex_);
+			idle_.wait (lock, [this] () { return inFlight_ == 0 && backlog_.empty (); });
+
+			// A NOP without user data tells the reaper to exit
+			io_uring_sqe* sqe = io_uring_get_sqe (&ring_);
+			io_uring_prep_nop (sqe);
+			io_uring_sqe_set_data (sqe, nullptr);
+			io_uring_submit (&ring_);
+		}
+
+		reaper_.join ();
+		io_uring_queue_exit (&ring_);
+	}
+
+	bool Init ()
+	{
+		if (io_uring_queue_init (static_cast<unsigned> (depth_), &ring_, 0) < 0) {
+			return false;
+		}
+
+		initialized_ = true;
+		reaper_ = std::thread (&UringBatchIO::Reap, this);
+		return true;
+	}
+
+	std::future<Image> Read (const std::string& path) override
+	{
+		std::unique_ptr<Request> request (new Request);
+		request->path = path;
+		request->isWrite = false;
+
+		std::size_t size = 0;
+		request->fd = OpenForRead (path, size);
+		request->buffer.resize (size);
+		AddOps (*request, request->buffer.data (), size, 0);
+
+		std::future<Image> result = request->readDone.get_future ();
+		Enqueue (std::move (request));
+		return result;
+	}
+
+	std::future<void> Write (const std::string& path, Image image) override
+	{
+		std::unique_ptr<Request> request (new Request);
+		request->path = path;
+		request->isWrite = true;
+		request->fd = OpenForWrite (path);
+		request->header = FormatPPMHeader (image.width, image.height);
+		request->image = std::move (image);
+
+		AddOps (*request, &request->header [0], request->header.size (), 0);
+		AddOps (*request, request->image.pixel.data (),
+			request->image.pixel.size (), request->header.size ());
+
+		std::future<void> result = request->writeDone.get_future ();
+		Enqueue (std::move (request));
+		return result;
+	}
+
+	const char* Name () const override
+	{
+		return "io_uring";
+	}
+
+private:
+	struct Request;
+
+	struct Op
+	{
+		Request* request;
+		char* data;
+		std::size_t length;
+		off_t offset;
+	};
+
+	struct Request
+	{
+		std::string path;
+		bool isWrite;
+		int fd;
+		int error;
+		bool truncated;
+		std::size_t pending;
+		std::vector<Op> ops;
+
+		PixelBuffer buffer;
+		std::promise<Image> readDone;
+
+		std::string header;
+		Image image;
+		std::promise<void> writeDone;
+
+		Request () : isWrite (false), fd (-1), error (0), truncated (false), pending (0) {}
+	};
+
+	static void AddOps (Request& request, char* data, std::size_t size, off_t offset)
+	{
+		for (std::size_t done = 0; done < size; done += ChunkSize) {
+			const Op op = { &request, data + done, std::min (ChunkSize, size - done),
+				off_t (offset + done) };
+			request.ops.push_back (op);
+		}
+	}
+
+	void Enqueue (std::unique_ptr<Request> request)
+	{
+		// Empty files have nothing to transfer
+		if (request->ops.empty ()) {
+			Complete (request.release ());
+			return;
+		}
+
+		Request* r = request.release ();
+		std::lock_guard<std::mutex> lock (mutex_);
+		r->pending = r->ops.size ();
+		for (auto& op : r->ops) {
+			backlog_.push_back (&op);
+		}
+		Pump ();
+	}
+
+	// Moves queued operations into the submission ring. mutex_ must be held.
+	void Pump ()
+	{
+		bool submitted = false;
+		while (!backlog_.empty () && inFlight_ < depth_) {
+			io_uring_sqe* sqe = io_uring_get_sqe (&ring_);
+			if (!sqe) {
+				break;
+			}
+
+			Op* op = backlog_.front ();
+			backlog_.pop_front ();
+
+			if (op->request->isWrite) {
+				io_uring_prep_write (sqe, op->request->fd, op->data,
+					static_cast<unsigned> (op->length), op->offset);
+			} else {
+				io_uring_prep_read (sqe, op->request->fd, op->data,
+					static_cast<unsigned> (op->length), op->offset);
+			}
+			io_uring_sqe_set_data (sqe, op);
+
+			++inFlight_;
+			submitted = true;
+		}
+
+		if (submitted) {
+			io_uring_submit (&ring_);
+		}
+	}
+
+	void Reap ()
+	{
+		for (;;) {
+			io_uring_cqe* cqe = nullptr;
+			const int ret = io_uring_wait_cqe (&ring_, &cqe);
+			if (ret == -EINTR) {
+				continue;
+			} else if (ret < 0) {
+				// Nothing sensible left to do with a broken ring
+				std::terminate ();
+			}
+
+			Op* op = static_cast<Op*> (io_uring_cqe_get_data (cqe));
+			const int res = cqe->res;
+			io_uring_cqe_seen (&ring_, cqe);
+
+			if (!op) {
+				return;
+			}
+
+			Request* finished = nullptr;
+			{
+				std::lock_guard<std::mutex> lock (mutex_);
+				--inFlight_;
+
+				Request& request = *op->request;
+				if (res < 0) {
+					request.error = -res;
+				} else if (res == 0 && !request.isWrite) {
+					request.truncated = true;
+				} else if (std::size_t (res) < op->length) {
+					// Short transfer, queue the remainder
+					op->data += res;
+					op->length -= res;
+					op->offset += res;
+					backlog_.push_back (op);
+					op = nullptr;
+				}
+
+				if (op && --request.pending == 0) {
+					finished = &request;
+				}
+
+				Pump ();
+			}
+
+			if (finished) {
+				Complete (finished);
+			}
+
+			idle_.notify_all ();
+		}
+	}
+
+	static void Complete (Request* r)
+	{
+		std::unique_ptr<Request> request (r);
+		close (request->fd);
+
+		std::exception_ptr error;
+		if (request->error) {
+			error = std::make_exception_ptr (std::system_error (
+				request->error, std::generic_category (), request->path));
+		} else if (request->truncated) {
+			error = std::make_exception_ptr (std::runtime_error (
+				request->path + ": unexpected end of file"));
+		}
+
+		if (request->isWrite) {
+			if (error) {
+				request->writeDone.set_exception (error);
+			} else {
+				request->writeDone.set_value ();
+			}
+		} else if (error) {
+			request->readDone.set_exception (error);
+		} else {
+			try {
+				request->readDone.set_value (
+					DecodePPM (std::move (request->buffer), request->path));
+			} catch (...) {
+				request->readDone.set_exception (std::current_exception ());
+			}
+		}
+	}
+
+	io_uring ring_;
+	std::size_t depth_;
+	std::size_t inFlight_;
+	bool initialized_;
+	std::deque<Op*> backlog_;
+	std::mutex mutex_;
+	std::condition_variable idle_;
+	std::thread reaper_;
+};
+#endif
+}
+
+std::unique_ptr<BatchIO> CreateBatchIO (std::size_t queueDepth)
+{
+	if (queueDepth == 0) {
+		queueDepth = 1;
+	}
+
+#ifdef HAVE_LIBURING
+	// io_uring may be compiled in but disabled by the kernel or a seccomp
+	// profile, in which case initialization fails and we fall back
+	std::unique_ptr<UringBatchIO> uring (new UringBatchIO (queueDepth));
+	if (uring->Init ()) {
+		return std::unique_ptr<BatchIO> (uring.release ());
+	}
+#endif
+
+	return std::unique_ptr<BatchIO> (new ThreadPoolBatchIO (queueDepth));
+}
+
+Image LoadImageRGBA (const std::string& path, ThreadPool& pool)
+{
+	TraceSpan span ("LoadImageRGBA");
+	std::size_t size = 0;
+	FileDescriptor fd (OpenForRead (path, size));
+
+	// The header is tiny unless it has long comments, grow until it parses
+	int width = 0, height = 0;
+	std::size_t headerSize = 0;
+	std::vector<char> header;
+	for (std::size_t probe = 4096; ; probe *= 2) {
+		header.resize (std::min (probe, size));
+		PReadAll (fd.Get (), header.data (), header.size (), 0, path);
+
+		if (ParsePPMHeader (header.data (), header.size (), width, height, headerSize)) {
+			break;
+		} else if (header.size () == size) {
+			throw std::runtime_error (path + ": not an 8 bit binary PPM");
+		}
+	}
+
+	if (size - headerSize < std::size_t (width) * height * 3) {
+		throw std::runtime_error (path + ": truncated pixel data");
+	}
+
+	Image result;
+	result.width = width;
+	result.height = height;
+	result.pixel.resize (std::size_t (width) * height * 4);
+
+	const std::size_t bandRows = RowsPerBand (width, height, pool);
+	std::vector<std::future<void>> bands;
+
+	for (std::size_t first = 0; first < std::size_t (height); first += bandRows) {
+		const std::size_t begin = first * width;
+		const std::size_t end = std::min (std::size_t (height), first + bandRows) * width;
+		char* const pixels = result.pixel.data ();
+		const int file = fd.Get ();
+
+		bands.push_back (pool.Submit ([=, &path] () {
+			for (std::size_t block = begin; block < end; block += ConvertBlock) {
+				const std::size_t count = std::min (ConvertBlock, end - block);
+
+				// Read the RGB data into the tail of the block's RGBA range,
+				// then expand front to back. Destination 4i never passes
+				// source count + 3i, so this is safe in place.
+				char* const rgba = pixels + block * 4;
+				char* const rgb = rgba + count;
+				PReadAll (file, rgb, count * 3, headerSize + block * 3, path);
+
+				for (std::size_t i = 0; i < count; ++i) {
+					rgba [4 * i + 0] = rgb [3 * i + 0];
+					rgba [4 * i + 1] = rgb [3 * i + 1];
+					rgba [4 * i + 2] = rgb [3 * i + 2];
+					rgba [4 * i + 3] = 0;
+				}
+			}
+		}));
+	}
+
+	WaitAll (bands);
+
+	return result;
+}
+
+void SaveImageRGBA (const Image& img, const std::string& path, ThreadPool& pool)
+{
+	TraceSpan span ("SaveImageRGBA");
+	FileDescriptor fd (OpenForWrite (path));
+
+	const std::string header = FormatPPMHeader (img.width, img.height);
+	const std::size_t pixelCount = std::size_t (img.width) * img.height;
+
+	// Size the file up front so the bands can be written in any order
+	if (ftruncate (fd.Get (), header.size () + pixelCount * 3) != 0) {
+		throw MakeError (path);
+	}
+	PWriteAll (fd.Get (), header.data (), header.size (), 0, path);
+
+	const std::size_t bandRows = RowsPerBand (img.width, img.height, pool);
+	std::vector<std::future<void>> bands;
+
+	for (std::size_t first = 0; first < std::size_t (img.height); first += bandRows) {
+		const std::size_t begin = first * img.width;
+		const std::size_t end = std::min (std::size_t (img.height), first + bandRows) * img.width;
+		const char* const pixels = img.pixel.data ();
+		const std::size_t headerSize = header.size ();
+		const int file = fd.Get ();
+
+		bands.push_back (pool.Submit ([=, &path] () {
+			std::vector<char> rgb (ConvertBlock * 3);
+
+			for (std::size_t block = begin; block < end; block += ConvertBlock) {
+				const std::size_t count = std::min (ConvertBlock, end - block);
+				const char* const rgba = pixels + block * 4;
+
+				for (std::size_t i = 0; i < count; ++i) {
+					rgb [3 * i + 0] = rgba [4 * i + 0];
+					rgb [3 * i + 1] = rgba [4 * i + 1];
+					rgb [3 * i + 2] = rgba [4 * i + 2];
+				}
+
+				PWriteAll (file, rgb.data (), count * 3, headerSize + block * 3, path);
+			}
+		}));
+	}
+
+	WaitAll (bands);
+}
+
+Prefetcher::Prefetcher (BatchIO& io, const std::vector<std::string>& paths,
+	std::size_t depth)
+	: io_ (io), paths_ (paths), depth_ (depth ? depth : 1), issued_ (0)
+{
+	Fill ();
+}
+
+Image Prefetcher::Next ()
+{
+	std::future<Image> next = std::move (pending_.front ());
+	pending_.pop_front ();
+	Fill ();
+
+	// Any time spent here is the device waiting for input
+	TraceSpan span ("WaitForInput");
+	return next.get ();
+}
+
+void Prefetcher::Fill ()
+{
+	while (pending_.size () < depth_ && issued_ < paths_.size ()) {
+		pending_.push_back (io_.Read (paths_ [issued_++]));
+	}
+}
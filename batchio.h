@@ -0,0 +1,68 @@
+#ifndef CLTUT_BATCHIO_H
+#define CLTUT_BATCHIO_H
+
+#include "image.h"
+
+class ThreadPool;
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Asynchronous whole-file PPM reader/writer which keeps many requests in
+// flight at once. Failures are reported as exceptions through the futures.
+class BatchIO
+{
+public:
+	virtual ~BatchIO () {}
+
+	// Reads a PPM file, the resulting image is RGB
+	virtual std::future<Image> Read (const std::string& path) = 0;
+
+	// Writes an RGB image as PPM
+	virtual std::future<void> Write (const std::string& path, Image image) = 0;
+
+	virtual const char* Name () const = 0;
+};
+
+// Returns the io_uring backend if it was compiled in and the kernel supports
+// it, otherwise a pread/pwrite backend running on a pool of queueDepth threads
+std::unique_ptr<BatchIO> CreateBatchIO (std::size_t queueDepth);
+
+// Keeps reads for the next depth files of a list in flight, so loading
+// overlaps with whatever the caller does with the current image
+class Prefetcher
+{
+public:
+	Prefetcher (BatchIO& io, const std::vector<std::string>& paths,
+		std::size_t depth);
+
+	bool Done () const
+	{
+		return pending_.empty ();
+	}
+
+	// Blocks until the next image in list order is loaded
+	Image Next ();
+
+private:
+	void Fill ();
+
+	BatchIO& io_;
+	std::vector<std::string> paths_;
+	std::size_t depth_;
+	std::size_t issued_;
+	std::deque<std::future<Image>> pending_;
+};
+
+// Chunked single-image I/O for very large files. The pixel payload is split
+// into row bands that the pool's threads pread/pwrite concurrently, with the
+// RGB <-> RGBA conversion done on each block right after it was transferred.
+//
+// LoadImageRGBA returns an RGBA image, SaveImageRGBA takes one and writes RGB.
+Image LoadImageRGBA (const std::string& path, ThreadPool& pool);
+void SaveImageRGBA (const Image& img, const std::string& path, ThreadPool& pool);
+
+#endif
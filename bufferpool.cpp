@@ -0,0 +1,141 @@
+#include "bufferpool.h"
+#include "memorybudget.h"
+
+#include <utility>
+
+BufferPool::Lease::Lease ()
+	: pool_ (nullptr)
+{
+}
+
+BufferPool::Lease::Lease (BufferPool* pool, const Key& key, CLMem mem)
+	: pool_ (pool), key_ (key), mem_ (std::move (mem))
+{
+}
+
+BufferPool::Lease::~Lease ()
+{
+	if (pool_ && mem_) {
+		pool_->Return (key_, std::move (mem_));
+	}
+}
+
+BufferPool::Lease::Lease (Lease&& other)
+	: pool_ (other.pool_), key_ (other.key_), mem_ (std::move (other.mem_))
+{
+	other.pool_ = nullptr;
+}
+
+BufferPool::Lease& BufferPool::Lease::operator= (Lease&& other)
+{
+	if (this != &other) {
+		if (pool_ && mem_) {
+			pool_->Return (key_, std::move (mem_));
+		}
+
+		pool_ = other.pool_;
+		key_ = other.key_;
+		mem_ = std::move (other.mem_);
+		other.pool_ = nullptr;
+	}
+	return *this;
+}
+
+BufferPool::BufferPool (cl_context context, std::size_t capacity,
+	MemoryBudget* budget)
+	: context_ (context), capacity_ (capacity), size_ (0), allocated_ (0),
+	budget_ (budget)
+{
+}
+
+BufferPool::Lease BufferPool::Buffer (cl_mem_flags flags, std::size_t size)
+{
+	const Key key (flags, size, 0, 0);
+	CLMem mem = Take (key);
+	if (!mem) {
+		Reserve (size);
+		try {
+			mem = CreateBuffer (context_, flags, size, nullptr);
+		} catch (...) {
+			Release (size);
+			throw;
+		}
+	}
+
+	return Lease (this, key, std::move (mem));
+}
+
+BufferPool::Lease BufferPool::Image2D (cl_mem_flags flags, int width, int height)
+{
+	const Key key (flags, std::size_t (width) * height * 4, width, height);
+	CLMem mem = Take (key);
+	if (!mem) {
+		Reserve (std::get<1> (key));
+		try {
+			mem = CreateImage2D (context_, flags, width, height, nullptr);
+		} catch (...) {
+			Release (std::get<1> (key));
+			throw;
+		}
+	}
+
+	return Lease (this, key, std::move (mem));
+}
+
+void BufferPool::Clear ()
+{
+	free_.clear ();
+	Release (size_);
+	size_ = 0;
+}
+
+CLMem BufferPool::Take (const Key& key)
+{
+	const auto entry = free_.find (key);
+	if (entry == free_.end ()) {
+		return CLMem ();
+	}
+
+	CLMem mem = std::move (entry->second);
+	free_.erase (entry);
+	size_ -= std::get<1> (key);
+	return mem;
+}
+
+void BufferPool::Return (const Key& key, CLMem mem)
+{
+	// Dropping mem releases it
+	if (size_ + std::get<1> (key) > capacity_) {
+		Release (std::get<1> (key));
+		return;
+	}
+
+	free_.insert (std::make_pair (key, std::move (mem)));
+	size_ += std::get<1> (key);
+}
+
+void BufferPool::Reserve (std::size_t bytes)
+{
+	if (budget_ && !budget_->Fits (bytes) && !free_.empty ()) {
+		Clear ();
+	}
+
+	if (budget_) {
+		budget_->Reserve (bytes);
+	}
+	allocated_ += bytes;
+}
+
+void BufferPool::Release (std::size_t bytes)
+{
+	if (budget_) {
+		budget_->Release (bytes);
+	}
+	allocated_ -= bytes;
+}
+
+void SetKernelArg (cl_kernel kernel, cl_uint index, const BufferPool::Lease& value)
+{
+	const cl_mem handle = value.Get ();
+	SetKernelArg (kernel, index, handle);
+}
@@ -0,0 +1,102 @@
+#ifndef CLTUT_BUFFERPOOL_H
+#define CLTUT_BUFFERPOOL_H
+
+#include "clhandle.h"
+
+#include <cstddef>
+#include <map>
+#include <tuple>
+
+class MemoryBudget;
+
+// Keeps the device memory objects of earlier calls and hands them out again
+// to later calls which need one of the same kind and size, so repeated
+// images of one size skip the allocations. Objects which would push the
+// pool over capacity bytes are released instead. With a budget, every new
+// object is reserved from it first; if that fails the pooled objects are
+// released and it is tried once more. Not thread safe.
+class BufferPool
+{
+	// Flags, size in bytes, and width and height for images (0 for buffers)
+	typedef std::tuple<cl_mem_flags, std::size_t, int, int> Key;
+
+public:
+	// A memory object taken from the pool, which goes back when destroyed
+	class Lease
+	{
+	public:
+		Lease ();
+		Lease (BufferPool* pool, const Key& key, CLMem mem);
+		~Lease ();
+
+		Lease (Lease&& other);
+		Lease& operator= (Lease&& other);
+
+		cl_mem Get () const
+		{
+			return mem_;
+		}
+
+		operator cl_mem () const
+		{
+			return mem_;
+		}
+
+	private:
+		BufferPool* pool_;
+		Key key_;
+		CLMem mem_;
+	};
+
+	BufferPool (cl_context context, std::size_t capacity,
+		MemoryBudget* budget = nullptr);
+
+	BufferPool (const BufferPool&) = delete;
+	BufferPool& operator= (const BufferPool&) = delete;
+
+	Lease Buffer (cl_mem_flags flags, std::size_t size);
+
+	// An RGBA image, see CreateImage2D
+	Lease Image2D (cl_mem_flags flags, int width, int height);
+
+	// Releases every pooled object, e.g. when the device ran out of memory
+	void Clear ();
+
+	cl_context Context () const
+	{
+		return context_;
+	}
+
+	// Bytes held by objects which are currently not leased
+	std::size_t Size () const
+	{
+		return size_;
+	}
+
+	// Bytes of all objects the pool created which are still alive, leased
+	// or not
+	std::size_t Allocated () const
+	{
+		return allocated_;
+	}
+
+private:
+	CLMem Take (const Key& key);
+	void Return (const Key& key, CLMem mem);
+
+	// Count bytes of objects being created and released in allocated_ and
+	// the budget
+	void Reserve (std::size_t bytes);
+	void Release (std::size_t bytes);
+
+	cl_context context_;
+	std::size_t capacity_;
+	std::size_t size_;
+	std::size_t allocated_;
+	MemoryBudget* budget_;
+	std::multimap<Key, CLMem> free_;
+};
+
+void SetKernelArg (cl_kernel kernel, cl_uint index, const BufferPool::Lease& value);
+
+#endif
@@ -0,0 +1,147 @@
+#include "clhandle.h"
+
+CLError::CLError (cl_int code)
+	: std::runtime_error ("OpenCL call failed with error " + std::to_string (code)),
+	code_ (code)
+{
+}
+
+bool CLError::IsResourceExhaustion () const
+{
+	switch (code_) {
+	case CL_OUT_OF_RESOURCES:
+	case CL_OUT_OF_HOST_MEMORY:
+	case CL_MEM_OBJECT_ALLOCATION_FAILURE:
+	// Reported when a buffer or image exceeds the device's maximum size
+	case CL_INVALID_BUFFER_SIZE:
+	case CL_INVALID_IMAGE_SIZE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void CheckError (cl_int error)
+{
+	if (error != CL_SUCCESS) {
+		throw CLError (error);
+	}
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateCommandQueue.html
+CLCommandQueue CreateCommandQueue (cl_context context, cl_device_id device,
+	cl_command_queue_properties properties)
+{
+	cl_int error = CL_SUCCESS;
+	CLCommandQueue queue (clCreateCommandQueue (context, device, properties, &error));
+	CheckError (error);
+	return queue;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateKernel.html
+CLKernel CreateKernel (cl_program program, const char* name)
+{
+	cl_int error = CL_SUCCESS;
+	CLKernel kernel (clCreateKernel (program, name, &error));
+	CheckError (error);
+	return kernel;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateBuffer.html
+CLMem CreateBuffer (cl_context context, cl_mem_flags flags, std::size_t size,
+	const void* hostData)
+{
+	cl_int error = CL_SUCCESS;
+	CLMem buffer (clCreateBuffer (context, flags, size,
+		const_cast<void*> (hostData), &error));
+	CheckError (error);
+	return buffer;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateImage2D.html
+CLMem CreateImage2D (cl_context context, cl_mem_flags flags, int width,
+	int height, const void* hostData)
+{
+	static const cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+
+	cl_int error = CL_SUCCESS;
+	CLMem image (clCreateImage2D (context, flags, &format, width, height, 0,
+		// This is a bug in the spec
+		const_cast<void*> (hostData),
+		&error));
+	CheckError (error);
+	return image;
+}
+
+CLProgram CreateProgram (const std::string& source,
+	cl_context context)
+{
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateProgramWithSource.html
+	size_t lengths [1] = { source.size () };
+	const char* sources [1] = { source.data () };
+
+	cl_int error = 0;
+	CLProgram program (clCreateProgramWithSource (context, 1, sources, lengths, &error));
+	CheckError (error);
+
+	return program;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetPlatformIDs.html
+std::vector<cl_platform_id> GetPlatformIds ()
+{
+	// The ICD loader reports an error rather than a count of zero
+	cl_uint platformIdCount = 0;
+	if (clGetPlatformIDs (0, nullptr, &platformIdCount) != CL_SUCCESS) {
+		return std::vector<cl_platform_id> ();
+	}
+
+	std::vector<cl_platform_id> platformIds (platformIdCount);
+	if (platformIdCount > 0) {
+		CheckError (clGetPlatformIDs (platformIdCount, platformIds.data (), nullptr));
+	}
+	return platformIds;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetDeviceIDs.html
+std::vector<cl_device_id> GetDeviceIds (cl_platform_id platform)
+{
+	cl_uint deviceIdCount = 0;
+	if (clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, 0, nullptr,
+		&deviceIdCount) != CL_SUCCESS) {
+		return std::vector<cl_device_id> ();
+	}
+
+	std::vector<cl_device_id> deviceIds (deviceIdCount);
+	if (deviceIdCount > 0) {
+		CheckError (clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, deviceIdCount,
+			deviceIds.data (), nullptr));
+	}
+	return deviceIds;
+}
+
+std::string GetPlatformName (cl_platform_id id)
+{
+	size_t size = 0;
+	CheckError (clGetPlatformInfo (id, CL_PLATFORM_NAME, 0, nullptr, &size));
+
+	std::string result;
+	result.resize (size);
+	CheckError (clGetPlatformInfo (id, CL_PLATFORM_NAME, size,
+		const_cast<char*> (result.data ()), nullptr));
+
+	return result;
+}
+
+std::string GetDeviceName (cl_device_id id)
+{
+	size_t size = 0;
+	CheckError (clGetDeviceInfo (id, CL_DEVICE_NAME, 0, nullptr, &size));
+
+	std::string result;
+	result.resize (size);
+	CheckError (clGetDeviceInfo (id, CL_DEVICE_NAME, size,
+		const_cast<char*> (result.data ()), nullptr));
+
+	return result;
+}
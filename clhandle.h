@@ -0,0 +1,184 @@
+#ifndef CLTUT_CLHANDLE_H
+#define CLTUT_CLHANDLE_H
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+	#include "OpenCL/opencl.h"
+#else
+	#include "CL/cl.h"
+#endif
+
+// Thrown for every OpenCL call that does not return CL_SUCCESS
+class CLError : public std::runtime_error
+{
+public:
+	explicit CLError (cl_int code);
+
+	cl_int Code () const
+	{
+		return code_;
+	}
+
+	// True for the errors that can go away when the same work is retried
+	// with less device memory, for example with smaller tiles
+	bool IsResourceExhaustion () const;
+
+private:
+	cl_int code_;
+};
+
+// Throws a CLError if error is not CL_SUCCESS
+void CheckError (cl_int error);
+
+template <typename T>
+struct CLTraits;
+
+template <>
+struct CLTraits<cl_context>
+{
+	static void Release (cl_context handle) { clReleaseContext (handle); }
+};
+
+template <>
+struct CLTraits<cl_command_queue>
+{
+	static void Release (cl_command_queue handle) { clReleaseCommandQueue (handle); }
+};
+
+template <>
+struct CLTraits<cl_program>
+{
+	static void Release (cl_program handle) { clReleaseProgram (handle); }
+};
+
+template <>
+struct CLTraits<cl_kernel>
+{
+	static void Release (cl_kernel handle) { clReleaseKernel (handle); }
+};
+
+template <>
+struct CLTraits<cl_mem>
+{
+	static void Release (cl_mem handle) { clReleaseMemObject (handle); }
+};
+
+template <>
+struct CLTraits<cl_event>
+{
+	static void Release (cl_event handle) { clReleaseEvent (handle); }
+};
+
+// Owns one reference to an OpenCL object and releases it when destroyed.
+// Converts to the raw handle, so it can be passed to the cl* functions
+// directly.
+template <typename T>
+class CLHandle
+{
+public:
+	CLHandle ()
+		: handle_ (nullptr)
+	{
+	}
+
+	explicit CLHandle (T handle)
+		: handle_ (handle)
+	{
+	}
+
+	~CLHandle ()
+	{
+		Reset ();
+	}
+
+	CLHandle (CLHandle&& other)
+		: handle_ (other.Release ())
+	{
+	}
+
+	CLHandle& operator= (CLHandle&& other)
+	{
+		if (this != &other) {
+			Reset (other.Release ());
+		}
+		return *this;
+	}
+
+	CLHandle (const CLHandle&) = delete;
+	CLHandle& operator= (const CLHandle&) = delete;
+
+	T Get () const
+	{
+		return handle_;
+	}
+
+	operator T () const
+	{
+		return handle_;
+	}
+
+	// Gives up ownership without releasing
+	T Release ()
+	{
+		T handle = handle_;
+		handle_ = nullptr;
+		return handle;
+	}
+
+	void Reset (T handle = nullptr)
+	{
+		if (handle_) {
+			CLTraits<T>::Release (handle_);
+		}
+		handle_ = handle;
+	}
+
+private:
+	T handle_;
+};
+
+typedef CLHandle<cl_context> CLContext;
+typedef CLHandle<cl_command_queue> CLCommandQueue;
+typedef CLHandle<cl_program> CLProgram;
+typedef CLHandle<cl_kernel> CLKernel;
+typedef CLHandle<cl_mem> CLMem;
+typedef CLHandle<cl_event> CLEvent;
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clSetKernelArg.html
+template <typename T>
+void SetKernelArg (cl_kernel kernel, cl_uint index, const T& value)
+{
+	CheckError (clSetKernelArg (kernel, index, sizeof (T), &value));
+}
+
+template <typename T>
+void SetKernelArg (cl_kernel kernel, cl_uint index, const CLHandle<T>& value)
+{
+	const T handle = value.Get ();
+	SetKernelArg (kernel, index, handle);
+}
+
+CLCommandQueue CreateCommandQueue (cl_context context, cl_device_id device,
+	cl_command_queue_properties properties);
+CLKernel CreateKernel (cl_program program, const char* name);
+CLMem CreateBuffer (cl_context context, cl_mem_flags flags, std::size_t size,
+	const void* hostData);
+
+// An RGBA image with 8 bit channels, the format all image2d kernels use
+CLMem CreateImage2D (cl_context context, cl_mem_flags flags, int width,
+	int height, const void* hostData);
+
+CLProgram CreateProgram (const std::string& source, cl_context context);
+
+// Empty if there is no platform
+std::vector<cl_platform_id> GetPlatformIds ();
+std::vector<cl_device_id> GetDeviceIds (cl_platform_id platform);
+
+std::string GetPlatformName (cl_platform_id id);
+std::string GetDeviceName (cl_device_id id);
+
+#endif
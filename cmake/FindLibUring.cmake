@@ -0,0 +1,24 @@
+FIND_PATH(LIBURING_INCLUDE_DIR
+	NAMES
+		liburing.h)
+
+FIND_LIBRARY(
+    LIBURING_LIBRARY
+    NAMES uring)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(
+  LibUring
+  DEFAULT_MSG
+  LIBURING_LIBRARY LIBURING_INCLUDE_DIR)
+
+if(LIBURING_FOUND)
+  set(LIBURING_LIBRARIES ${LIBURING_LIBRARY})
+else(LIBURING_FOUND)
+  set(LIBURING_LIBRARIES)
+endif(LIBURING_FOUND)
+
+mark_as_advanced(
+  LIBURING_INCLUDE_DIR
+  LIBURING_LIBRARY
+  )
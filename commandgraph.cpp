@@ -0,0 +1,55 @@
+#include "commandgraph.h"
+
+#include <stdexcept>
+
+CommandGraph::CommandGraph (const std::vector<cl_command_queue>& queues)
+	: queues_ (queues), outOfOrder_ (false)
+{
+	if (queues_.empty ()) {
+		throw std::invalid_argument ("CommandGraph needs a queue");
+	}
+
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetCommandQueueInfo.html
+	if (queues_.size () == 1) {
+		cl_command_queue_properties properties = 0;
+		CheckError (clGetCommandQueueInfo (queues_ [0], CL_QUEUE_PROPERTIES,
+			sizeof (properties), &properties, nullptr));
+		outOfOrder_ = (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+	}
+}
+
+CommandGraph::~CommandGraph ()
+{
+	for (const cl_command_queue queue : queues_) {
+		clFinish (queue);
+	}
+}
+
+CommandGraph::Node CommandGraph::Add (std::size_t lane,
+	const std::vector<Node>& after, const Command& command)
+{
+	std::vector<cl_event> waitList;
+	for (const Node node : after) {
+		waitList.push_back (events_ [node]);
+	}
+
+	cl_event event = nullptr;
+	command (queues_ [lane % queues_.size ()], static_cast<cl_uint> (waitList.size ()),
+		waitList.empty () ? nullptr : waitList.data (), &event);
+
+	events_.push_back (CLEvent (event));
+	return events_.size () - 1;
+}
+
+void CommandGraph::Finish ()
+{
+	// A queue only has to start its commands once they are flushed, and a
+	// command waiting on another queue's event could wait forever otherwise
+	for (const cl_command_queue queue : queues_) {
+		CheckError (clFlush (queue));
+	}
+
+	for (const cl_command_queue queue : queues_) {
+		CheckError (clFinish (queue));
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef CLTUT_COMMANDGRAPH_H
+#define CLTUT_COMMANDGRAPH_H
+
+#include "clhandle.h"
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Enqueues commands with explicit dependencies between them, so that
+// independent ones (the uploads, kernels and readbacks of different tiles)
+// may overlap. The queues are either one out-of-order queue, or in-order
+// queues which the commands are spread over by lane; each dependency
+// becomes an event in the wait list of the command, which also works
+// across queues. A single in-order queue runs everything in order, as
+// before.
+class CommandGraph
+{
+public:
+	typedef std::size_t Node;
+
+	// Enqueues a command on queue, waiting for the given events and
+	// returning its own in event
+	typedef std::function<void (cl_command_queue queue, cl_uint waitCount,
+		const cl_event* waitList, cl_event* event)> Command;
+
+	explicit CommandGraph (const std::vector<cl_command_queue>& queues);
+
+	// Waits for the queues, so memory the commands use may be released
+	// after the graph even if Finish was never reached
+	~CommandGraph ();
+
+	CommandGraph (const CommandGraph&) = delete;
+	CommandGraph& operator= (const CommandGraph&) = delete;
+
+	// True if commands may run concurrently, which is what extra memory
+	// for commands in flight is worth spending on
+	bool Concurrent () const
+	{
+		return queues_.size () > 1 || outOfOrder_;
+	}
+
+	// Enqueues command after the given nodes. Commands of one lane go to
+	// the same queue, so a chain of dependent commands should share a lane.
+	Node Add (std::size_t lane, const std::vector<Node>& after, const Command& command);
+
+	// The event of a node, owned by the graph
+	cl_event Event (Node node) const
+	{
+		return events_ [node];
+	}
+
+	// Submits everything and waits until all commands completed
+	void Finish ();
+
+private:
+	std::vector<cl_command_queue> queues_;
+	bool outOfOrder_;
+	std::vector<CLEvent> events_;
+};
+
+#endif
@@ -0,0 +1,807 @@
+#include "engine.h"
+
+#include "hash.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+bool IsRGB (const Image& image)
+{
+	return image.pixel.size () == std::size_t (image.width) * image.height * 3;
+}
+
+std::string LoadKernel (const std::string& name)
+{
+	std::ifstream in (name);
+	if (!in) {
+		throw std::runtime_error (name + ": cannot open kernel source");
+	}
+
+	std::string result (
+		(std::istreambuf_iterator<char> (in)),
+		std::istreambuf_iterator<char> ());
+	return result;
+}
+
+cl_platform_id SelectPlatform (std::size_t index)
+{
+	const std::vector<cl_platform_id> platformIds = GetPlatformIds ();
+	if (platformIds.empty ()) {
+		throw std::runtime_error ("No OpenCL platform found");
+	}
+
+	if (index >= platformIds.size ()) {
+		throw std::runtime_error ("There is no OpenCL platform "
+			+ std::to_string (index + 1));
+	}
+
+	return platformIds [index];
+}
+
+std::vector<cl_device_id> AllDevices (cl_platform_id platform,
+	std::size_t deviceIndex)
+{
+	std::vector<cl_device_id> deviceIds = GetDeviceIds (platform);
+	if (deviceIds.empty ()) {
+		throw std::runtime_error ("No OpenCL devices found");
+	}
+
+	if (deviceIndex >= deviceIds.size ()) {
+		throw std::runtime_error ("There is no OpenCL device "
+			+ std::to_string (deviceIndex + 1));
+	}
+
+	return deviceIds;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateContext.html
+CLContext CreateContext (cl_platform_id platform,
+	const std::vector<cl_device_id>& devices)
+{
+	const cl_context_properties contextProperties [] =
+	{
+		CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties> (platform),
+		0, 0
+	};
+
+	cl_int error = CL_SUCCESS;
+	CLContext context (clCreateContext (contextProperties,
+		static_cast<cl_uint> (devices.size ()), devices.data (),
+		nullptr, nullptr, &error));
+	CheckError (error);
+
+	return context;
+}
+
+// Tile size of multiDevice frames which neither the parameters nor the
+// memory budget split. Small enough for a few tiles per device even in
+// small frames, large enough to keep a launch busy.
+const int DeviceTileSize = 256;
+
+// Device bytes per pixel in each of the input and output buffers of path,
+// for the memory budget. The separable filter's float4 intermediate is
+// split between the two.
+std::size_t PathPixelBytes (FilterPath path)
+{
+	switch (path) {
+	case BufferFloatPath: return 4 * sizeof (cl_float);
+	case SeparablePath: return 4 + 2 * sizeof (cl_float);
+	default: return 4;
+	}
+}
+}
+
+FilterParams::FilterParams ()
+	: borderMode (0), path (ImagePath), planar (false), vectorWidth (8),
+	tileSize (0)
+{
+	localSize [0] = localSize [1] = 0;
+
+	// Simple Gaussian blur filter
+	const float filter [] = {
+		1, 2, 1,
+		2, 4, 2,
+		1, 2, 1
+	};
+
+	// Normalize the filter
+	for (const float weight : filter) {
+		weights.push_back (weight / 16.0f);
+	}
+}
+
+int FilterParams::FilterSize () const
+{
+	int side = 1;
+	while (std::size_t (side) * side < weights.size ()) {
+		side += 2;
+	}
+
+	if (std::size_t (side) * side != weights.size ()) {
+		throw std::invalid_argument ("The filter needs an odd square number of weights");
+	}
+
+	return side / 2;
+}
+
+std::vector<float> GaussianWeights (double sigma, int radius)
+{
+	const int side = 2 * radius + 1;
+	std::vector<float> weights (std::size_t (side) * side);
+
+	double sum = 0;
+	for (int y = -radius; y <= radius; ++y) {
+		for (int x = -radius; x <= radius; ++x) {
+			const double weight = std::exp (-(x * x + y * y) / (2 * sigma * sigma));
+			weights [(y + radius) * side + x + radius] = static_cast<float> (weight);
+			sum += weight;
+		}
+	}
+
+	for (auto& weight : weights) {
+		weight = static_cast<float> (weight / sum);
+	}
+
+	return weights;
+}
+
+std::vector<float> LoadWeights (const std::string& path)
+{
+	std::ifstream in (path);
+	if (!in) {
+		throw std::runtime_error (path + ": cannot open weights file");
+	}
+
+	std::vector<float> weights;
+	float weight;
+	while (in >> weight) {
+		weights.push_back (weight);
+	}
+
+	if (!in.eof ()) {
+		throw std::runtime_error (path + ": weights must be numbers");
+	}
+
+	return weights;
+}
+
+EngineOptions::EngineOptions ()
+	: kernelPath ("kernels/image.cl"), platformIndex (0), deviceIndex (0),
+	profiling (false), outOfOrder (false), multiDevice (false), hostThreads (0), poolCapacity (256 << 20), memoryBudget (0), tileCacheSize (0),
+	cacheTileSize (64)
+{
+}
+
+Engine::Instruments::Instruments (MetricsRegistry& registry)
+	: frames (registry.GetCounter ("clfilter_frames_total",
+		"Images filtered")),
+	bytesIn (registry.GetCounter ("clfilter_bytes_in_total",
+		"Pixel bytes of the filtered images")),
+	bytesOut (registry.GetCounter ("clfilter_bytes_out_total",
+		"Pixel bytes of the filter results")),
+	filterLatency (registry.GetHistogram ("clfilter_stage_seconds",
+		"Seconds spent in each stage of an image", "stage=\"filter\"")),
+	queueLatency (registry.GetHistogram ("clfilter_stage_seconds",
+		"Seconds spent in each stage of an image", "stage=\"queue\"")),
+	batchLatency (registry.GetHistogram ("clfilter_stage_seconds",
+		"Seconds spent in each stage of an image", "stage=\"batch\"")),
+	queueDepth (registry.GetGauge ("clfilter_queue_depth",
+		"FilterAsync calls which have not started yet")),
+	programHits (registry.GetCounter ("clfilter_program_cache_hits_total",
+		"Filter calls which reused a built program")),
+	programMisses (registry.GetCounter ("clfilter_program_cache_misses_total",
+		"Programs built")),
+	poolFree (registry.GetGauge ("clfilter_pool_free_bytes",
+		"Device memory kept in the buffer pool for reuse")),
+	deviceMemory (registry.GetGauge ("clfilter_device_memory_bytes",
+		"Device memory allocated through the buffer pool, leased or not")),
+	deviceMemoryPeak (registry.GetGauge ("clfilter_device_memory_peak_bytes",
+		"Most device memory allocated through the buffer pool at once")),
+	budgetTiledFrames (registry.GetCounter ("clfilter_budget_tiled_frames_total",
+		"Frames filtered in tiles because they did not fit the memory budget whole"))
+{
+}
+
+Engine::Engine (const EngineOptions& options)
+	: options_ (options),
+	instruments_ (metrics_),
+	platform_ (SelectPlatform (options.platformIndex)),
+	devices_ (AllDevices (platform_, options.deviceIndex)),
+	context_ (CreateContext (platform_, devices_)),
+	// All work goes to the selected device's queue
+	queue_ (CreateCommandQueue (context_, devices_ [options.deviceIndex],
+		options.profiling ? CL_QUEUE_PROFILING_ENABLE : 0)),
+	source_ (LoadKernel (options.kernelPath)),
+	budget_ (GetDeviceMemoryLimits (devices_ [options.deviceIndex]), options.memoryBudget),
+	pool_ (context_, options.poolCapacity, &budget_),
+	tileCache_ (options.tileCacheSize),
+	tileDeviceTime_ (0),
+	variants_ (options.variantCache),
+	outOfOrderQueue_ (false),
+	hostPool_ (options.hostThreads ? options.hostThreads
+		: std::thread::hardware_concurrency ()),
+	worker_ (1)
+{
+	const cl_command_queue_properties profiling =
+		options.profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+
+	if (options.outOfOrder) {
+		// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetDeviceInfo.html
+		cl_command_queue_properties supported = 0;
+		CheckError (clGetDeviceInfo (Device (), CL_DEVICE_QUEUE_PROPERTIES,
+			sizeof (supported), &supported, nullptr));
+		outOfOrderQueue_ = (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+		// One queue per tile in flight is enough for all of them to overlap
+		const std::size_t queueCount = outOfOrderQueue_ ? 1 : 3;
+		for (std::size_t i = 0; i < queueCount; ++i) {
+			tileQueueHandles_.push_back (CreateCommandQueue (context_, Device (),
+				profiling | (outOfOrderQueue_ ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0)));
+			tileQueues_.push_back (tileQueueHandles_.back ());
+		}
+	} else {
+		tileQueues_.push_back (queue_);
+	}
+
+	for (std::size_t i = 0; i < devices_.size (); ++i) {
+		deviceTiles_.push_back (&metrics_.GetCounter ("clfilter_device_tiles_total",
+			"Tiles filtered on each device of a multi-device engine",
+			"device=\"" + std::to_string (i) + "\""));
+
+		// The other devices are not profiled, the profiler follows the
+		// selected device's clock
+		if (options.multiDevice && i != options.deviceIndex) {
+			deviceQueues_.push_back (CreateCommandQueue (context_, devices_ [i], 0));
+			devicePools_.emplace_back (new BufferPool (context_, options.poolCapacity));
+		} else {
+			deviceQueues_.push_back (CLCommandQueue ());
+			devicePools_.emplace_back ();
+		}
+	}
+
+	if (options.profiling) {
+		profiler_.Synchronize (Device ());
+	}
+}
+
+void Engine::Filter (const Image& source, Image& destination,
+	const FilterParams& params)
+{
+	TraceSpan span ("Filter");
+	const bool rgb = IsRGB (source);
+
+	if (rgb && params.planar) {
+		std::lock_guard<std::mutex> lock (mutex_);
+		ScopedLatency latency (instruments_.filterLatency);
+		Program& program = GetProgram (params);
+
+		destination = FilterImagePlanar (pool_, queue_, program.planar,
+			params.vectorWidth, source);
+		RecordFrame (source.pixel.size ());
+		profiler_.Collect ();
+		return;
+	}
+
+	// OpenCL only supports RGBA, so we need to convert here. Without the
+	// lock, so the conversions overlap with the device work of other calls.
+	const Image converted = rgb ? RGBtoRGBA (source, hostPool_) : Image ();
+	Image result = FilterRGBA (rgb ? converted : source, params, source.pixel.size ());
+
+	destination = rgb ? RGBAtoRGB (result, hostPool_) : std::move (result);
+}
+
+void Engine::FilterBatch (const std::vector<Image>& sources,
+	std::vector<Image>& destinations, const FilterParams& params)
+{
+	TraceSpan span ("FilterBatch");
+
+	std::vector<bool> rgb (sources.size ());
+	std::vector<Image> rgba;
+	rgba.reserve (sources.size ());
+	for (std::size_t i = 0; i < sources.size (); ++i) {
+		rgb [i] = IsRGB (sources [i]);
+		rgba.push_back (rgb [i] ? RGBtoRGBA (sources [i], hostPool_) : sources [i]);
+	}
+
+	std::vector<Image> results;
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		ScopedLatency latency (instruments_.batchLatency);
+		Program& program = GetProgram (params);
+
+		// The whole batch shares one input and one output buffer, so only
+		// as many images as fit the budget and a single allocation go in
+		// at once
+		int width = 1, height = 1;
+		for (const Image& image : rgba) {
+			width = std::max (width, image.width);
+			height = std::max (height, image.height);
+		}
+		FilterParams bufferParams = params;
+		bufferParams.path = BufferPath;
+		const std::size_t imageBytes = std::size_t (width) * height * 4;
+		const std::size_t chunk = std::max<std::size_t> (1, std::min (
+			PlanFrame (width, height, bufferParams, program).framesInFlight,
+			budget_.Limits ().maxAllocSize / imageBytes));
+
+		for (std::size_t begin = 0; begin < rgba.size (); begin += chunk) {
+			const std::vector<Image> part (rgba.begin () + begin,
+				rgba.begin () + std::min (rgba.size (), begin + chunk));
+			for (Image& result : FilterImageBatch (pool_, queue_, program.filter, part)) {
+				results.push_back (std::move (result));
+			}
+		}
+
+		for (const Image& source : sources) {
+			RecordFrame (source.pixel.size ());
+		}
+		profiler_.Collect ();
+	}
+
+	destinations.resize (sources.size ());
+	for (std::size_t i = 0; i < sources.size (); ++i) {
+		destinations [i] = rgb [i] ? RGBAtoRGB (results [i], hostPool_) : std::move (results [i]);
+	}
+}
+
+std::future<void> Engine::FilterAsync (const Image& source, Image& destination,
+	const FilterParams& params)
+{
+	const auto queued = std::chrono::steady_clock::now ();
+	instruments_.queueDepth.Add (1);
+
+	const bool rgb = IsRGB (source);
+	if (rgb && params.planar) {
+		return worker_.Submit ([this, &source, &destination, params, queued] () {
+			instruments_.queueDepth.Add (-1);
+			instruments_.queueLatency.Record (std::chrono::steady_clock::now () - queued);
+			Filter (source, destination, params);
+		});
+	}
+
+	// A frame goes through three stages: the conversion to RGBA runs here,
+	// spread over the host pool, the device work on the worker thread and
+	// the conversion back on the host pool again. The worker thread only
+	// submits to the device, so the conversions of one frame overlap with
+	// the device work of the others.
+	auto done = std::make_shared<std::promise<void>> ();
+	std::future<void> result = done->get_future ();
+
+	std::shared_ptr<const Image> rgba;
+	try {
+		rgba = std::make_shared<const Image> (rgb ? RGBtoRGBA (source, hostPool_) : Image ());
+	} catch (...) {
+		instruments_.queueDepth.Add (-1);
+		done->set_exception (std::current_exception ());
+		return result;
+	}
+
+	worker_.Submit ([this, &source, &destination, params, queued, rgb, rgba, done] () {
+		TraceSpan span ("Filter");
+		instruments_.queueDepth.Add (-1);
+		instruments_.queueLatency.Record (std::chrono::steady_clock::now () - queued);
+
+		try {
+			auto filtered = std::make_shared<Image> (FilterRGBA (rgb ? *rgba : source,
+				params, source.pixel.size ()));
+			if (!rgb) {
+				destination = std::move (*filtered);
+				done->set_value ();
+				return;
+			}
+
+			hostPool_.Submit ([this, &destination, filtered, done] () {
+				try {
+					destination = RGBAtoRGB (*filtered, hostPool_);
+					done->set_value ();
+				} catch (...) {
+					done->set_exception (std::current_exception ());
+				}
+			});
+		} catch (...) {
+			done->set_exception (std::current_exception ());
+		}
+	});
+
+	return result;
+}
+
+#ifdef CLTUT_HAVE_COROUTINES
+Engine::FilterAwaitable Engine::Filter (const Image& source, const FilterParams& params)
+{
+	return FilterAwaitable (*this, source, params);
+}
+
+Engine::FilterAwaitable::FilterAwaitable (Engine& engine, const Image& source,
+	const FilterParams& params)
+	: engine_ (engine), source_ (source), params_ (params), rgb_ (false),
+	status_ (CL_COMPLETE)
+{
+}
+
+bool Engine::FilterAwaitable::await_suspend (std::coroutine_handle<> handle)
+{
+	handle_ = handle;
+	start_ = std::chrono::steady_clock::now ();
+	rgb_ = IsRGB (source_);
+
+	const bool planar = rgb_ && params_.planar;
+	bool enqueued = false;
+	try {
+		if (!planar) {
+			if (rgb_) {
+				rgba_ = RGBtoRGBA (source_, engine_.hostPool_);
+			}
+			const Image& rgba = rgb_ ? rgba_ : source_;
+
+			std::lock_guard<std::mutex> lock (engine_.mutex_);
+			Program& program = engine_.GetProgram (params_);
+			// EnqueueFilterImage knows the image and uchar buffer paths, the
+			// other variants go through the host pool below. The float buffer
+			// path converts on the host after the readback, which an event
+			// callback cannot do.
+			const bool enqueueable = params_.path == ImagePath
+				|| params_.path == BufferPath;
+			if (enqueueable && !engine_.options_.tileCacheSize
+				&& engine_.PlanFrame (rgba.width, rgba.height, params_, program).tileSize == 0) {
+				pending_ = EnqueueFilterImage (engine_.pool_, engine_.queue_,
+					program.filter, params_.path, rgba);
+
+				// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clSetEventCallback.html
+				CheckError (clSetEventCallback (pending_->done, CL_COMPLETE,
+					&FilterAwaitable::Completed, this));
+				enqueued = true;
+			}
+		}
+	} catch (...) {
+		// Commands which were enqueued still use pending_
+		if (pending_) {
+			const cl_event events [1] = { pending_->done };
+			clWaitForEvents (1, events);
+		}
+		error_ = std::current_exception ();
+		return false;
+	}
+
+	if (!enqueued) {
+		engine_.hostPool_.Submit ([this, planar] () {
+			try {
+				if (planar) {
+					engine_.Filter (source_, result_, params_);
+				} else {
+					result_ = engine_.FilterRGBA (rgb_ ? rgba_ : source_, params_,
+						source_.pixel.size ());
+				}
+			} catch (...) {
+				error_ = std::current_exception ();
+			}
+			handle_.resume ();
+		});
+	}
+
+	return true;
+}
+
+Image Engine::FilterAwaitable::await_resume ()
+{
+	if (pending_) {
+		std::lock_guard<std::mutex> lock (engine_.mutex_);
+		result_ = std::move (pending_->result);
+
+		// The leases go back to the pool, which wants the lock
+		pending_.reset ();
+		if (!error_ && status_ == CL_COMPLETE) {
+			engine_.instruments_.filterLatency.Record (std::chrono::steady_clock::now () - start_);
+			engine_.RecordFrame (source_.pixel.size ());
+		}
+		engine_.profiler_.Collect ();
+	}
+
+	if (error_) {
+		std::rethrow_exception (error_);
+	} else if (status_ != CL_COMPLETE) {
+		throw CLError (status_);
+	}
+
+	if (rgb_ && !params_.planar) {
+		return RGBAtoRGB (result_, engine_.hostPool_);
+	}
+	return std::move (result_);
+}
+
+void CL_CALLBACK Engine::FilterAwaitable::Completed (cl_event, cl_int status, void* data)
+{
+	// The callback runs on a thread of the OpenCL runtime, which must not
+	// be kept busy with the rest of the coroutine
+	FilterAwaitable* const self = static_cast<FilterAwaitable*> (data);
+	self->status_ = status;
+	self->engine_.hostPool_.Submit ([self] () {
+		self->handle_.resume ();
+	});
+}
+#endif
+
+FilterPath Engine::Calibrate (const Image& image, const FilterParams& params)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	Program& program = GetProgram (params);
+
+	// The calibration queues do not profile, so their commands must stay
+	// out of the profiler. GetProgram sets it again on the next call.
+	program.filter.launch.profiler = nullptr;
+
+	std::vector<FilterPath> devicePaths;
+	for (const cl_device_id device : devices_) {
+		const std::string key = VariantStore::Key (device, program.filter,
+			image.width, image.height);
+
+		FilterPath path = BufferPath;
+		if (variants_.Find (key, path)
+			&& !VariantConstraint (GetFilterVariant (path), device, program.filter)) {
+			std::cout << "Using " << FilterPathName (path) << " on "
+				<< GetDeviceName (device).c_str () << " from "
+				<< variants_.Path () << std::endl;
+		} else {
+			double time = 0;
+			path = CalibrateFilterPath (pool_, device, program.filter, image, &time);
+			variants_.Store (key, path, time);
+		}
+		devicePaths.push_back (path);
+	}
+
+	return devicePaths [options_.deviceIndex];
+}
+
+DevicePeaks Engine::MeasurePeaks (const FilterParams& params)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	const Program& program = GetProgram (params);
+
+	return ::MeasurePeaks (pool_, queue_, program.filter);
+}
+
+std::unique_ptr<RegionFilter> Engine::CreateRegionFilter (int width, int height,
+	const FilterParams& params)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	const Program& program = GetProgram (params);
+
+	return std::unique_ptr<RegionFilter> (new RegionFilter (context_, queue_,
+		program.filter, width, height));
+}
+
+const char* Engine::QueueMode () const
+{
+	if (outOfOrderQueue_) {
+		return "out-of-order queue";
+	}
+
+	return tileQueues_.size () > 1 ? "in-order queues" : "in-order queue";
+}
+
+const Profiler& Engine::Profile ()
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	profiler_.Collect ();
+	return profiler_;
+}
+
+Engine::Program& Engine::GetProgram (const FilterParams& params)
+{
+	const int filterSize = params.FilterSize ();
+	std::string buildOptions = "-D FILTER_SIZE=" + std::to_string (filterSize)
+		+ " -D VECTOR_WIDTH=" + std::to_string (params.vectorWidth)
+		+ " -D BORDER_MODE=" + std::to_string (params.borderMode)
+		+ " -D BLOCK_ROWS=" + std::to_string (BlockRows);
+
+	// The local tiled kernel only exists where every device of the context
+	// can run it, since the program is built for all of them
+	bool localTile = true;
+	for (const cl_device_id device : devices_) {
+		localTile = localTile && LocalTileFits (device, filterSize);
+	}
+	if (localTile) {
+		buildOptions += " -D LOCAL_TILE=" + std::to_string (LocalTileSize);
+	}
+
+	std::unique_ptr<Program>& entry = programs_ [buildOptions];
+	if (entry) {
+		instruments_.programHits.Add ();
+	} else {
+		TraceSpan span ("BuildProgram");
+		instruments_.programMisses.Add ();
+		std::unique_ptr<Program> program (new Program);
+		program->program = CreateProgram (source_, context_);
+		CheckError (clBuildProgram (program->program,
+			static_cast<cl_uint> (devices_.size ()), devices_.data (),
+			buildOptions.c_str (), nullptr, nullptr));
+
+		FilterKernels& filter = program->filter;
+		filter.filterSize = filterSize;
+		filter.borderMode = params.borderMode;
+		filter.image = CreateKernel (program->program, "Filter");
+		filter.imageInterior = CreateKernel (program->program, "FilterInterior");
+		filter.bufferInterior = CreateKernel (program->program, "FilterBufferInterior");
+		filter.buffer = CreateKernel (program->program, "FilterBuffer");
+		filter.bufferFloat = CreateKernel (program->program, "FilterBufferFloat");
+		filter.batch = CreateKernel (program->program, "FilterBatch");
+		filter.streamCopy = CreateKernel (program->program, "StreamCopy");
+		filter.peakFlops = CreateKernel (program->program, "PeakFlops");
+		filter.blocked = CreateKernel (program->program, "FilterBufferBlocked");
+		filter.rows = CreateKernel (program->program, "FilterRows");
+		filter.columns = CreateKernel (program->program, "FilterColumns");
+		if (localTile) {
+			filter.local = CreateKernel (program->program, "FilterBufferLocal");
+		}
+		filter.separable = false;
+
+		PlanarKernels& planar = program->planar;
+		planar.filterSize = filterSize;
+		planar.deinterleave = CreateKernel (program->program, "Deinterleave");
+		planar.filter = CreateKernel (program->program, "FilterPlanar");
+		planar.interleave = CreateKernel (program->program, "Interleave");
+
+		// The weights are filled in below, the first time the program is used
+		const std::size_t side = 2 * filterSize + 1;
+		program->weights = CreateBuffer (context_, CL_MEM_READ_ONLY,
+			sizeof (float) * params.weights.size (), nullptr);
+		program->rowWeights = CreateBuffer (context_, CL_MEM_READ_ONLY,
+			sizeof (float) * side, nullptr);
+		program->columnWeights = CreateBuffer (context_, CL_MEM_READ_ONLY,
+			sizeof (float) * side, nullptr);
+
+		SetKernelArg (filter.image, 1, program->weights);
+		SetKernelArg (filter.imageInterior, 1, program->weights);
+		SetKernelArg (filter.buffer, 1, program->weights);
+		SetKernelArg (filter.bufferInterior, 1, program->weights);
+		SetKernelArg (filter.bufferFloat, 1, program->weights);
+		SetKernelArg (filter.batch, 1, program->weights);
+		SetKernelArg (filter.blocked, 1, program->weights);
+		SetKernelArg (filter.rows, 1, program->rowWeights);
+		SetKernelArg (filter.columns, 1, program->columnWeights);
+		if (localTile) {
+			SetKernelArg (filter.local, 1, program->weights);
+		}
+		SetKernelArg (planar.filter, 1, program->weights);
+
+		// Kernel arguments are per kernel object, so every device's thread
+		// needs its own
+		program->deviceFilters.resize (devices_.size ());
+		for (std::size_t i = 0; i < devices_.size (); ++i) {
+			if (options_.multiDevice && i != options_.deviceIndex) {
+				std::unique_ptr<FilterKernels> kernels (new FilterKernels ());
+				kernels->filterSize = filterSize;
+				kernels->borderMode = params.borderMode;
+				kernels->bufferInterior = CreateKernel (program->program, "FilterBufferInterior");
+				SetKernelArg (kernels->bufferInterior, 1, program->weights);
+				program->deviceFilters [i] = std::move (kernels);
+			}
+		}
+
+		entry = std::move (program);
+	}
+
+	Program& program = *entry;
+	if (program.filter.weights != params.weights) {
+		CheckError (clEnqueueWriteBuffer (queue_, program.weights, CL_TRUE, 0,
+			sizeof (float) * params.weights.size (), params.weights.data (),
+			0, nullptr, nullptr));
+		program.filter.weights = params.weights;
+
+		std::vector<float> row, column;
+		program.filter.separable = SeparateWeights (params.weights, row, column);
+		if (program.filter.separable) {
+			CheckError (clEnqueueWriteBuffer (queue_, program.rowWeights, CL_TRUE, 0,
+				sizeof (float) * row.size (), row.data (), 0, nullptr, nullptr));
+			CheckError (clEnqueueWriteBuffer (queue_, program.columnWeights, CL_TRUE, 0,
+				sizeof (float) * column.size (), column.data (), 0, nullptr, nullptr));
+		}
+	}
+
+	LaunchSettings launch;
+	launch.localSize [0] = params.localSize [0];
+	launch.localSize [1] = params.localSize [1];
+	launch.profiler = options_.profiling ? &profiler_ : nullptr;
+	program.filter.launch = launch;
+	program.planar.launch = launch;
+
+	launch.profiler = nullptr;
+	for (const auto& kernels : program.deviceFilters) {
+		if (kernels) {
+			kernels->launch = launch;
+		}
+	}
+
+	return program;
+}
+
+Image Engine::FilterRGBA (const Image& rgba, const FilterParams& params,
+	std::size_t frameBytes)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	ScopedLatency latency (instruments_.filterLatency);
+	Program& program = GetProgram (params);
+
+	Image result;
+	if (options_.tileCacheSize) {
+		const std::uint64_t filterHash = XXH64 (params.weights.data (),
+			params.weights.size () * sizeof (float), program.filter.filterSize);
+		result = FilterImageCached (pool_, queue_, program.filter, tileCache_,
+			options_.cacheTileSize, filterHash, rgba, tileDeviceTime_);
+	} else {
+		const FramePlan plan = PlanFrame (rgba.width, rgba.height, params, program);
+		if (plan.tileSize > 0 && params.tileSize <= 0) {
+			instruments_.budgetTiledFrames.Add ();
+		}
+
+		if (options_.multiDevice && devices_.size () > 1) {
+			// The selected device first, its lane runs on this thread
+			std::vector<DeviceLane> lanes;
+			std::vector<std::size_t> laneDevices;
+			for (std::size_t i = 0; i < devices_.size (); ++i) {
+				const std::size_t device = (options_.deviceIndex + i) % devices_.size ();
+				DeviceLane lane = DeviceLane ();
+				if (device == options_.deviceIndex) {
+					lane.queue = queue_;
+					lane.kernels = &program.filter;
+					lane.pool = &pool_;
+				} else {
+					lane.queue = deviceQueues_ [device];
+					lane.kernels = program.deviceFilters [device].get ();
+					lane.pool = devicePools_ [device].get ();
+				}
+				lanes.push_back (lane);
+				laneDevices.push_back (device);
+			}
+
+			const int tileSize = plan.tileSize > 0 ? plan.tileSize : DeviceTileSize;
+			result = FilterImageDynamic (lanes, tileSize, rgba);
+			for (std::size_t i = 0; i < lanes.size (); ++i) {
+				deviceTiles_ [laneDevices [i]]->Add (lanes [i].tiles);
+			}
+		} else if (plan.tileSize > 0) {
+			result = FilterImageTiled (pool_, tileQueues_, program.filter,
+				plan.tileSize, rgba, plan.tileSlots);
+		} else {
+			result = FilterImageResilient (pool_, queue_, program.filter,
+				params.path, rgba);
+		}
+	}
+
+	RecordFrame (frameBytes);
+	profiler_.Collect ();
+	return result;
+}
+
+FramePlan Engine::Plan (int width, int height, const FilterParams& params)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	return PlanFrame (width, height, params, GetProgram (params));
+}
+
+FramePlan Engine::PlanFrame (int width, int height, const FilterParams& params,
+	const Program& program) const
+{
+	const bool concurrent = tileQueues_.size () > 1 || outOfOrderQueue_;
+	return budget_.Plan (width, height, program.filter.filterSize,
+		PathPixelBytes (params.path),
+		params.path == ImagePath, concurrent ? MaxTilesInFlight : 1, params.tileSize);
+}
+
+void Engine::RecordFrame (std::size_t frameBytes)
+{
+	instruments_.frames.Add ();
+	instruments_.bytesIn.Add (frameBytes);
+	instruments_.bytesOut.Add (frameBytes);
+	instruments_.poolFree.Set (static_cast<std::int64_t> (pool_.Size ()));
+	instruments_.deviceMemory.Set (static_cast<std::int64_t> (pool_.Allocated ()));
+	instruments_.deviceMemoryPeak.Set (static_cast<std::int64_t> (budget_.Peak ()));
+}
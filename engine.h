@@ -0,0 +1,379 @@
+#ifndef CLTUT_ENGINE_H
+#define CLTUT_ENGINE_H
+
+#include "bufferpool.h"
+#include "clhandle.h"
+#include "filter.h"
+#include "image.h"
+#include "memorybudget.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "threadpool.h"
+#include "tilecache.h"
+#include "variants.h"
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The awaitable Filter needs C++20
+#if defined (__cpp_impl_coroutine)
+	#include <coroutine>
+	#define CLTUT_HAVE_COROUTINES
+#endif
+
+// Settings of one filter call
+struct FilterParams
+{
+	FilterParams ();
+
+	// (2 * radius + 1)^2 weights, row by row. A normalized 3x3 Gaussian
+	// blur by default.
+	std::vector<float> weights;
+
+	// One of the BORDER_* modes in kernels/image.cl
+	int borderMode;
+
+	// Layout used for RGBA images, and for RGB ones unless planar is set
+	FilterPath path;
+
+	// Filters RGB images as R, G and B planes with vectorWidth wide loads
+	bool planar;
+	int vectorWidth;
+
+	// Work-group size, see LaunchSettings. 0 x 0 by default.
+	std::size_t localSize [2];
+
+	// If not zero, RGBA images are filtered in tiles of this size, which
+	// bounds the device memory needed
+	int tileSize;
+
+	// The radius of the weights, FILTER_SIZE in kernels/image.cl. Throws
+	// std::invalid_argument if their count is not an odd square.
+	int FilterSize () const;
+};
+
+// Normalized (2 * radius + 1)^2 Gaussian weights
+std::vector<float> GaussianWeights (double sigma, int radius);
+
+// Reads whitespace separated weights from a text file, row by row
+std::vector<float> LoadWeights (const std::string& path);
+
+struct EngineOptions
+{
+	EngineOptions ();
+
+	std::string kernelPath;
+
+	// Zero based indices of the platform, and of the device on it which
+	// gets the work
+	std::size_t platformIndex;
+	std::size_t deviceIndex;
+
+	// Records every device command, see Engine::Profile. Needed for the
+	// device side of a trace.
+	bool profiling;
+
+	// Runs the tiles of FilterParams::tileSize concurrently, on an
+	// out-of-order queue if the device has one and on several in-order
+	// queues otherwise
+	bool outOfOrder;
+
+	// Filters RGBA frames on all devices of the platform at once, in tiles
+	// which each device takes as it finishes its last, see
+	// FilterImageDynamic. Not combined with the tile cache, which uses the
+	// selected device alone.
+	bool multiDevice;
+
+	// Threads for the host side of the filter calls, 0 for one per core
+	std::size_t hostThreads;
+
+	// Device memory the buffer pool keeps between calls, in bytes
+	std::size_t poolCapacity;
+
+	// Device memory all calls may use together, in bytes, 0 for three
+	// quarters of the device's global memory. Frames which would not fit
+	// whole are filtered in tiles which do, see MemoryBudget::Plan.
+	std::size_t memoryBudget;
+
+	// If not zero, RGBA filtering goes through a tile cache of this many
+	// bytes with cacheTileSize x cacheTileSize tiles
+	std::size_t tileCacheSize;
+	int cacheTileSize;
+
+	// File Calibrate keeps the fastest variant per device, filter and frame
+	// size in, see VariantStore. Empty to benchmark on every run.
+	std::string variantCache;
+};
+
+// Reusable filter engine. Owns a context over all devices of a platform, a
+// queue on one of them (on each with multiDevice), every program built so far (one
+// per filter size, border mode and vector width) and a pool of device
+// memory, so their setup is paid once rather than per image.
+//
+// Filter and FilterAsync may be called from any thread, the device work of
+// all calls is serialized. The conversions between RGB and RGBA are not, they
+// run on a work-stealing host thread pool outside the lock.
+class Engine
+{
+public:
+	explicit Engine (const EngineOptions& options = EngineOptions ());
+
+	Engine (const Engine&) = delete;
+	Engine& operator= (const Engine&) = delete;
+
+	// Filters an RGB or RGBA image. destination gets the same layout.
+	void Filter (const Image& source, Image& destination,
+		const FilterParams& params);
+
+	// Filters many small RGB or RGBA images with one launch, see
+	// FilterImageBatch. The filter path, planar and tile settings of params
+	// do not apply.
+	void FilterBatch (const std::vector<Image>& sources,
+		std::vector<Image>& destinations, const FilterParams& params);
+
+	// Filter with the device work on the engine's worker thread, which
+	// does nothing else, and the conversions on its host thread pool, so
+	// several frames in flight overlap. source and destination must stay
+	// valid until the future is ready.
+	std::future<void> FilterAsync (const Image& source, Image& destination,
+		const FilterParams& params);
+
+#ifdef CLTUT_HAVE_COROUTINES
+	class FilterAwaitable;
+
+	// Filter for coroutines: Image result = co_await engine.Filter (source,
+	// params) enqueues the device work without blocking the thread, and the
+	// coroutine resumes on the host thread pool once the readback completed,
+	// which clSetEventCallback reports. So one thread may keep many frames
+	// in flight. Nothing happens until the result is awaited, and source
+	// must stay valid until then. Tiles, the tile cache and the planar
+	// kernel are not enqueued this way, they run as Filter on the host
+	// thread pool. All awaited calls must have resumed before the engine
+	// is destroyed.
+	FilterAwaitable Filter (const Image& source, const FilterParams& params);
+#endif
+
+	// Calibrates the RGBA paths on every device with an RGBA image, see
+	// CalibrateFilterPath, and returns the fastest one on the engine's device.
+	// Devices with a choice in the variant cache for this filter and frame
+	// size are not benchmarked again.
+	FilterPath Calibrate (const Image& image, const FilterParams& params);
+
+	// Streaming copy bandwidth and FLOP/s of the engine's device, see
+	// MeasurePeaks in filter.h
+	DevicePeaks MeasurePeaks (const FilterParams& params);
+
+	// For filtering successive frames which only change in some rectangles.
+	// It shares the kernels of the engine, so it must not be used while
+	// another call is running.
+	std::unique_ptr<RegionFilter> CreateRegionFilter (int width, int height,
+		const FilterParams& params);
+
+	cl_platform_id Platform () const
+	{
+		return platform_;
+	}
+
+	// The device the work goes to
+	cl_device_id Device () const
+	{
+		return devices_ [options_.deviceIndex];
+	}
+
+	const std::vector<cl_device_id>& Devices () const
+	{
+		return devices_;
+	}
+
+	// How the tiles are queued, see EngineOptions::outOfOrder
+	const char* QueueMode () const;
+
+	// How Filter will run a width x height frame within the memory budget
+	FramePlan Plan (int width, int height, const FilterParams& params);
+
+	// Not synchronized with running calls
+	const MemoryBudget& Budget () const
+	{
+		return budget_;
+	}
+
+	// Runs the host side of the filter calls; free for other band-parallel
+	// host work, like LoadImageRGBA
+	ThreadPool& HostPool ()
+	{
+		return hostPool_;
+	}
+
+	const TileCache& Cache () const
+	{
+		return tileCache_;
+	}
+
+	// Tiles each device of Devices filtered with multiDevice so far
+	std::uint64_t DeviceTiles (std::size_t device) const
+	{
+		return deviceTiles_ [device]->Value ();
+	}
+
+	// Milliseconds the tile cache misses spent on the device
+	double TileDeviceTime () const
+	{
+		return tileDeviceTime_;
+	}
+
+	// The device commands of all calls so far, empty unless profiling was
+	// enabled. Not synchronized with running calls.
+	const Profiler& Profile ();
+
+	// Frames, bytes, latencies, queue depth, program cache and device memory
+	// of the engine, all prefixed clfilter_. Callers may register their own
+	// metrics here too, so one MetricsWriter exports everything.
+	MetricsRegistry& Metrics ()
+	{
+		return metrics_;
+	}
+
+private:
+#ifdef CLTUT_HAVE_COROUTINES
+	friend class FilterAwaitable;
+#endif
+
+	struct Program
+	{
+		CLProgram program;
+		CLMem weights;
+
+		// The factors of separable weights, see SeparateWeights
+		CLMem rowWeights;
+		CLMem columnWeights;
+
+		FilterKernels filter;
+		PlanarKernels planar;
+
+		// With multiDevice, kernels of their own for the other devices,
+		// indexed like devices_; null for the selected device, which uses
+		// filter
+		std::vector<std::unique_ptr<FilterKernels>> deviceFilters;
+	};
+
+	// The metrics the engine updates itself
+	struct Instruments
+	{
+		explicit Instruments (MetricsRegistry& registry);
+
+		Counter& frames;
+		Counter& bytesIn;
+		Counter& bytesOut;
+		Histogram& filterLatency;
+		Histogram& queueLatency;
+		Histogram& batchLatency;
+		Gauge& queueDepth;
+		Counter& programHits;
+		Counter& programMisses;
+		Gauge& poolFree;
+		Gauge& deviceMemory;
+		Gauge& deviceMemoryPeak;
+		Counter& budgetTiledFrames;
+	};
+
+	// Builds the program for these parameters on first use, and updates
+	// its weights and launch settings. mutex_ must be held.
+	Program& GetProgram (const FilterParams& params);
+
+	// Plan for the program of params. mutex_ must be held.
+	FramePlan PlanFrame (int width, int height, const FilterParams& params,
+		const Program& program) const;
+
+	// The device work of Filter on an RGBA image. Takes mutex_.
+	Image FilterRGBA (const Image& rgba, const FilterParams& params,
+		std::size_t frameBytes);
+
+	// Counts a filtered image of frameBytes in its own layout. mutex_ must
+	// be held.
+	void RecordFrame (std::size_t frameBytes);
+
+	EngineOptions options_;
+	MetricsRegistry metrics_;
+	Instruments instruments_;
+	cl_platform_id platform_;
+	std::vector<cl_device_id> devices_;
+	CLContext context_;
+	CLCommandQueue queue_;
+	std::string source_;
+	std::map<std::string, std::unique_ptr<Program>> programs_;
+	MemoryBudget budget_;
+	BufferPool pool_;
+	Profiler profiler_;
+	TileCache tileCache_;
+	double tileDeviceTime_;
+	VariantStore variants_;
+
+	// With multiDevice, a queue and pool for each other device, indexed
+	// like devices_ (queue_ and pool_ serve the selected one), and how
+	// many tiles each device filtered
+	std::vector<CLCommandQueue> deviceQueues_;
+	std::vector<std::unique_ptr<BufferPool>> devicePools_;
+	std::vector<Counter*> deviceTiles_;
+
+	// The queues FilterImageTiled runs on, queue_ alone unless outOfOrder
+	std::vector<CLCommandQueue> tileQueueHandles_;
+	std::vector<cl_command_queue> tileQueues_;
+	bool outOfOrderQueue_;
+	std::mutex mutex_;
+
+	// The RGB <-> RGBA conversions
+	ThreadPool hostPool_;
+
+	// Last, so pending FilterAsync calls finish before anything else goes.
+	// It hands the conversions back to hostPool_, so that goes after it.
+	ThreadPool worker_;
+};
+
+#ifdef CLTUT_HAVE_COROUTINES
+class Engine::FilterAwaitable
+{
+public:
+	FilterAwaitable (Engine& engine, const Image& source, const FilterParams& params);
+
+	FilterAwaitable (const FilterAwaitable&) = delete;
+	FilterAwaitable& operator= (const FilterAwaitable&) = delete;
+
+	bool await_ready () const
+	{
+		return false;
+	}
+
+	// Enqueues the work, or resumes right away if that failed
+	bool await_suspend (std::coroutine_handle<> handle);
+
+	// Returns the result or throws what went wrong
+	Image await_resume ();
+
+private:
+	static void CL_CALLBACK Completed (cl_event event, cl_int status, void* data);
+
+	Engine& engine_;
+	const Image& source_;
+	FilterParams params_;
+	std::chrono::steady_clock::time_point start_;
+	bool rgb_;
+	Image rgba_;
+
+	// Set if the work was enqueued. Otherwise result_ gets the result of
+	// the fallback, which is RGBA unless the planar kernel made it.
+	std::unique_ptr<PendingFilter> pending_;
+	cl_int status_;
+	Image result_;
+	std::exception_ptr error_;
+	std::coroutine_handle<> handle_;
+};
+#endif
+
+#endif
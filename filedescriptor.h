@@ -0,0 +1,37 @@
+#ifndef CLTUT_FILEDESCRIPTOR_H
+#define CLTUT_FILEDESCRIPTOR_H
+
+#include <unistd.h>
+
+// Owns a POSIX file descriptor, of a file or a socket, and closes it
+class FileDescriptor
+{
+public:
+	explicit FileDescriptor (int fd) : fd_ (fd) {}
+	~FileDescriptor ()
+	{
+		if (fd_ >= 0) {
+			close (fd_);
+		}
+	}
+
+	FileDescriptor (const FileDescriptor&) = delete;
+	FileDescriptor& operator= (const FileDescriptor&) = delete;
+
+	int Get () const
+	{
+		return fd_;
+	}
+
+	int Release ()
+	{
+		const int fd = fd_;
+		fd_ = -1;
+		return fd;
+	}
+
+private:
+	int fd_;
+};
+
+#endif
@@ -0,0 +1,1357 @@
+#include "filter.h"
+
+#include "commandgraph.h"
+#include "hash.h"
+#include "profiler.h"
+#include "tilecache.h"
+#include "variants.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+// The event argument for a command, so the profiler gets it if there is one.
+// bytes is the size of a transfer.
+cl_event* Track (const LaunchSettings& launch, const char* name, std::size_t bytes)
+{
+	return launch.profiler ? launch.profiler->Track (name, double (bytes)) : nullptr;
+}
+
+// Estimated bytes moved and floating point operations of a launch
+struct Work
+{
+	double bytes;
+	double flops;
+};
+
+// The work of a filter over pixelCount pixels of channels channels each:
+// every input pixel is read once and every output pixel written once, which
+// assumes the overlapping footprints hit the cache, and each tap costs a
+// multiply and an add per channel
+Work FilterWork (std::size_t pixelCount, std::size_t pixelBytes, int channels,
+	int filterSize)
+{
+	const double taps = double (2 * filterSize + 1) * (2 * filterSize + 1);
+	const Work work = { 2.0 * pixelCount * pixelBytes, 2.0 * taps * channels * pixelCount };
+	return work;
+}
+
+// Tracks a launch under the kernel's function name
+cl_event* Track (const LaunchSettings& launch, cl_kernel kernel, const Work& work)
+{
+	if (!launch.profiler) {
+		return nullptr;
+	}
+
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetKernelInfo.html
+	std::size_t size = 0;
+	CheckError (clGetKernelInfo (kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &size));
+
+	std::string name (size, '\0');
+	CheckError (clGetKernelInfo (kernel, CL_KERNEL_FUNCTION_NAME, size,
+		&name [0], nullptr));
+	name.resize (size ? size - 1 : 0);
+
+	return launch.profiler->Track (name, work.bytes, work.flops);
+}
+
+// The local size for a 2D launch of the given size, or nullptr
+const std::size_t* LocalSize (const LaunchSettings& launch, const std::size_t* size)
+{
+	if (launch.localSize [0] == 0 || launch.localSize [1] == 0
+		|| size [0] % launch.localSize [0] || size [1] % launch.localSize [1]) {
+		return nullptr;
+	}
+
+	return launch.localSize;
+}
+
+// Runs a 2D RGBA filter kernel over size pixels starting at offset.
+// pixelBytes is the size of a pixel in its input and output.
+void EnqueueKernel2D (cl_command_queue queue, cl_kernel kernel,
+	const LaunchSettings& launch, const std::size_t* offset, const std::size_t* size,
+	std::size_t pixelBytes, int filterSize)
+{
+	const Work work = FilterWork (size [0] * size [1], pixelBytes, 4, filterSize);
+
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clEnqueueNDRangeKernel.html
+	CheckError (clEnqueueNDRangeKernel (queue, kernel, 2, offset, size,
+		LocalSize (launch, size), 0, nullptr, Track (launch, kernel, work)));
+}
+
+// Runs interior over the pixels whose whole filter footprint is inside the
+// image, and border over the strips around them. The arguments of both
+// kernels must be set already, and their pixels must be 4 bytes.
+void EnqueueSplitFilter (cl_command_queue queue, cl_kernel border,
+	cl_kernel interior, const LaunchSettings& launch, int width, int height,
+	int filterSize)
+{
+	const std::size_t w = width, h = height, f = filterSize;
+
+	if (w <= 2 * f || h <= 2 * f) {
+		std::size_t offset [3] = { 0 };
+		std::size_t size [3] = { w, h, 1 };
+		EnqueueKernel2D (queue, border, launch, offset, size, 4, filterSize);
+		return;
+	}
+
+	// x, y, width, height
+	const std::size_t regions [5][4] = {
+		{ f, f, w - 2 * f, h - 2 * f },
+		{ 0, 0, w, f },
+		{ 0, h - f, w, f },
+		{ 0, f, f, h - 2 * f },
+		{ w - f, f, f, h - 2 * f }
+	};
+
+	for (int i = 0; i < 5; ++i) {
+		if (regions [i][2] == 0 || regions [i][3] == 0) {
+			continue;
+		}
+
+		std::size_t offset [3] = { regions [i][0], regions [i][1], 0 };
+		std::size_t size [3] = { regions [i][2], regions [i][3], 1 };
+		EnqueueKernel2D (queue, i == 0 ? interior : border, launch, offset, size,
+			4, filterSize);
+	}
+}
+
+// Rows of buffer images are padded to a multiple of this many bytes
+const std::size_t RowAlignment = 64;
+
+// Copies the tw x th tile at tx, ty out of an RGBA image together with its
+// filterSize halo, applying the border mode on the host. The rows of the
+// result are tw + 2 * filterSize pixels long.
+std::vector<char> GatherTile (const Image& image, int tx, int ty, int tw, int th,
+	int filterSize, int borderMode)
+{
+	const int f = filterSize;
+	const int pw = tw + 2 * f;
+
+	std::vector<char> input (std::size_t (pw) * (th + 2 * f) * 4);
+	for (int y = 0; y < th + 2 * f; ++y) {
+		const int sy = BorderCoordinate (ty + y - f, image.height, borderMode);
+		for (int x = 0; x < pw; ++x) {
+			const int sx = BorderCoordinate (tx + x - f, image.width, borderMode);
+			char* const p = &input [(std::size_t (y) * pw + x) * 4];
+			if (sx < 0 || sy < 0) {
+				std::fill (p, p + 4, 0);
+			} else {
+				std::copy_n (&image.pixel [(std::size_t (sy) * image.width + sx) * 4], 4, p);
+			}
+		}
+	}
+
+	return input;
+}
+
+// The ranges of output coordinates along an axis of size pixels which read
+// the input range [begin, end) under borderMode, with filterSize taps on
+// either side. Wrap reads the far edge, and mirror reads it too once the
+// filter is wider than the image.
+std::vector<std::pair<int, int>> AffectedRanges (int begin, int end, int filterSize,
+	int size, int borderMode)
+{
+	std::vector<std::pair<int, int>> ranges;
+	if ((borderMode == 1 || borderMode == 2) && 2 * filterSize + 1 > size) {
+		ranges.push_back (std::make_pair (0, size));
+		return ranges;
+	}
+
+	// The input range itself, and where it shows up again outside the image
+	std::vector<std::pair<int, int>> sources (1, std::make_pair (begin, end));
+	if (borderMode == 2) {
+		sources.push_back (std::make_pair (begin - size, end - size));
+		sources.push_back (std::make_pair (begin + size, end + size));
+	} else if (borderMode == 1) {
+		sources.push_back (std::make_pair (-end, -begin));
+		sources.push_back (std::make_pair (2 * size - end, 2 * size - begin));
+	}
+
+	for (const auto& source : sources) {
+		const int first = std::max (source.first - filterSize, 0);
+		const int last = std::min (source.second + filterSize, size);
+		if (first < last) {
+			ranges.push_back (std::make_pair (first, last));
+		}
+	}
+	return ranges;
+}
+
+// Adds a command to the graph and hands its event to the profiler as well.
+// tracked is what Track returned for the command.
+CommandGraph::Node AddTracked (CommandGraph& graph, cl_event* tracked,
+	std::size_t lane, const std::vector<CommandGraph::Node>& after,
+	const CommandGraph::Command& command)
+{
+	const CommandGraph::Node node = graph.Add (lane, after, command);
+	if (tracked) {
+		CheckError (clRetainEvent (graph.Event (node)));
+		*tracked = graph.Event (node);
+	}
+
+	return node;
+}
+
+// Gives the profiler a reference to event too, if it tracks the command
+void ShareEvent (cl_event* tracked, cl_event event)
+{
+	if (tracked) {
+		CheckError (clRetainEvent (event));
+		*tracked = event;
+	}
+}
+
+// Largest and smallest tile FilterImageResilient tries
+const int MaxRetryTileSize = 1024;
+const int MinRetryTileSize = 64;
+}
+
+LaunchSettings::LaunchSettings ()
+	: profiler (nullptr)
+{
+	localSize [0] = localSize [1] = 0;
+}
+
+Image FilterImage (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, const Image& image)
+{
+	const auto inputImage = pool.Image2D (CL_MEM_READ_ONLY, image.width, image.height);
+	const auto outputImage = pool.Image2D (CL_MEM_WRITE_ONLY, image.width, image.height);
+
+	// The read at the end blocks, so the pixels need not be copied here
+	std::size_t origin [3] = { 0 };
+	std::size_t region [3] = { std::size_t (image.width), std::size_t (image.height), 1 };
+	CheckError (clEnqueueWriteImage (queue, inputImage, CL_FALSE,
+		origin, region, 0, 0,
+		image.pixel.data (), 0, nullptr, Track (kernels.launch, "WriteImage",
+		image.pixel.size ())));
+
+	// Setup the kernel arguments, the filter weights are bound once up front
+	SetKernelArg (kernels.image, 0, inputImage);
+	SetKernelArg (kernels.image, 2, outputImage);
+	SetKernelArg (kernels.imageInterior, 0, inputImage);
+	SetKernelArg (kernels.imageInterior, 2, outputImage);
+
+	// Run the processing
+	EnqueueSplitFilter (queue, kernels.image, kernels.imageInterior,
+		kernels.launch, image.width, image.height, kernels.filterSize);
+	
+	// Prepare the result image, set to black
+	Image result = image;
+	std::fill (result.pixel.begin (), result.pixel.end (), 0);
+
+	// Get the result back to the host
+	CheckError (clEnqueueReadImage (queue, outputImage, CL_TRUE,
+		origin, region, 0, 0,
+		result.pixel.data (), 0, nullptr, Track (kernels.launch, "ReadImage",
+		result.pixel.size ())));
+
+	return result;
+}
+
+Image FilterImageBuffer (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, bool floatPixels, const Image& image)
+{
+	const cl_kernel kernel = floatPixels ? kernels.bufferFloat : kernels.buffer;
+	const std::size_t pixelSize = floatPixels ? 4 * sizeof (cl_float) : 4;
+	const std::size_t hostRowBytes = image.width * pixelSize;
+	const std::size_t rowBytes = (hostRowBytes + RowAlignment - 1)
+		/ RowAlignment * RowAlignment;
+	const cl_int pitch = static_cast<cl_int> (rowBytes / pixelSize);
+	const std::size_t pixelCount = std::size_t (image.width) * image.height;
+
+	std::vector<float> floats;
+	const void* source = image.pixel.data ();
+	if (floatPixels) {
+		const unsigned char* bytes =
+			reinterpret_cast<const unsigned char*> (image.pixel.data ());
+		floats.assign (bytes, bytes + pixelCount * 4);
+		source = floats.data ();
+	}
+
+	const auto inputBuffer = pool.Buffer (CL_MEM_READ_ONLY, rowBytes * image.height);
+	const auto outputBuffer = pool.Buffer (CL_MEM_WRITE_ONLY, rowBytes * image.height);
+
+	// Copy the tightly packed host rows into the padded device rows
+	std::size_t origin [3] = { 0 };
+	std::size_t region [3] = { hostRowBytes, std::size_t (image.height), 1 };
+	CheckError (clEnqueueWriteBufferRect (queue, inputBuffer, CL_FALSE,
+		origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+		source, 0, nullptr, Track (kernels.launch, "WriteBufferRect",
+		hostRowBytes * image.height)));
+
+	SetKernelArg (kernel, 0, inputBuffer);
+	SetKernelArg (kernel, 2, outputBuffer);
+	SetKernelArg (kernel, 3, image.width);
+	SetKernelArg (kernel, 4, image.height);
+	SetKernelArg (kernel, 5, pitch);
+
+	if (floatPixels) {
+		std::size_t offset [3] = { 0 };
+		std::size_t size [3] = { std::size_t (image.width), std::size_t (image.height), 1 };
+		EnqueueKernel2D (queue, kernel, kernels.launch, offset, size,
+			pixelSize, kernels.filterSize);
+	} else {
+		SetKernelArg (kernels.bufferInterior, 0, inputBuffer);
+		SetKernelArg (kernels.bufferInterior, 2, outputBuffer);
+		SetKernelArg (kernels.bufferInterior, 3, pitch);
+
+		EnqueueSplitFilter (queue, kernel, kernels.bufferInterior,
+			kernels.launch, image.width, image.height, kernels.filterSize);
+	}
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (pixelCount * 4);
+
+	if (floatPixels) {
+		CheckError (clEnqueueReadBufferRect (queue, outputBuffer, CL_TRUE,
+			origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+			floats.data (), 0, nullptr, Track (kernels.launch, "ReadBufferRect",
+			hostRowBytes * image.height)));
+
+		for (std::size_t i = 0; i < floats.size (); ++i) {
+			const float v = std::min (std::max (floats [i], 0.0f), 255.0f);
+			result.pixel [i] = static_cast<char> (static_cast<int> (v + 0.5f));
+		}
+	} else {
+		CheckError (clEnqueueReadBufferRect (queue, outputBuffer, CL_TRUE,
+			origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+			result.pixel.data (), 0, nullptr, Track (kernels.launch, "ReadBufferRect",
+			hostRowBytes * image.height)));
+	}
+
+	return result;
+}
+
+Rect ExpandRect (const Rect& rect, int margin, int width, int height)
+{
+	const int x0 = std::max (rect.x - margin, 0);
+	const int y0 = std::max (rect.y - margin, 0);
+	const int x1 = std::min (rect.x + rect.width + margin, width);
+	const int y1 = std::min (rect.y + rect.height + margin, height);
+
+	const Rect result = { x0, y0, std::max (x1 - x0, 0), std::max (y1 - y0, 0) };
+	return result;
+}
+
+Image CropImage (const Image& image, const Rect& rect, int margin, int borderMode)
+{
+	const std::vector<char> pixels = GatherTile (image, rect.x, rect.y,
+		rect.width, rect.height, margin, borderMode);
+
+	Image result;
+	result.width = rect.width + 2 * margin;
+	result.height = rect.height + 2 * margin;
+	result.pixel.assign (pixels.begin (), pixels.end ());
+	return result;
+}
+
+RegionFilter::RegionFilter (cl_context context, cl_command_queue queue,
+	const FilterKernels& kernels, int width, int height)
+	: queue_ (queue), kernels_ (kernels), width_ (width), height_ (height),
+	input_ (CreateImage2D (context, CL_MEM_READ_ONLY, width, height, nullptr)),
+	output_ (CreateImage2D (context, CL_MEM_WRITE_ONLY, width, height, nullptr))
+{
+}
+
+Image RegionFilter::Filter (const Image& image)
+{
+	const Rect all = { 0, 0, width_, height_ };
+	Upload (image, all);
+	SetArguments ();
+	EnqueueSplitFilter (queue_, kernels_.image, kernels_.imageInterior,
+		kernels_.launch, width_, height_, kernels_.filterSize);
+
+	Image result = image;
+	Download (result, all);
+	CheckError (clFinish (queue_));
+	return result;
+}
+
+void RegionFilter::FilterRegions (const Image& image, const std::vector<Rect>& dirty,
+	Image& result)
+{
+	// Only the pixels of the rectangles changed. Every output pixel within
+	// FILTER_SIZE of them reads them, and under wrap and mirror so do the
+	// pixels at the edges they are read through.
+	std::vector<Rect> regions;
+	for (const auto& rect : dirty) {
+		const Rect upload = ExpandRect (rect, 0, width_, height_);
+		if (upload.width == 0 || upload.height == 0) {
+			continue;
+		}
+		Upload (image, upload);
+
+		const auto columns = AffectedRanges (upload.x, upload.x + upload.width,
+			kernels_.filterSize, width_, kernels_.borderMode);
+		const auto rows = AffectedRanges (upload.y, upload.y + upload.height,
+			kernels_.filterSize, height_, kernels_.borderMode);
+		for (const auto& row : rows) {
+			for (const auto& column : columns) {
+				const Rect region = { column.first, row.first,
+					column.second - column.first, row.second - row.first };
+				regions.push_back (region);
+			}
+		}
+	}
+
+	SetArguments ();
+
+	for (const auto& region : regions) {
+		std::size_t offset [3] = { std::size_t (region.x), std::size_t (region.y), 0 };
+		std::size_t size [3] = { std::size_t (region.width), std::size_t (region.height), 1 };
+		EnqueueKernel2D (queue_, kernels_.image, kernels_.launch, offset, size,
+			4, kernels_.filterSize);
+	}
+
+	for (const auto& region : regions) {
+		Download (result, region);
+	}
+
+	CheckError (clFinish (queue_));
+}
+
+void RegionFilter::SetArguments ()
+{
+	SetKernelArg (kernels_.image, 0, input_);
+	SetKernelArg (kernels_.image, 2, output_);
+	SetKernelArg (kernels_.imageInterior, 0, input_);
+	SetKernelArg (kernels_.imageInterior, 2, output_);
+}
+
+// The host rows are the full image width apart, so the row pitch lets the
+// copy pick the rectangle straight out of the frame
+void RegionFilter::Upload (const Image& image, const Rect& rect)
+{
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clEnqueueWriteImage.html
+	std::size_t origin [3] = { std::size_t (rect.x), std::size_t (rect.y), 0 };
+	std::size_t region [3] = { std::size_t (rect.width), std::size_t (rect.height), 1 };
+	CheckError (clEnqueueWriteImage (queue_, input_, CL_FALSE, origin, region,
+		std::size_t (width_) * 4, 0,
+		image.pixel.data () + (std::size_t (rect.y) * width_ + rect.x) * 4,
+		0, nullptr, Track (kernels_.launch, "WriteImage",
+		region [0] * region [1] * 4)));
+}
+
+void RegionFilter::Download (Image& result, const Rect& rect)
+{
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clEnqueueReadImage.html
+	std::size_t origin [3] = { std::size_t (rect.x), std::size_t (rect.y), 0 };
+	std::size_t region [3] = { std::size_t (rect.width), std::size_t (rect.height), 1 };
+	CheckError (clEnqueueReadImage (queue_, output_, CL_FALSE, origin, region,
+		std::size_t (width_) * 4, 0,
+		result.pixel.data () + (std::size_t (rect.y) * width_ + rect.x) * 4,
+		0, nullptr, Track (kernels_.launch, "ReadImage",
+		region [0] * region [1] * 4)));
+}
+
+int BorderCoordinate (int i, int size, int borderMode)
+{
+	switch (borderMode) {
+	case 1:
+		i %= 2 * size;
+		if (i < 0) {
+			i += 2 * size;
+		}
+		return i < size ? i : 2 * size - 1 - i;
+	case 2:
+		i %= size;
+		return i < 0 ? i + size : i;
+	case 3:
+		return (i < 0 || i >= size) ? -1 : i;
+	default:
+		return std::min (std::max (i, 0), size - 1);
+	}
+}
+
+Image FilterImageCached (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, TileCache& cache, int tileSize,
+	std::uint64_t filterHash, const Image& image, double& deviceTime)
+{
+	const int f = kernels.filterSize;
+	const int slot = tileSize + 2 * f;
+	const std::size_t slotBytes = std::size_t (slot) * slot * 4;
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (image.pixel.size ());
+
+	// A tile which repeats within the frame is filtered once, and its
+	// result copied to every position it has
+	struct Miss
+	{
+		int width, height;
+		std::uint64_t key;
+		std::vector<char> input;
+		std::vector<std::pair<int, int>> positions;
+	};
+	std::vector<Miss> misses;
+	std::unordered_multimap<std::uint64_t, std::size_t> missIndex;
+
+	for (int ty = 0; ty < image.height; ty += tileSize) {
+		for (int tx = 0; tx < image.width; tx += tileSize) {
+			const int tw = std::min (tileSize, image.width - tx);
+			const int th = std::min (tileSize, image.height - ty);
+			std::vector<char> input = GatherTile (image, tx, ty, tw, th,
+				f, kernels.borderMode);
+
+			const std::uint64_t key = XXH64 (input.data (), input.size (),
+				filterHash ^ (std::uint64_t (tw) << 32 | std::uint64_t (th)));
+
+			const std::vector<char>* cached = cache.Find (key, input);
+			if (!cached) {
+				// The key covers the tile size, the input the pixels
+				const auto candidates = missIndex.equal_range (key);
+				auto same = candidates.first;
+				while (same != candidates.second && misses [same->second].input != input) {
+					++same;
+				}
+
+				if (same != candidates.second) {
+					misses [same->second].positions.push_back (std::make_pair (tx, ty));
+				} else {
+					Miss miss = { tw, th, key, std::move (input),
+						std::vector<std::pair<int, int>> (1, std::make_pair (tx, ty)) };
+					missIndex.insert (std::make_pair (key, misses.size ()));
+					misses.push_back (std::move (miss));
+				}
+				continue;
+			}
+
+			for (int y = 0; y < th; ++y) {
+				std::copy_n (&(*cached) [std::size_t (y) * tw * 4], tw * 4,
+					&result.pixel [(std::size_t (ty + y) * image.width + tx) * 4]);
+			}
+		}
+	}
+
+	if (misses.empty ()) {
+		return result;
+	}
+
+	const auto start = std::chrono::steady_clock::now ();
+
+	// One slot of slot x slot pixels per missing tile, stacked vertically.
+	// Smaller edge tiles only fill the top left of their slot.
+	std::vector<char> staging (slotBytes * misses.size ());
+	for (std::size_t i = 0; i < misses.size (); ++i) {
+		const Miss& miss = misses [i];
+		const std::size_t rowBytes = std::size_t (miss.width + 2 * f) * 4;
+		for (int y = 0; y < miss.height + 2 * f; ++y) {
+			std::copy_n (&miss.input [y * rowBytes], rowBytes,
+				&staging [i * slotBytes + std::size_t (y) * slot * 4]);
+		}
+	}
+
+	const auto inputBuffer = pool.Buffer (CL_MEM_READ_ONLY, staging.size ());
+	const auto outputBuffer = pool.Buffer (CL_MEM_WRITE_ONLY, staging.size ());
+
+	// Completes before the blocking read below, which reuses staging
+	CheckError (clEnqueueWriteBuffer (queue, inputBuffer, CL_FALSE, 0, staging.size (),
+		staging.data (), 0, nullptr, Track (kernels.launch, "WriteBuffer",
+		staging.size ())));
+
+	const cl_int pitch = slot;
+	SetKernelArg (kernels.bufferInterior, 0, inputBuffer);
+	SetKernelArg (kernels.bufferInterior, 2, outputBuffer);
+	SetKernelArg (kernels.bufferInterior, 3, pitch);
+
+	// Rows between two slots are computed too and ignored, which is cheaper
+	// than a launch per tile
+	std::size_t offset [3] = { std::size_t (f), std::size_t (f), 0 };
+	std::size_t size [3] = { std::size_t (tileSize),
+		misses.size () * slot - 2 * f, 1 };
+	EnqueueKernel2D (queue, kernels.bufferInterior, kernels.launch, offset, size, 4, f);
+
+	CheckError (clEnqueueReadBuffer (queue, outputBuffer, CL_TRUE, 0, staging.size (),
+		staging.data (), 0, nullptr, Track (kernels.launch, "ReadBuffer",
+		staging.size ())));
+
+	const std::chrono::duration<double, std::milli> elapsed =
+		std::chrono::steady_clock::now () - start;
+	deviceTime += elapsed.count ();
+
+	for (std::size_t i = 0; i < misses.size (); ++i) {
+		Miss& miss = misses [i];
+		std::vector<char> output (std::size_t (miss.width) * miss.height * 4);
+
+		for (int y = 0; y < miss.height; ++y) {
+			const char* const row = &staging [i * slotBytes
+				+ (std::size_t (y + f) * slot + f) * 4];
+			std::copy_n (row, miss.width * 4, &output [std::size_t (y) * miss.width * 4]);
+			for (const auto& position : miss.positions) {
+				std::copy_n (row, miss.width * 4, &result.pixel [
+					(std::size_t (position.second + y) * image.width + position.first) * 4]);
+			}
+		}
+
+		cache.Insert (miss.key, std::move (miss.input), std::move (output));
+	}
+
+	return result;
+}
+
+Image FilterImageTiled (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, int tileSize, const Image& image)
+{
+	return FilterImageTiled (pool, std::vector<cl_command_queue> (1, queue),
+		kernels, tileSize, image);
+}
+
+Image FilterImageTiled (BufferPool& pool, const std::vector<cl_command_queue>& queues,
+	const FilterKernels& kernels, int tileSize, const Image& image,
+	std::size_t maxSlots)
+{
+	const int f = kernels.filterSize;
+	const int slot = tileSize + 2 * f;
+	const std::size_t slotBytes = std::size_t (slot) * slot * 4;
+	const cl_int pitch = slot;
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (image.pixel.size ());
+
+	// The uploads read from here until the graph finished
+	std::deque<std::vector<char>> inputs;
+
+	// Tiles in flight use different slots. A slot is free for the next
+	// tile once the kernel read its input and its output was read back.
+	struct Slot
+	{
+		BufferPool::Lease input;
+		BufferPool::Lease output;
+		bool used;
+		CommandGraph::Node filter;
+		CommandGraph::Node read;
+	};
+	std::vector<Slot> slots;
+
+	// Destroyed first, so nothing above goes while commands still use it
+	CommandGraph graph (queues);
+	slots.resize (graph.Concurrent () ? std::max<std::size_t> (maxSlots, 1) : 1);
+	for (auto& s : slots) {
+		s.input = pool.Buffer (CL_MEM_READ_ONLY, slotBytes);
+		s.output = pool.Buffer (CL_MEM_WRITE_ONLY, slotBytes);
+		s.used = false;
+	}
+
+	std::size_t tile = 0;
+	for (int ty = 0; ty < image.height; ty += tileSize) {
+		for (int tx = 0; tx < image.width; tx += tileSize, ++tile) {
+			const int tw = std::min (tileSize, image.width - tx);
+			const int th = std::min (tileSize, image.height - ty);
+			inputs.push_back (GatherTile (image, tx, ty, tw, th, f, kernels.borderMode));
+			const std::vector<char>& input = inputs.back ();
+
+			Slot& s = slots [tile % slots.size ()];
+			const std::vector<CommandGraph::Node> none;
+
+			// The tile goes to the top left of the slot
+			const std::size_t origin [3] = { 0 };
+			const std::size_t region [3] = { std::size_t (tw + 2 * f) * 4, std::size_t (th + 2 * f), 1 };
+			const cl_mem inputBuffer = s.input;
+			const CommandGraph::Node write = AddTracked (graph,
+				Track (kernels.launch, "WriteBufferRect", region [0] * region [1]),
+				tile, s.used ? std::vector<CommandGraph::Node> (1, s.filter) : none,
+				[&] (cl_command_queue queue, cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+					CheckError (clEnqueueWriteBufferRect (queue, inputBuffer, CL_FALSE,
+						origin, origin, region, std::size_t (slot) * 4, 0, region [0], 0,
+						input.data (), waitCount, waitList, event));
+				});
+
+			// Arguments are captured when the kernel is enqueued
+			SetKernelArg (kernels.bufferInterior, 0, s.input);
+			SetKernelArg (kernels.bufferInterior, 2, s.output);
+			SetKernelArg (kernels.bufferInterior, 3, pitch);
+
+			std::vector<CommandGraph::Node> filterAfter (1, write);
+			if (s.used) {
+				filterAfter.push_back (s.read);
+			}
+
+			const std::size_t offset [3] = { std::size_t (f), std::size_t (f), 0 };
+			const std::size_t size [3] = { std::size_t (tw), std::size_t (th), 1 };
+			const CommandGraph::Node filter = AddTracked (graph,
+				Track (kernels.launch, kernels.bufferInterior,
+					FilterWork (size [0] * size [1], 4, 4, f)),
+				tile, filterAfter,
+				[&] (cl_command_queue queue, cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+					CheckError (clEnqueueNDRangeKernel (queue, kernels.bufferInterior, 2,
+						offset, size, LocalSize (kernels.launch, size),
+						waitCount, waitList, event));
+				});
+
+			const std::size_t tileOrigin [3] = { std::size_t (f) * 4, std::size_t (f), 0 };
+			const std::size_t tileRegion [3] = { std::size_t (tw) * 4, std::size_t (th), 1 };
+			const cl_mem outputBuffer = s.output;
+			char* const destination = &result.pixel [(std::size_t (ty) * image.width + tx) * 4];
+			const CommandGraph::Node read = AddTracked (graph,
+				Track (kernels.launch, "ReadBufferRect", tileRegion [0] * tileRegion [1]),
+				tile, std::vector<CommandGraph::Node> (1, filter),
+				[&] (cl_command_queue queue, cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+					CheckError (clEnqueueReadBufferRect (queue, outputBuffer, CL_FALSE,
+						tileOrigin, origin, tileRegion, std::size_t (slot) * 4, 0,
+						std::size_t (image.width) * 4, 0, destination,
+						waitCount, waitList, event));
+				});
+
+			s.used = true;
+			s.filter = filter;
+			s.read = read;
+		}
+	}
+
+	graph.Finish ();
+	return result;
+}
+
+std::vector<Image> FilterImageBatch (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, const std::vector<Image>& images)
+{
+	if (images.empty ()) {
+		return std::vector<Image> ();
+	}
+
+	// Every image gets a slot of the largest width and height
+	int pitch = 0, slotHeight = 0;
+	std::size_t pixelCount = 0;
+	std::vector<cl_int2> sizes (images.size ());
+	for (std::size_t i = 0; i < images.size (); ++i) {
+		pitch = std::max (pitch, images [i].width);
+		slotHeight = std::max (slotHeight, images [i].height);
+		pixelCount += std::size_t (images [i].width) * images [i].height;
+		sizes [i].s [0] = images [i].width;
+		sizes [i].s [1] = images [i].height;
+	}
+
+	const std::size_t slotBytes = std::size_t (pitch) * slotHeight * 4;
+	std::vector<char> staging (slotBytes * images.size ());
+	for (std::size_t i = 0; i < images.size (); ++i) {
+		const Image& image = images [i];
+		for (int y = 0; y < image.height; ++y) {
+			std::copy_n (&image.pixel [std::size_t (y) * image.width * 4], image.width * 4,
+				&staging [i * slotBytes + std::size_t (y) * pitch * 4]);
+		}
+	}
+
+	const auto inputBuffer = pool.Buffer (CL_MEM_READ_ONLY, staging.size ());
+	const auto outputBuffer = pool.Buffer (CL_MEM_WRITE_ONLY, staging.size ());
+	const auto sizeBuffer = pool.Buffer (CL_MEM_READ_ONLY, sizes.size () * sizeof (cl_int2));
+
+	// Both complete before the blocking read below, which reuses staging
+	CheckError (clEnqueueWriteBuffer (queue, inputBuffer, CL_FALSE, 0, staging.size (),
+		staging.data (), 0, nullptr, Track (kernels.launch, "WriteBuffer",
+		staging.size ())));
+	CheckError (clEnqueueWriteBuffer (queue, sizeBuffer, CL_FALSE, 0,
+		sizes.size () * sizeof (cl_int2), sizes.data (), 0, nullptr,
+		Track (kernels.launch, "WriteBuffer", sizes.size () * sizeof (cl_int2))));
+
+	SetKernelArg (kernels.batch, 0, inputBuffer);
+	SetKernelArg (kernels.batch, 2, outputBuffer);
+	SetKernelArg (kernels.batch, 3, sizeBuffer);
+	SetKernelArg (kernels.batch, 4, pitch);
+	SetKernelArg (kernels.batch, 5, slotHeight);
+
+	// One launch over all slices, the third dimension selects the image
+	std::size_t size [3] = { std::size_t (pitch), std::size_t (slotHeight), images.size () };
+	const std::size_t local [3] = { kernels.launch.localSize [0], kernels.launch.localSize [1], 1 };
+	CheckError (clEnqueueNDRangeKernel (queue, kernels.batch, 3, nullptr, size,
+		LocalSize (kernels.launch, size) ? local : nullptr,
+		0, nullptr, Track (kernels.launch, kernels.batch,
+			FilterWork (pixelCount, 4, 4, kernels.filterSize))));
+
+	CheckError (clEnqueueReadBuffer (queue, outputBuffer, CL_TRUE, 0, staging.size (),
+		staging.data (), 0, nullptr, Track (kernels.launch, "ReadBuffer",
+		staging.size ())));
+
+	std::vector<Image> results (images.size ());
+	for (std::size_t i = 0; i < images.size (); ++i) {
+		Image& result = results [i];
+		result.width = images [i].width;
+		result.height = images [i].height;
+		result.pixel.resize (images [i].pixel.size ());
+
+		for (int y = 0; y < result.height; ++y) {
+			std::copy_n (&staging [i * slotBytes + std::size_t (y) * pitch * 4],
+				result.width * 4, &result.pixel [std::size_t (y) * result.width * 4]);
+		}
+	}
+
+	return results;
+}
+
+Image FilterImageDynamic (std::vector<DeviceLane>& lanes, int tileSize,
+	const Image& image)
+{
+	if (lanes.empty ()) {
+		throw std::invalid_argument ("FilterImageDynamic needs a device");
+	}
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (image.pixel.size ());
+
+	const int tilesX = (image.width + tileSize - 1) / tileSize;
+	const std::size_t tileCount = std::size_t (tilesX)
+		* ((image.height + tileSize - 1) / tileSize);
+	std::atomic<std::size_t> next (0);
+
+	// Tiles of lanes which failed, and their errors
+	std::mutex mutex;
+	std::vector<std::size_t> retries;
+	std::exception_ptr error;
+
+	// Returns false if the lane failed
+	auto run = [&] (DeviceLane& lane) -> bool {
+		const FilterKernels& kernels = *lane.kernels;
+		const int f = kernels.filterSize;
+		const int slot = tileSize + 2 * f;
+		const std::size_t slotBytes = std::size_t (slot) * slot * 4;
+		const cl_int pitch = slot;
+
+		for (;;) {
+			std::size_t tile = next++;
+			if (tile >= tileCount) {
+				std::lock_guard<std::mutex> lock (mutex);
+				if (retries.empty ()) {
+					return true;
+				}
+				tile = retries.back ();
+				retries.pop_back ();
+			}
+
+			const auto start = std::chrono::steady_clock::now ();
+			try {
+				const int tx = int (tile % tilesX) * tileSize;
+				const int ty = int (tile / tilesX) * tileSize;
+				const int tw = std::min (tileSize, image.width - tx);
+				const int th = std::min (tileSize, image.height - ty);
+				const std::vector<char> input = GatherTile (image, tx, ty, tw, th,
+					f, kernels.borderMode);
+
+				const auto inputBuffer = lane.pool->Buffer (CL_MEM_READ_ONLY, slotBytes);
+				const auto outputBuffer = lane.pool->Buffer (CL_MEM_WRITE_ONLY, slotBytes);
+
+				const std::size_t origin [3] = { 0 };
+				const std::size_t region [3] = { std::size_t (tw + 2 * f) * 4, std::size_t (th + 2 * f), 1 };
+				CheckError (clEnqueueWriteBufferRect (lane.queue, inputBuffer, CL_FALSE,
+					origin, origin, region, std::size_t (slot) * 4, 0, region [0], 0,
+					input.data (), 0, nullptr, nullptr));
+
+				SetKernelArg (kernels.bufferInterior, 0, inputBuffer);
+				SetKernelArg (kernels.bufferInterior, 2, outputBuffer);
+				SetKernelArg (kernels.bufferInterior, 3, pitch);
+
+				const std::size_t offset [3] = { std::size_t (f), std::size_t (f), 0 };
+				const std::size_t size [3] = { std::size_t (tw), std::size_t (th), 1 };
+				EnqueueKernel2D (lane.queue, kernels.bufferInterior, kernels.launch,
+					offset, size, 4, f);
+
+				// Straight into the result, whose rows the other lanes write
+				// other parts of
+				const std::size_t bufferOrigin [3] = { std::size_t (f) * 4, std::size_t (f), 0 };
+				const std::size_t hostOrigin [3] = { std::size_t (tx) * 4, std::size_t (ty), 0 };
+				const std::size_t tileRegion [3] = { std::size_t (tw) * 4, std::size_t (th), 1 };
+				CheckError (clEnqueueReadBufferRect (lane.queue, outputBuffer, CL_TRUE,
+					bufferOrigin, hostOrigin, tileRegion, std::size_t (slot) * 4, 0,
+					std::size_t (image.width) * 4, 0, result.pixel.data (),
+					0, nullptr, nullptr));
+			} catch (...) {
+				std::lock_guard<std::mutex> lock (mutex);
+				retries.push_back (tile);
+				if (!error) {
+					error = std::current_exception ();
+				}
+				return false;
+			}
+
+			lane.busy += std::chrono::duration<double> (
+				std::chrono::steady_clock::now () - start).count ();
+			++lane.tiles;
+		}
+	};
+
+	std::vector<char> healthy (lanes.size ());
+	std::vector<std::thread> threads;
+	for (std::size_t i = 0; i < lanes.size (); ++i) {
+		lanes [i].tiles = 0;
+		lanes [i].busy = 0;
+	}
+	for (std::size_t i = 1; i < lanes.size (); ++i) {
+		threads.emplace_back ([&, i] () { healthy [i] = run (lanes [i]); });
+	}
+	healthy [0] = run (lanes [0]);
+	for (auto& thread : threads) {
+		thread.join ();
+	}
+
+	// A lane which failed late leaves its tile to lanes which may have
+	// stopped already, so the healthy ones go over the rest once more
+	for (std::size_t i = 0; i < lanes.size () && !retries.empty (); ++i) {
+		if (healthy [i]) {
+			healthy [i] = run (lanes [i]);
+		}
+	}
+
+	if (!retries.empty ()) {
+		std::rethrow_exception (error);
+	}
+	return result;
+}
+
+Image FilterImageCPU (const FilterKernels& kernels, const Image& image)
+{
+	const int f = kernels.filterSize;
+	const int side = 2 * f + 1;
+	const unsigned char* const input =
+		reinterpret_cast<const unsigned char*> (image.pixel.data ());
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (image.pixel.size ());
+
+	for (int y = 0; y < image.height; ++y) {
+		for (int x = 0; x < image.width; ++x) {
+			float sum [4] = { 0 };
+			for (int dy = -f; dy <= f; ++dy) {
+				const int sy = BorderCoordinate (y + dy, image.height, kernels.borderMode);
+				if (sy < 0) {
+					continue;
+				}
+
+				for (int dx = -f; dx <= f; ++dx) {
+					const int sx = BorderCoordinate (x + dx, image.width, kernels.borderMode);
+					if (sx < 0) {
+						continue;
+					}
+
+					const float weight = kernels.weights [(dx + f) + (dy + f) * side];
+					const unsigned char* const p = input + (std::size_t (sy) * image.width + sx) * 4;
+					for (int c = 0; c < 4; ++c) {
+						sum [c] += weight * p [c];
+					}
+				}
+			}
+
+			char* const out = &result.pixel [(std::size_t (y) * image.width + x) * 4];
+			for (int c = 0; c < 4; ++c) {
+				// Same as convert_uchar4_sat_rte
+				out [c] = static_cast<char> (std::lrint (std::min (std::max (sum [c], 0.0f), 255.0f)));
+			}
+		}
+	}
+
+	return result;
+}
+
+Image FilterImageVariant (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, FilterPath path, const Image& image)
+{
+	if ((path == LocalTiledPath && !kernels.local.Get ())
+		|| (path == SeparablePath && !kernels.separable)) {
+		throw std::invalid_argument (std::string (FilterPathName (path))
+			+ " does not apply to this filter");
+	}
+
+	const std::size_t hostRowBytes = std::size_t (image.width) * 4;
+	const std::size_t rowBytes = (hostRowBytes + RowAlignment - 1)
+		/ RowAlignment * RowAlignment;
+	const cl_int pitch = static_cast<cl_int> (rowBytes / 4);
+	const std::size_t pixelCount = std::size_t (image.width) * image.height;
+	const std::size_t w = image.width, h = image.height;
+
+	const auto inputBuffer = pool.Buffer (CL_MEM_READ_ONLY, rowBytes * h);
+	const auto outputBuffer = pool.Buffer (CL_MEM_WRITE_ONLY, rowBytes * h);
+
+	const std::size_t origin [3] = { 0 };
+	const std::size_t region [3] = { hostRowBytes, h, 1 };
+	CheckError (clEnqueueWriteBufferRect (queue, inputBuffer, CL_FALSE,
+		origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+		image.pixel.data (), 0, nullptr, Track (kernels.launch, "WriteBufferRect",
+		hostRowBytes * h)));
+
+	// All of them take input, weights, output, width, height and pitch
+	auto setArgs = [&] (cl_kernel kernel, cl_mem input, cl_mem output) {
+		SetKernelArg (kernel, 0, input);
+		SetKernelArg (kernel, 2, output);
+		SetKernelArg (kernel, 3, image.width);
+		SetKernelArg (kernel, 4, image.height);
+		SetKernelArg (kernel, 5, pitch);
+	};
+
+	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clEnqueueNDRangeKernel.html
+	if (path == LocalTiledPath) {
+		setArgs (kernels.local, inputBuffer, outputBuffer);
+
+		// The work-group size is fixed, so the range is rounded up to it
+		const std::size_t tile = LocalTileSize;
+		const std::size_t size [3] = { (w + tile - 1) / tile * tile, (h + tile - 1) / tile * tile, 1 };
+		const std::size_t localSize [3] = { tile, tile, 1 };
+		CheckError (clEnqueueNDRangeKernel (queue, kernels.local, 2, nullptr, size,
+			localSize, 0, nullptr, Track (kernels.launch, kernels.local,
+			FilterWork (pixelCount, 4, 4, kernels.filterSize))));
+	} else if (path == RegisterBlockedPath) {
+		setArgs (kernels.blocked, inputBuffer, outputBuffer);
+
+		const std::size_t size [3] = { w, (h + BlockRows - 1) / BlockRows, 1 };
+		CheckError (clEnqueueNDRangeKernel (queue, kernels.blocked, 2, nullptr, size,
+			nullptr, 0, nullptr, Track (kernels.launch, kernels.blocked,
+			FilterWork (pixelCount, 4, 4, kernels.filterSize))));
+	} else {
+		// The horizontal sums, as float4 with the same pitch
+		const auto rowsBuffer = pool.Buffer (CL_MEM_READ_WRITE, rowBytes * 4 * h);
+		setArgs (kernels.rows, inputBuffer, rowsBuffer);
+		setArgs (kernels.columns, rowsBuffer, outputBuffer);
+
+		// Each pass has 2 * filterSize + 1 taps, and moves a byte and a
+		// float pixel
+		const double taps = 2 * kernels.filterSize + 1;
+		const Work passWork = { 20.0 * pixelCount, 2.0 * taps * 4 * pixelCount };
+
+		const std::size_t size [3] = { w, h, 1 };
+		CheckError (clEnqueueNDRangeKernel (queue, kernels.rows, 2, nullptr, size,
+			nullptr, 0, nullptr, Track (kernels.launch, kernels.rows, passWork)));
+		CheckError (clEnqueueNDRangeKernel (queue, kernels.columns, 2, nullptr, size,
+			nullptr, 0, nullptr, Track (kernels.launch, kernels.columns, passWork)));
+	}
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (pixelCount * 4);
+
+	CheckError (clEnqueueReadBufferRect (queue, outputBuffer, CL_TRUE,
+		origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+		result.pixel.data (), 0, nullptr, Track (kernels.launch, "ReadBufferRect",
+		hostRowBytes * h)));
+
+	return result;
+}
+
+const char* FilterPathName (FilterPath path)
+{
+	switch (path) {
+	case BufferPath: return "buffer uchar4";
+	case BufferFloatPath: return "buffer float4";
+	case LocalTiledPath: return "local tiles";
+	case RegisterBlockedPath: return "register blocked";
+	case SeparablePath: return "separable";
+	default: return "image2d";
+	}
+}
+
+Image FilterImageWith (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, FilterPath path, const Image& image)
+{
+	switch (path) {
+	case BufferPath:
+		return FilterImageBuffer (pool, queue, kernels, false, image);
+	case BufferFloatPath:
+		return FilterImageBuffer (pool, queue, kernels, true, image);
+	case LocalTiledPath:
+	case RegisterBlockedPath:
+	case SeparablePath:
+		return FilterImageVariant (pool, queue, kernels, path, image);
+	default:
+		return FilterImage (pool, queue, kernels, image);
+	}
+}
+
+Image FilterImageResilient (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, FilterPath path, const Image& image)
+{
+	try {
+		return FilterImageWith (pool, queue, kernels, path, image);
+	} catch (const CLError& error) {
+		if (!error.IsResourceExhaustion ()) {
+			throw;
+		}
+		std::cerr << FilterPathName (path) << ": " << error.what () << std::endl;
+	}
+
+	// What the pool holds is likely what the tiles are short of
+	pool.Clear ();
+
+	for (int tileSize = MaxRetryTileSize; tileSize >= MinRetryTileSize; tileSize /= 2) {
+		try {
+			return FilterImageTiled (pool, queue, kernels, tileSize, image);
+		} catch (const CLError& error) {
+			if (!error.IsResourceExhaustion ()) {
+				throw;
+			}
+			std::cerr << tileSize << "x" << tileSize << " tiles: " << error.what () << std::endl;
+		}
+	}
+
+	std::cerr << "Falling back to the CPU filter" << std::endl;
+	return FilterImageCPU (kernels, image);
+}
+
+std::unique_ptr<PendingFilter> EnqueueFilterImage (BufferPool& pool,
+	cl_command_queue queue, const FilterKernels& kernels, FilterPath path,
+	const Image& image)
+{
+	if (path != ImagePath && path != BufferPath) {
+		throw std::invalid_argument (std::string (FilterPathName (path))
+			+ " cannot be enqueued");
+	}
+
+	std::unique_ptr<PendingFilter> pending (new PendingFilter);
+	pending->result.width = image.width;
+	pending->result.height = image.height;
+	pending->result.pixel.resize (image.pixel.size ());
+
+	const std::size_t origin [3] = { 0 };
+	cl_event done = nullptr;
+
+	if (path == ImagePath) {
+		pending->input = pool.Image2D (CL_MEM_READ_ONLY, image.width, image.height);
+		pending->output = pool.Image2D (CL_MEM_WRITE_ONLY, image.width, image.height);
+
+		const std::size_t region [3] = { std::size_t (image.width), std::size_t (image.height), 1 };
+		CheckError (clEnqueueWriteImage (queue, pending->input, CL_FALSE,
+			origin, region, 0, 0, image.pixel.data (), 0, nullptr,
+			Track (kernels.launch, "WriteImage", image.pixel.size ())));
+
+		SetKernelArg (kernels.image, 0, pending->input);
+		SetKernelArg (kernels.image, 2, pending->output);
+		SetKernelArg (kernels.imageInterior, 0, pending->input);
+		SetKernelArg (kernels.imageInterior, 2, pending->output);
+		EnqueueSplitFilter (queue, kernels.image, kernels.imageInterior,
+			kernels.launch, image.width, image.height, kernels.filterSize);
+
+		cl_event* const tracked = Track (kernels.launch, "ReadImage", image.pixel.size ());
+		CheckError (clEnqueueReadImage (queue, pending->output, CL_FALSE,
+			origin, region, 0, 0, pending->result.pixel.data (), 0, nullptr, &done));
+		pending->done = CLEvent (done);
+		ShareEvent (tracked, done);
+	} else {
+		const std::size_t hostRowBytes = std::size_t (image.width) * 4;
+		const std::size_t rowBytes = (hostRowBytes + RowAlignment - 1)
+			/ RowAlignment * RowAlignment;
+		const cl_int pitch = static_cast<cl_int> (rowBytes / 4);
+
+		pending->input = pool.Buffer (CL_MEM_READ_ONLY, rowBytes * image.height);
+		pending->output = pool.Buffer (CL_MEM_WRITE_ONLY, rowBytes * image.height);
+
+		const std::size_t region [3] = { hostRowBytes, std::size_t (image.height), 1 };
+		CheckError (clEnqueueWriteBufferRect (queue, pending->input, CL_FALSE,
+			origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+			image.pixel.data (), 0, nullptr, Track (kernels.launch, "WriteBufferRect",
+			hostRowBytes * image.height)));
+
+		SetKernelArg (kernels.buffer, 0, pending->input);
+		SetKernelArg (kernels.buffer, 2, pending->output);
+		SetKernelArg (kernels.buffer, 3, image.width);
+		SetKernelArg (kernels.buffer, 4, image.height);
+		SetKernelArg (kernels.buffer, 5, pitch);
+		SetKernelArg (kernels.bufferInterior, 0, pending->input);
+		SetKernelArg (kernels.bufferInterior, 2, pending->output);
+		SetKernelArg (kernels.bufferInterior, 3, pitch);
+		EnqueueSplitFilter (queue, kernels.buffer, kernels.bufferInterior,
+			kernels.launch, image.width, image.height, kernels.filterSize);
+
+		cl_event* const tracked = Track (kernels.launch, "ReadBufferRect",
+			hostRowBytes * image.height);
+		CheckError (clEnqueueReadBufferRect (queue, pending->output, CL_FALSE,
+			origin, origin, region, rowBytes, 0, hostRowBytes, 0,
+			pending->result.pixel.data (), 0, nullptr, &done));
+		pending->done = CLEvent (done);
+		ShareEvent (tracked, done);
+	}
+
+	CheckError (clFlush (queue));
+	return pending;
+}
+
+FilterPath CalibrateFilterPath (BufferPool& pool, cl_device_id device,
+	const FilterKernels& kernels, const Image& image, double* bestTimeOut)
+{
+	if (kernels.launch.profiler) {
+		throw std::invalid_argument ("Calibration cannot be profiled");
+	}
+
+	const CLCommandQueue queue = CreateCommandQueue (pool.Context (), device, 0);
+
+	std::cout << "Calibrating filter paths on " << GetDeviceName (device).c_str ()
+		<< " (" << image.width << "x" << image.height << ")" << std::endl;
+
+	FilterPath best = BufferPath;
+	double bestTime = 0, imageTime = 0;
+
+	for (const FilterVariant& variant : FilterVariants ()) {
+		const FilterPath path = variant.path;
+		if (const char* constraint = VariantConstraint (variant, device, kernels)) {
+			std::cout << "\t" << FilterPathName (path) << ": " << constraint << std::endl;
+			continue;
+		}
+
+		// One warm-up run, then the best of three
+		FilterImageWith (pool, queue, kernels, path, image);
+		double time = 0;
+		for (int run = 0; run < 3; ++run) {
+			const auto start = std::chrono::steady_clock::now ();
+			FilterImageWith (pool, queue, kernels, path, image);
+			const std::chrono::duration<double, std::milli> elapsed =
+				std::chrono::steady_clock::now () - start;
+
+			time = run ? std::min (time, elapsed.count ()) : elapsed.count ();
+		}
+
+		std::cout << "\t" << FilterPathName (path) << ": " << time << " ms";
+		if (path == ImagePath) {
+			imageTime = time;
+		} else if (imageTime > 0) {
+			std::cout << " (" << imageTime / time << "x vs. image2d)";
+		}
+		std::cout << std::endl;
+
+		if (bestTime == 0 || time < bestTime) {
+			best = path;
+			bestTime = time;
+		}
+	}
+
+	std::cout << "\tusing " << FilterPathName (best) << std::endl;
+
+	if (bestTimeOut) {
+		*bestTimeOut = bestTime;
+	}
+	return best;
+}
+
+Image FilterImagePlanar (BufferPool& pool, cl_command_queue queue,
+	const PlanarKernels& kernels, int vectorWidth, const Image& image)
+{
+	const std::size_t pixelCount = std::size_t (image.width) * image.height;
+	const cl_int count = static_cast<cl_int> (pixelCount);
+
+	const auto rgbBuffer = pool.Buffer (CL_MEM_READ_WRITE, pixelCount * 3);
+	const auto planes = pool.Buffer (CL_MEM_READ_WRITE, pixelCount * 3);
+	const auto filteredPlanes = pool.Buffer (CL_MEM_READ_WRITE, pixelCount * 3);
+
+	CheckError (clEnqueueWriteBuffer (queue, rgbBuffer, CL_FALSE, 0, pixelCount * 3,
+		image.pixel.data (), 0, nullptr, Track (kernels.launch, "WriteBuffer",
+		pixelCount * 3)));
+
+	SetKernelArg (kernels.deinterleave, 0, rgbBuffer);
+	SetKernelArg (kernels.deinterleave, 1, planes);
+	SetKernelArg (kernels.deinterleave, 2, count);
+
+	SetKernelArg (kernels.filter, 0, planes);
+	SetKernelArg (kernels.filter, 2, filteredPlanes);
+	SetKernelArg (kernels.filter, 3, image.width);
+	SetKernelArg (kernels.filter, 4, image.height);
+
+	// The result is interleaved back into the input buffer
+	SetKernelArg (kernels.interleave, 0, filteredPlanes);
+	SetKernelArg (kernels.interleave, 1, rgbBuffer);
+	SetKernelArg (kernels.interleave, 2, count);
+
+	std::size_t offset [3] = { 0 };
+	std::size_t pixels [3] = { pixelCount, 1, 1 };
+	// Deinterleave and Interleave read and write 3 bytes per pixel
+	const Work interleaveWork = { 6.0 * pixelCount, 0 };
+	CheckError (clEnqueueNDRangeKernel (queue, kernels.deinterleave, 1, offset, pixels, nullptr,
+		0, nullptr, Track (kernels.launch, kernels.deinterleave, interleaveWork)));
+
+	// One work item per VECTOR_WIDTH pixels of a row, the third dimension
+	// selects the plane
+	std::size_t size [3] = {
+		std::size_t ((image.width + vectorWidth - 1) / vectorWidth),
+		std::size_t (image.height), 3 };
+	const std::size_t local [3] = { kernels.launch.localSize [0], kernels.launch.localSize [1], 1 };
+	CheckError (clEnqueueNDRangeKernel (queue, kernels.filter, 3, offset, size,
+		LocalSize (kernels.launch, size) ? local : nullptr,
+		0, nullptr, Track (kernels.launch, kernels.filter,
+			FilterWork (pixelCount * 3, 1, 1, kernels.filterSize))));
+
+	CheckError (clEnqueueNDRangeKernel (queue, kernels.interleave, 1, offset, pixels, nullptr,
+		0, nullptr, Track (kernels.launch, kernels.interleave, interleaveWork)));
+
+	Image result;
+	result.width = image.width;
+	result.height = image.height;
+	result.pixel.resize (pixelCount * 3);
+
+	CheckError (clEnqueueReadBuffer (queue, rgbBuffer, CL_TRUE, 0, pixelCount * 3,
+		result.pixel.data (), 0, nullptr, Track (kernels.launch, "ReadBuffer",
+		pixelCount * 3)));
+
+	return result;
+}
+
+DevicePeaks MeasurePeaks (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels)
+{
+	// Large enough to stream past any cache
+	const std::size_t copyBytes = 32 << 20;
+	const auto input = pool.Buffer (CL_MEM_READ_ONLY, copyBytes);
+	const auto output = pool.Buffer (CL_MEM_WRITE_ONLY, copyBytes);
+	SetKernelArg (kernels.streamCopy, 0, input);
+	SetKernelArg (kernels.streamCopy, 1, output);
+
+	const cl_int iterations = 256;
+	const std::size_t flopItems = 1 << 20;
+	const auto flopOutput = pool.Buffer (CL_MEM_WRITE_ONLY, flopItems * sizeof (cl_float));
+	SetKernelArg (kernels.peakFlops, 0, flopOutput);
+	const cl_float scale = 0.5f;
+	SetKernelArg (kernels.peakFlops, 1, scale);
+	SetKernelArg (kernels.peakFlops, 2, iterations);
+
+	// Best of three runs after a warm-up, timed on the host so the queue
+	// need not have profiling enabled
+	const auto bestTime = [queue] (cl_kernel kernel, std::size_t items) {
+		double best = 0;
+		for (int run = 0; run < 4; ++run) {
+			const auto start = std::chrono::steady_clock::now ();
+			CheckError (clEnqueueNDRangeKernel (queue, kernel, 1, nullptr, &items,
+				nullptr, 0, nullptr, nullptr));
+			CheckError (clFinish (queue));
+			const std::chrono::duration<double> elapsed =
+				std::chrono::steady_clock::now () - start;
+
+			if (run > 0 && (best == 0 || elapsed.count () < best)) {
+				best = elapsed.count ();
+			}
+		}
+		return best;
+	};
+
+	DevicePeaks peaks;
+	peaks.bandwidth = 2.0 * copyBytes / bestTime (kernels.streamCopy,
+		copyBytes / (4 * sizeof (cl_float)));
+	peaks.flops = 32.0 * iterations * flopItems / bestTime (kernels.peakFlops,
+		flopItems);
+	return peaks;
+}
+
+int MaxDifference (const Image& a, const Image& b)
+{
+	int result = 0;
+	for (std::size_t i = 0; i < a.pixel.size (); ++i) {
+		const int d = static_cast<unsigned char> (a.pixel [i])
+			- static_cast<unsigned char> (b.pixel [i]);
+		result = std::max (result, std::abs (d));
+	}
+
+	return result;
+}
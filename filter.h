@@ -0,0 +1,294 @@
+#ifndef CLTUT_FILTER_H
+#define CLTUT_FILTER_H
+
+#include "bufferpool.h"
+#include "clhandle.h"
+#include "image.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Profiler;
+class TileCache;
+
+// How the filter functions launch their kernels
+struct LaunchSettings
+{
+	LaunchSettings ();
+
+	// Work-group size of the 2D launches, 0 lets the runtime choose. Only
+	// used for the launches whose size it divides, the kernels do not
+	// handle padded ranges.
+	std::size_t localSize [2];
+
+	// Gets every device command if not null
+	Profiler* profiler;
+};
+
+// The kernels of one build of kernels/image.cl. Their filter weights
+// argument is bound once when they are created.
+struct FilterKernels
+{
+	// FILTER_SIZE and BORDER_MODE the program was built with
+	int filterSize;
+	int borderMode;
+
+	// Host copy of the weights for the CPU fallback
+	std::vector<float> weights;
+
+	LaunchSettings launch;
+
+	// Handle any pixel, used for the borders
+	CLKernel image;
+	CLKernel buffer;
+	CLKernel bufferFloat;
+
+	// Unchecked versions for the interior
+	CLKernel imageInterior;
+	CLKernel bufferInterior;
+
+	// Many images per launch, see FilterImageBatch
+	CLKernel batch;
+
+	// The other variants of the buffer filter, see FilterImageVariant.
+	// local is null unless the program was built with LOCAL_TILE.
+	CLKernel local;
+	CLKernel blocked;
+	CLKernel rows;
+	CLKernel columns;
+
+	// Set if the current weights are separable, and rows and columns have
+	// their factors
+	bool separable;
+
+	// Micro-benchmarks for MeasurePeaks
+	CLKernel streamCopy;
+	CLKernel peakFlops;
+};
+
+struct PlanarKernels
+{
+	int filterSize;
+	LaunchSettings launch;
+
+	CLKernel deinterleave;
+	CLKernel filter;
+	CLKernel interleave;
+};
+
+// The implementations of the RGBA filter, see FilterVariants in
+// variants.h for what each of them needs
+enum FilterPath
+{
+	ImagePath,
+	BufferPath,
+	BufferFloatPath,
+	LocalTiledPath,
+	RegisterBlockedPath,
+	SeparablePath
+};
+
+// Work-group side of FilterBufferLocal, LOCAL_TILE in kernels/image.cl
+const int LocalTileSize = 16;
+
+// Rows per work item of FilterBufferBlocked, BLOCK_ROWS in kernels/image.cl
+const int BlockRows = 4;
+
+const char* FilterPathName (FilterPath path);
+
+// All filter functions take RGBA images unless noted otherwise, and get
+// their device memory from the pool. They return once the result is on
+// the host.
+Image FilterImage (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, const Image& image);
+
+// Filters with FilterBuffer, or FilterBufferFloat if floatPixels is set.
+// Float pixels keep the 0-255 range of the bytes, and are filtered in a
+// single launch without an interior split.
+Image FilterImageBuffer (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, bool floatPixels, const Image& image);
+
+// Filters with FilterBufferLocal, FilterBufferBlocked or the separable
+// FilterRows and FilterColumns, each in a single launch over the whole
+// image which handles the borders itself
+Image FilterImageVariant (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, FilterPath path, const Image& image);
+
+Image FilterImageWith (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, FilterPath path, const Image& image);
+
+// Filters an RGBA image tile by tile, reusing the results of tiles whose
+// input was seen before. filterHash identifies the filter weights.
+//
+// Each tile is copied out together with its FILTER_SIZE halo, with the
+// border mode applied on the host, so its output only depends on that copy
+// and it can serve as the cache key. The tiles which miss are stacked into
+// one buffer and filtered in a single FilterBufferInterior launch.
+// deviceTime accumulates the milliseconds spent on the misses.
+Image FilterImageCached (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, TileCache& cache, int tileSize,
+	std::uint64_t filterHash, const Image& image, double& deviceTime);
+
+// Filters one tile of at most tileSize x tileSize pixels at a time, so the
+// device only needs memory for a single tile and its halo. Used when the
+// whole image does not fit.
+Image FilterImageTiled (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, int tileSize, const Image& image);
+
+// Tiles FilterImageTiled keeps in flight at most
+const std::size_t MaxTilesInFlight = 3;
+
+// The same with the tiles scheduled through a CommandGraph, so that with an
+// out-of-order queue or several in-order ones the upload, kernel and
+// readback of different tiles overlap. Up to maxSlots tiles are in flight
+// then, each with device memory of its own.
+Image FilterImageTiled (BufferPool& pool, const std::vector<cl_command_queue>& queues,
+	const FilterKernels& kernels, int tileSize, const Image& image,
+	std::size_t maxSlots = MaxTilesInFlight);
+
+// A filter whose commands were enqueued but may not have run yet. Keeps the
+// device memory and the result they use until it is destroyed, which must
+// not happen before done completed.
+struct PendingFilter
+{
+	BufferPool::Lease input;
+	BufferPool::Lease output;
+	Image result;
+
+	// The readback into result, the last command
+	CLEvent done;
+};
+
+// Enqueues what FilterImage, or FilterImageBuffer with byte pixels for
+// BufferPath, would run, without waiting for any of it, and flushes the
+// queue so it starts. image must stay valid until done completed. Throws
+// std::invalid_argument for the other paths.
+std::unique_ptr<PendingFilter> EnqueueFilterImage (BufferPool& pool,
+	cl_command_queue queue, const FilterKernels& kernels, FilterPath path,
+	const Image& image);
+
+// One device's part in FilterImageDynamic. A thread of its own submits to
+// it, so it needs its own kernel objects (their arguments are per object)
+// and its own pool; of the kernels, only bufferInterior is used.
+struct DeviceLane
+{
+	cl_command_queue queue;
+	const FilterKernels* kernels;
+	BufferPool* pool;
+
+	// Set by FilterImageDynamic: the tiles the device filtered, and the
+	// seconds it spent on them
+	std::size_t tiles;
+	double busy;
+};
+
+// Filters an RGBA image in tileSize x tileSize tiles on all lanes at once.
+// The tiles are not split up front: each lane's thread takes the next one
+// from a shared counter whenever it finished its last, so a fast device
+// filters more of them than one which is throttled or shared. Each tile is
+// uploaded together with its FILTER_SIZE halo and read back straight into
+// its place in the result. If a lane fails, its tile goes back to the
+// others and it stops; the first error is thrown only if all of them
+// failed.
+Image FilterImageDynamic (std::vector<DeviceLane>& lanes, int tileSize,
+	const Image& image);
+
+// Filters many small RGBA images, e.g. thumbnails, with a single launch, so
+// the per-launch overhead is paid once for all of them. Each image goes to
+// a slice of one buffer, as large as the largest image, so the batch should
+// hold images of similar sizes; the slice sizes are passed in a second
+// buffer. Returns the results in the order of the inputs.
+std::vector<Image> FilterImageBatch (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, const std::vector<Image>& images);
+
+// Host version of FilterBuffer, the last resort when the device cannot
+// filter the image at all
+Image FilterImageCPU (const FilterKernels& kernels, const Image& image);
+
+// Filters with the given path. If the device runs out of memory, empties
+// the pool and retries in tiles of halving size, and when even the
+// smallest tile fails, filters on the CPU. Any other error is passed on.
+Image FilterImageResilient (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels, FilterPath path, const Image& image);
+
+// Runs every filter variant the device and kernels allow on the given RGBA
+// image on one device and returns the fastest, and its time in ms in
+// bestTime if given. The time includes the transfers, since emulated images
+// usually cost the most when they are created and read back. The runs go
+// to a queue of their own without profiling, so kernels.launch must not
+// have a profiler.
+FilterPath CalibrateFilterPath (BufferPool& pool, cl_device_id device,
+	const FilterKernels& kernels, const Image& image, double* bestTime = nullptr);
+
+// Filters an RGB image using the planar layout. The conversion to and from
+// planes runs on the device, so no RGBA expansion is needed on the host.
+Image FilterImagePlanar (BufferPool& pool, cl_command_queue queue,
+	const PlanarKernels& kernels, int vectorWidth, const Image& image);
+
+// What a device achieves at best, the roof of a roofline model
+struct DevicePeaks
+{
+	// Bytes per second of a streaming copy, counting the read and the write
+	double bandwidth;
+
+	// Single precision multiply-adds, counted as two FLOPs each, per second
+	double flops;
+};
+
+// Measures the peaks with the StreamCopy and PeakFlops kernels. Takes a
+// fraction of a second on most devices.
+DevicePeaks MeasurePeaks (BufferPool& pool, cl_command_queue queue,
+	const FilterKernels& kernels);
+
+// Largest difference of any channel of two images of the same size
+int MaxDifference (const Image& a, const Image& b);
+
+// Host version of BorderCoordinate in kernels/image.cl
+int BorderCoordinate (int i, int size, int borderMode);
+
+struct Rect
+{
+	int x, y, width, height;
+};
+
+// Grows a rectangle by margin pixels on every side and clips it to the image
+Rect ExpandRect (const Rect& rect, int margin, int width, int height);
+
+// Copies rect out of an RGBA image together with margin pixels on every
+// side, which are read with the border mode where they fall outside the
+// image. Filtering the copy gives the right result for rect whatever the
+// kernel does at the copy's own border, if margin is the filter size.
+Image CropImage (const Image& image, const Rect& rect, int margin, int borderMode);
+
+// Keeps the input and output image of one frame size on the device, so
+// that after the first frame only the rectangles which changed need to be
+// uploaded, filtered and read back. Uses the image2d path.
+class RegionFilter
+{
+public:
+	RegionFilter (cl_context context, cl_command_queue queue,
+		const FilterKernels& kernels, int width, int height);
+
+	// Filters a whole RGBA frame
+	Image Filter (const Image& image);
+
+	// Updates result, the output of the previous frame, for a new frame in
+	// which only the dirty rectangles differ from the previous one
+	void FilterRegions (const Image& image, const std::vector<Rect>& dirty,
+		Image& result);
+
+private:
+	void SetArguments ();
+	void Upload (const Image& image, const Rect& rect);
+	void Download (Image& result, const Rect& rect);
+
+	cl_command_queue queue_;
+	const FilterKernels& kernels_;
+	int width_, height_;
+	CLMem input_;
+	CLMem output_;
+};
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef CLTUT_HASH_H
+#define CLTUT_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+// 64 bit xxHash (XXH64) of a buffer, compatible with the reference
+// implementation on little-endian machines
+std::uint64_t XXH64 (const void* data, std::size_t size, std::uint64_t seed);
+
+#endif
@@ -0,0 +1,204 @@
+#include "hugepages.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+
+namespace {
+std::atomic<int> hugePageMode (HugePagesOff);
+std::atomic<std::size_t> hugePageFallbacks (0);
+
+// A fresh mapping page faults on every first touch, which costs as much as
+// a whole conversion of the frame, so like malloc we keep a few freed
+// mappings for the next frames, up to a total size. Every mapping
+// remembers the mode it was asked for, so only one of the same mode is
+// reused and the spares go when the mode changes, and the mode it actually
+// got, which differs when explicit huge pages fell back.
+const std::size_t MaxSpareMappings = 4;
+const std::size_t MaxSpareBytes = std::size_t (256) << 20;
+
+struct Mapping
+{
+	void* memory;
+	std::size_t size;
+	HugePageMode requested;
+	HugePageMode mode;
+};
+
+std::mutex mappingMutex;
+std::map<void*, Mapping> liveMappings;
+std::vector<Mapping> spareMappings;
+std::size_t spareBytes = 0;
+
+void Unmap (const std::vector<Mapping>& mappings)
+{
+	for (const Mapping& mapping : mappings) {
+		munmap (mapping.memory, mapping.size);
+	}
+}
+
+// Large allocations are mapped in whole huge pages, so that a mapping of
+// any mode has the same length and FreeHostMemory need not know the mode
+std::size_t MappedSize (std::size_t bytes)
+{
+	return (bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+}
+
+void* Map (std::size_t size, int flags)
+{
+	void* memory = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return memory == MAP_FAILED ? nullptr : memory;
+}
+
+// Maps size bytes at a HugePageSize boundary, which the kernel can only
+// back with huge pages if the mapping is aligned. Maps one huge page more
+// and unmaps the ends which are left over.
+void* MapAligned (std::size_t size)
+{
+	char* const memory = static_cast<char*> (Map (size + HugePageSize, 0));
+	if (!memory) {
+		return nullptr;
+	}
+
+	const std::uintptr_t address = reinterpret_cast<std::uintptr_t> (memory);
+	const std::size_t head = (HugePageSize - address % HugePageSize) % HugePageSize;
+	if (head > 0) {
+		munmap (memory, head);
+	}
+	munmap (memory + head + size, HugePageSize - head);
+
+	return memory + head;
+}
+}
+
+void SetHugePageMode (HugePageMode mode)
+{
+	std::vector<Mapping> released;
+	{
+		std::lock_guard<std::mutex> lock (mappingMutex);
+		if (hugePageMode.exchange (mode) != mode) {
+			released.swap (spareMappings);
+			spareBytes = 0;
+		}
+	}
+
+	Unmap (released);
+}
+
+HugePageMode GetHugePageMode ()
+{
+	return static_cast<HugePageMode> (hugePageMode.load ());
+}
+
+std::size_t HugePageFallbacks ()
+{
+	return hugePageFallbacks;
+}
+
+void* AllocateHostMemory (std::size_t bytes)
+{
+	if (bytes < HugePageSize) {
+		return ::operator new (bytes);
+	}
+
+	const std::size_t size = MappedSize (bytes);
+	const HugePageMode mode = GetHugePageMode ();
+
+	{
+		std::lock_guard<std::mutex> lock (mappingMutex);
+		for (auto spare = spareMappings.begin (); spare != spareMappings.end (); ++spare) {
+			if (spare->size == size && spare->requested == mode) {
+				if (spare->mode != mode) {
+					++hugePageFallbacks;
+				}
+				void* const memory = spare->memory;
+				spareBytes -= spare->size;
+				liveMappings [memory] = *spare;
+				spareMappings.erase (spare);
+				return memory;
+			}
+		}
+	}
+
+	void* memory = nullptr;
+	HugePageMode mapped = mode;
+
+#ifdef MAP_HUGETLB
+	if (mode == HugePagesExplicit) {
+		memory = Map (size, MAP_HUGETLB);
+		if (!memory) {
+			++hugePageFallbacks;
+			mapped = HugePagesTransparent;
+		}
+	}
+#else
+	if (mode == HugePagesExplicit) {
+		mapped = HugePagesTransparent;
+	}
+#endif
+
+	if (memory) {
+		// Explicit huge pages
+	} else if (mode == HugePagesOff) {
+		memory = Map (size, 0);
+	} else {
+		memory = MapAligned (size);
+#ifdef MADV_HUGEPAGE
+		// Fails with EINVAL on kernels without transparent huge pages, which
+		// just leaves the small pages
+		if (memory) {
+			madvise (memory, size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	if (!memory) {
+		throw std::bad_alloc ();
+	}
+
+	const Mapping mapping = { memory, size, mode, mapped };
+	std::lock_guard<std::mutex> lock (mappingMutex);
+	liveMappings [memory] = mapping;
+	return memory;
+}
+
+void FreeHostMemory (void* memory, std::size_t bytes)
+{
+	if (!memory) {
+		return;
+	}
+
+	if (bytes < HugePageSize) {
+		::operator delete (memory);
+		return;
+	}
+
+	std::vector<Mapping> released;
+	{
+		std::lock_guard<std::mutex> lock (mappingMutex);
+		const auto live = liveMappings.find (memory);
+		const Mapping mapping = live->second;
+		liveMappings.erase (live);
+
+		// The oldest spare mappings make room for this one. One larger than
+		// all spares together, or of an older mode, is not kept.
+		if (mapping.size > MaxSpareBytes || mapping.requested != GetHugePageMode ()) {
+			released.push_back (mapping);
+		} else {
+			spareMappings.push_back (mapping);
+			spareBytes += mapping.size;
+			while (spareMappings.size () > MaxSpareMappings || spareBytes > MaxSpareBytes) {
+				released.push_back (spareMappings.front ());
+				spareBytes -= spareMappings.front ().size;
+				spareMappings.erase (spareMappings.begin ());
+			}
+		}
+	}
+
+	Unmap (released);
+}
@@ -0,0 +1,80 @@
+#ifndef CLTUT_HUGEPAGES_H
+#define CLTUT_HUGEPAGES_H
+
+#include <cstddef>
+#include <new>
+
+// How host memory of HugePageSize bytes or more is backed. Off leaves the
+// pages to the kernel's defaults; Transparent aligns the mapping to 2 MiB
+// and asks for transparent huge pages with madvise (MADV_HUGEPAGE);
+// Explicit maps pages from the hugetlbfs pool with MAP_HUGETLB, and falls
+// back to Transparent when the pool is empty or not configured. Where a
+// mode is not supported, the pages silently stay small.
+//
+// https://www.kernel.org/doc/html/latest/admin-guide/mm/transhuge.html
+// https://www.kernel.org/doc/html/latest/admin-guide/mm/hugetlbpage.html
+enum HugePageMode
+{
+	HugePagesOff,
+	HugePagesTransparent,
+	HugePagesExplicit
+};
+
+const std::size_t HugePageSize = std::size_t (2) << 20;
+
+// Applies to allocations made afterwards, memory allocated before is
+// released correctly whatever the mode is by then
+void SetHugePageMode (HugePageMode mode);
+HugePageMode GetHugePageMode ();
+
+// Number of allocations which asked for explicit huge pages and got
+// transparent ones instead, counting reused mappings which had fallen back
+std::size_t HugePageFallbacks ();
+
+// Allocates bytes of host memory, from their own mapping from HugePageSize
+// bytes up and from operator new below. Throws std::bad_alloc.
+void* AllocateHostMemory (std::size_t bytes);
+
+// Releases memory of AllocateHostMemory, bytes must be the same
+void FreeHostMemory (void* memory, std::size_t bytes);
+
+// Standard allocator over AllocateHostMemory, so containers of large frames
+// follow the huge page mode
+template <typename T>
+class HugePageAllocator
+{
+public:
+	typedef T value_type;
+
+	HugePageAllocator () {}
+
+	template <typename U>
+	HugePageAllocator (const HugePageAllocator<U>&) {}
+
+	T* allocate (std::size_t count)
+	{
+		if (count > std::size_t (-1) / sizeof (T)) {
+			throw std::bad_alloc ();
+		}
+		return static_cast<T*> (AllocateHostMemory (count * sizeof (T)));
+	}
+
+	void deallocate (T* memory, std::size_t count)
+	{
+		FreeHostMemory (memory, count * sizeof (T));
+	}
+};
+
+template <typename T, typename U>
+bool operator== (const HugePageAllocator<T>&, const HugePageAllocator<U>&)
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!= (const HugePageAllocator<T>&, const HugePageAllocator<U>&)
+{
+	return false;
+}
+
+#endif
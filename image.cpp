@@ -0,0 +1,218 @@
+#include "image.h"
+
+#include "threadpool.h"
+#include "trace.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+Image LoadImage (const char* path)
+{
+	TraceSpan span ("LoadImage");
+	std::ifstream in (path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error (std::string (path) + ": cannot open file");
+	}
+
+	std::string s;
+	in >> s;
+
+	if (s != "P6") {
+		throw std::runtime_error (std::string (path) + ": not a binary PPM file");
+	}
+
+	// Skip comments
+	for (;;) {
+		getline (in, s);
+
+		if (s.empty ()) {
+			continue;
+		}
+
+		if (s [0] != '#') {
+			break;
+		}
+	}
+
+	std::stringstream str (s);
+	int width, height, maxColor;
+	str >> width >> height;
+	in >> maxColor;
+
+	if (maxColor != 255) {
+		throw std::runtime_error (std::string (path) + ": only 8 bit PPM files are supported");
+	}
+
+	{
+		// Skip until end of line
+		std::string tmp;
+		getline(in, tmp);
+	}
+
+	PixelBuffer data (width * height * 3);
+	in.read (reinterpret_cast<char*> (data.data ()), data.size ());
+	if (!in) {
+		throw std::runtime_error (std::string (path) + ": truncated pixel data");
+	}
+
+	const Image img = { data, width, height };
+	return img;
+}
+
+void SaveImage (const Image& img, const char* path)
+{
+	TraceSpan span ("SaveImage");
+	std::ofstream out (path, std::ios::binary);
+
+	out << FormatPPMHeader (img.width, img.height);
+	out.write (img.pixel.data (), img.pixel.size ());
+
+	if (!out) {
+		throw std::runtime_error (std::string (path) + ": cannot write file");
+	}
+}
+
+namespace {
+// Converts pixels [begin, end) of an image
+void ExpandPixels (const char* rgb, char* rgba, std::size_t begin, std::size_t end)
+{
+	for (std::size_t i = begin; i < end; ++i) {
+		rgba [4 * i + 0] = rgb [3 * i + 0];
+		rgba [4 * i + 1] = rgb [3 * i + 1];
+		rgba [4 * i + 2] = rgb [3 * i + 2];
+		rgba [4 * i + 3] = 0;
+	}
+}
+
+void DropAlpha (const char* rgba, char* rgb, std::size_t begin, std::size_t end)
+{
+	for (std::size_t i = begin; i < end; ++i) {
+		rgb [3 * i + 0] = rgba [4 * i + 0];
+		rgb [3 * i + 1] = rgba [4 * i + 1];
+		rgb [3 * i + 2] = rgba [4 * i + 2];
+	}
+}
+
+Image WithSize (const Image& input, std::size_t channels)
+{
+	Image result;
+	result.width = input.width;
+	result.height = input.height;
+	result.pixel.resize (std::size_t (input.width) * input.height * channels);
+	return result;
+}
+
+// Pixels per band of the pooled conversions, enough to pay for the task
+const std::size_t ConvertGrain = 64 * 1024;
+}
+
+Image RGBtoRGBA (const Image& input)
+{
+	TraceSpan span ("RGBtoRGBA");
+	Image result = WithSize (input, 4);
+	ExpandPixels (input.pixel.data (), result.pixel.data (), 0, input.pixel.size () / 3);
+	return result;
+}
+
+Image RGBAtoRGB (const Image& input)
+{
+	TraceSpan span ("RGBAtoRGB");
+	Image result = WithSize (input, 3);
+	DropAlpha (input.pixel.data (), result.pixel.data (), 0, input.pixel.size () / 4);
+	return result;
+}
+
+Image RGBtoRGBA (const Image& input, ThreadPool& pool)
+{
+	TraceSpan span ("RGBtoRGBA");
+	Image result = WithSize (input, 4);
+	pool.ParallelFor (input.pixel.size () / 3, ConvertGrain,
+		[&] (std::size_t begin, std::size_t end) {
+			ExpandPixels (input.pixel.data (), result.pixel.data (), begin, end);
+		});
+	return result;
+}
+
+Image RGBAtoRGB (const Image& input, ThreadPool& pool)
+{
+	TraceSpan span ("RGBAtoRGB");
+	Image result = WithSize (input, 3);
+	pool.ParallelFor (input.pixel.size () / 4, ConvertGrain,
+		[&] (std::size_t begin, std::size_t end) {
+			DropAlpha (input.pixel.data (), result.pixel.data (), begin, end);
+		});
+	return result;
+}
+
+namespace {
+bool IsSpace (char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Skips whitespace and '#' comments, then reads one decimal number
+bool ReadHeaderNumber (const char* data, std::size_t size,
+	std::size_t& pos, int& value)
+{
+	for (;;) {
+		while (pos < size && IsSpace (data [pos])) {
+			++pos;
+		}
+
+		if (pos < size && data [pos] == '#') {
+			while (pos < size && data [pos] != '\n') {
+				++pos;
+			}
+			continue;
+		}
+
+		break;
+	}
+
+	if (pos == size || data [pos] < '0' || data [pos] > '9') {
+		return false;
+	}
+
+	value = 0;
+	while (pos < size && data [pos] >= '0' && data [pos] <= '9') {
+		value = value * 10 + (data [pos] - '0');
+		++pos;
+	}
+
+	return true;
+}
+}
+
+bool ParsePPMHeader (const char* data, std::size_t size,
+	int& width, int& height, std::size_t& headerSize)
+{
+	if (size < 2 || data [0] != 'P' || data [1] != '6') {
+		return false;
+	}
+
+	std::size_t pos = 2;
+	int maxColor = 0;
+	if (!ReadHeaderNumber (data, size, pos, width)
+		|| !ReadHeaderNumber (data, size, pos, height)
+		|| !ReadHeaderNumber (data, size, pos, maxColor)) {
+		return false;
+	}
+
+	if (maxColor != 255 || pos == size || !IsSpace (data [pos])) {
+		return false;
+	}
+
+	// Exactly one whitespace character separates the header from the pixels
+	headerSize = pos + 1;
+	return true;
+}
+
+std::string FormatPPMHeader (int width, int height)
+{
+	std::ostringstream out;
+	out << "P6\n";
+	out << width << " " << height << "\n";
+	out << "255\n";
+	return out.str ();
+}
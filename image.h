@@ -0,0 +1,43 @@
+#ifndef CLTUT_IMAGE_H
+#define CLTUT_IMAGE_H
+
+#include "hugepages.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// Pixel storage, on huge pages for large frames if SetHugePageMode asks
+// for them
+typedef std::vector<char, HugePageAllocator<char>> PixelBuffer;
+
+struct Image
+{
+	PixelBuffer pixel;
+	int width, height;
+};
+
+// Both throw std::runtime_error on I/O errors, LoadImage also if the file
+// is not an 8 bit binary PPM
+Image LoadImage (const char* path);
+void SaveImage (const Image& img, const char* path);
+
+Image RGBtoRGBA (const Image& input);
+Image RGBAtoRGB (const Image& input);
+
+// The same, split into bands of pixels which run on the pool
+Image RGBtoRGBA (const Image& input, ThreadPool& pool);
+Image RGBAtoRGB (const Image& input, ThreadPool& pool);
+
+// Parses a binary PPM (P6) header from an in-memory buffer. On success,
+// headerSize is the byte offset of the first pixel. Returns false if the
+// header is malformed, not 8 bit, or not fully contained in the buffer.
+bool ParsePPMHeader (const char* data, std::size_t size,
+	int& width, int& height, std::size_t& headerSize);
+
+// Returns the header SaveImage writes for an image of the given size
+std::string FormatPPMHeader (int width, int height);
+
+#endif
@@ -1,14 +1,53 @@
+#define BORDER_CLAMP 0
+#define BORDER_MIRROR 1
+#define BORDER_WRAP 2
+#define BORDER_CONSTANT 3
+
+#ifndef BORDER_MODE
+#define BORDER_MODE BORDER_CLAMP
+#endif
+
 __constant sampler_t sampler =
   CLK_NORMALIZED_COORDS_FALSE
 | CLK_ADDRESS_CLAMP_TO_EDGE
 | CLK_FILTER_NEAREST;
 
+// Only used where every read is known to be inside the image
+__constant sampler_t interiorSampler =
+  CLK_NORMALIZED_COORDS_FALSE
+| CLK_ADDRESS_NONE
+| CLK_FILTER_NEAREST;
+
 float FilterValue (__constant const float* filterWeights,
 	const int x, const int y)
 {
 	return filterWeights[(x+FILTER_SIZE) + (y+FILTER_SIZE)*(FILTER_SIZE*2 + 1)];
 }
 
+// Maps a coordinate which may be outside [0, size) to the one that is read
+// for it under BORDER_MODE. Returns -1 if the constant border (zero) should
+// be used instead.
+int BorderCoordinate (int i, const int size)
+{
+#if BORDER_MODE == BORDER_MIRROR
+    // Mirrored repeat, the edge pixel is repeated once: -1 -> 0, size -> size-1
+    i = i % (2*size);
+    if (i < 0) {
+        i += 2*size;
+    }
+    return i < size ? i : 2*size - 1 - i;
+#elif BORDER_MODE == BORDER_WRAP
+    i = i % size;
+    return i < 0 ? i + size : i;
+#elif BORDER_MODE == BORDER_CONSTANT
+    return (i < 0 || i >= size) ? -1 : i;
+#else
+    return clamp(i, 0, size - 1);
+#endif
+}
+
+// Handles any pixel, including the borders. The host launches it over the
+// strips around the interior region, or over the whole image.
 __kernel void Filter (
 	__read_only image2d_t input,
 	__constant float* filterWeights,
@@ -16,14 +55,511 @@ __kernel void Filter (
 {
 
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    const int2 size = get_image_dim(input);
 
     float4 sum = (float4)(0.0f);
     for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        const int sy = BorderCoordinate(pos.y + y, size.y);
         for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            const int sx = BorderCoordinate(pos.x + x, size.x);
+            if (sx < 0 || sy < 0) {
+                continue;
+            }
+
             sum += FilterValue(filterWeights, x, y)
-                * read_imagef(input, sampler, pos + (int2)(x,y));
+                * read_imagef(input, sampler, (int2)(sx, sy));
         }
     }
 
     write_imagef (output, (int2)(pos.x, pos.y), sum);
-}
\ No newline at end of file
+}
+
+// Pixels at least FILTER_SIZE away from every edge, launched with a global
+// offset of FILTER_SIZE. No read can leave the image, so there is no address
+// handling at all.
+__kernel void FilterInterior (
+	__read_only image2d_t input,
+	__constant float* filterWeights,
+	__write_only image2d_t output)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    float4 sum = (float4)(0.0f);
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            sum += FilterValue(filterWeights, x, y)
+                * read_imagef(input, interiorSampler, pos + (int2)(x,y));
+        }
+    }
+
+    write_imagef (output, pos, sum);
+}
+
+// Buffer versions of Filter for devices where image2d_t and samplers are
+// emulated. Pixels are stored row by row with a pitch (in pixels) that the
+// host pads so every row starts on an aligned address; the border handling
+// the sampler would do is done explicitly.
+__kernel void FilterBuffer (
+	__global const uchar4* input,
+	__constant float* filterWeights,
+	__global uchar4* output,
+	const int width,
+	const int height,
+	const int pitch)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if (x >= width || y >= height) {
+        return;
+    }
+
+    float4 sum = (float4)(0.0f);
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+        const int sy = BorderCoordinate(y + dy, height);
+        if (sy < 0) {
+            continue;
+        }
+
+        __global const uchar4* row = input + sy * pitch;
+        for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+            const int sx = BorderCoordinate(x + dx, width);
+            if (sx < 0) {
+                continue;
+            }
+
+            sum += FilterValue(filterWeights, dx, dy)
+                * convert_float4(row[sx]);
+        }
+    }
+
+    output[y * pitch + x] = convert_uchar4_sat_rte(sum);
+}
+
+// Interior counterpart of FilterBuffer, see FilterInterior. The launch
+// covers exactly the interior, so neither the size nor any index is checked.
+__kernel void FilterBufferInterior (
+	__global const uchar4* input,
+	__constant float* filterWeights,
+	__global uchar4* output,
+	const int pitch)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    __global const uchar4* center = input + y * pitch + x;
+
+    float4 sum = (float4)(0.0f);
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+        __global const uchar4* row = center + dy * pitch;
+        for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+            sum += FilterValue(filterWeights, dx, dy)
+                * convert_float4(row[dx]);
+        }
+    }
+
+    output[y * pitch + x] = convert_uchar4_sat_rte(sum);
+}
+
+// FilterBuffer for work-groups of LOCAL_TILE x LOCAL_TILE, which first copy
+// their pixels and halo into local memory, so each input pixel is read from
+// global memory once per group rather than once per filter tap. Only built
+// if the host found the tile fits the local memory of every device, and
+// launched with exactly that work-group size over a global size rounded up
+// to it.
+#ifdef LOCAL_TILE
+#define LOCAL_SPAN (LOCAL_TILE + 2*FILTER_SIZE)
+
+__kernel __attribute__((reqd_work_group_size(LOCAL_TILE, LOCAL_TILE, 1)))
+void FilterBufferLocal (
+	__global const uchar4* input,
+	__constant float* filterWeights,
+	__global uchar4* output,
+	const int width,
+	const int height,
+	const int pitch)
+{
+    __local uchar4 tile[LOCAL_SPAN * LOCAL_SPAN];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int x0 = get_group_id(0) * LOCAL_TILE - FILTER_SIZE;
+    const int y0 = get_group_id(1) * LOCAL_TILE - FILTER_SIZE;
+
+    for(int ty = ly; ty < LOCAL_SPAN; ty += LOCAL_TILE) {
+        const int sy = BorderCoordinate(y0 + ty, height);
+        for(int tx = lx; tx < LOCAL_SPAN; tx += LOCAL_TILE) {
+            const int sx = BorderCoordinate(x0 + tx, width);
+            tile[ty * LOCAL_SPAN + tx] = (sx < 0 || sy < 0)
+                ? (uchar4)(0) : input[sy * pitch + sx];
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Only after the barrier, which every work item has to reach
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) {
+        return;
+    }
+
+    __local const uchar4* center = tile + (ly + FILTER_SIZE) * LOCAL_SPAN + lx + FILTER_SIZE;
+
+    float4 sum = (float4)(0.0f);
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+        __local const uchar4* row = center + dy * LOCAL_SPAN;
+        for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+            sum += FilterValue(filterWeights, dx, dy)
+                * convert_float4(row[dx]);
+        }
+    }
+
+    output[y * pitch + x] = convert_uchar4_sat_rte(sum);
+}
+#endif
+
+// FilterBuffer for BLOCK_ROWS vertically adjacent pixels per work item. Each
+// input row of their combined footprint is read once and feeds every one of
+// the sums, which stay in registers, instead of being read by each pixel.
+#ifndef BLOCK_ROWS
+#define BLOCK_ROWS 4
+#endif
+
+__kernel void FilterBufferBlocked (
+	__global const uchar4* input,
+	__constant float* filterWeights,
+	__global uchar4* output,
+	const int width,
+	const int height,
+	const int pitch)
+{
+    const int x = get_global_id(0);
+    const int y0 = get_global_id(1) * BLOCK_ROWS;
+
+    if (x >= width || y0 >= height) {
+        return;
+    }
+
+    float4 sum[BLOCK_ROWS];
+    for(int i = 0; i < BLOCK_ROWS; i++) {
+        sum[i] = (float4)(0.0f);
+    }
+
+    for(int r = -FILTER_SIZE; r < BLOCK_ROWS + FILTER_SIZE; r++) {
+        const int sy = BorderCoordinate(y0 + r, height);
+        if (sy < 0) {
+            continue;
+        }
+
+        __global const uchar4* row = input + sy * pitch;
+        for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+            const int sx = BorderCoordinate(x + dx, width);
+            if (sx < 0) {
+                continue;
+            }
+
+            const float4 pixel = convert_float4(row[sx]);
+            for(int i = 0; i < BLOCK_ROWS; i++) {
+                const int dy = r - i;
+                if (dy >= -FILTER_SIZE && dy <= FILTER_SIZE) {
+                    sum[i] += FilterValue(filterWeights, dx, dy) * pixel;
+                }
+            }
+        }
+    }
+
+    for(int i = 0; i < BLOCK_ROWS && y0 + i < height; i++) {
+        output[(y0 + i) * pitch + x] = convert_uchar4_sat_rte(sum[i]);
+    }
+}
+
+// Separable filters, whose weights are column[y] * row[x], in two passes of
+// 2 * FILTER_SIZE + 1 taps each instead of one of (2 * FILTER_SIZE + 1)^2.
+// FilterRows writes the horizontal sums as floats with the same pitch, and
+// FilterColumns sums those vertically. Both apply BORDER_MODE along their
+// axis, which for every mode gives what the 2D filter reads.
+__kernel void FilterRows (
+	__global const uchar4* input,
+	__constant float* rowWeights,
+	__global float4* rows,
+	const int width,
+	const int height,
+	const int pitch)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if (x >= width || y >= height) {
+        return;
+    }
+
+    __global const uchar4* row = input + y * pitch;
+
+    float4 sum = (float4)(0.0f);
+    for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+        const int sx = BorderCoordinate(x + dx, width);
+        if (sx < 0) {
+            continue;
+        }
+
+        sum += rowWeights[dx + FILTER_SIZE] * convert_float4(row[sx]);
+    }
+
+    rows[y * pitch + x] = sum;
+}
+
+__kernel void FilterColumns (
+	__global const float4* rows,
+	__constant float* columnWeights,
+	__global uchar4* output,
+	const int width,
+	const int height,
+	const int pitch)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if (x >= width || y >= height) {
+        return;
+    }
+
+    float4 sum = (float4)(0.0f);
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+        const int sy = BorderCoordinate(y + dy, height);
+        if (sy < 0) {
+            continue;
+        }
+
+        sum += columnWeights[dy + FILTER_SIZE] * rows[sy * pitch + x];
+    }
+
+    output[y * pitch + x] = convert_uchar4_sat_rte(sum);
+}
+
+// Same as FilterBuffer, but on float pixels to skip the conversions
+__kernel void FilterBufferFloat (
+	__global const float4* input,
+	__constant float* filterWeights,
+	__global float4* output,
+	const int width,
+	const int height,
+	const int pitch)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    if (x >= width || y >= height) {
+        return;
+    }
+
+    float4 sum = (float4)(0.0f);
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+        const int sy = BorderCoordinate(y + dy, height);
+        if (sy < 0) {
+            continue;
+        }
+
+        __global const float4* row = input + sy * pitch;
+        for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+            const int sx = BorderCoordinate(x + dx, width);
+            if (sx < 0) {
+                continue;
+            }
+
+            sum += FilterValue(filterWeights, dx, dy) * row[sx];
+        }
+    }
+
+    output[y * pitch + x] = sum;
+}
+
+// Filters a batch of small images in one launch. Slice z of the buffers is
+// a pitch x slotHeight image whose top left sizes[z] pixels are used, and
+// the border mode applies at the edges of each image, as in FilterBuffer.
+__kernel void FilterBatch (
+	__global const uchar4* input,
+	__constant float* filterWeights,
+	__global uchar4* output,
+	__global const int2* sizes,
+	const int pitch,
+	const int slotHeight)
+{
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int2 size = sizes[get_global_id(2)];
+
+    if (x >= size.x || y >= size.y) {
+        return;
+    }
+
+    const int slice = get_global_id(2) * pitch * slotHeight;
+
+    float4 sum = (float4)(0.0f);
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+        const int sy = BorderCoordinate(y + dy, size.y);
+        if (sy < 0) {
+            continue;
+        }
+
+        __global const uchar4* row = input + slice + sy * pitch;
+        for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+            const int sx = BorderCoordinate(x + dx, size.x);
+            if (sx < 0) {
+                continue;
+            }
+
+            sum += FilterValue(filterWeights, dx, dy)
+                * convert_float4(row[sx]);
+        }
+    }
+
+    output[slice + y * pitch + x] = convert_uchar4_sat_rte(sum);
+}
+
+// Planar layout: a single uchar buffer holding the R, G and B planes one
+// after the other, each width*height bytes. Every lane of a vector then does
+// the same channel's work, which lets the filter use wide loads.
+
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 8
+#endif
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+#define floatN CONCAT(float, VECTOR_WIDTH)
+#define vloadN CONCAT(vload, VECTOR_WIDTH)
+#define vstoreN CONCAT(vstore, VECTOR_WIDTH)
+#define convert_floatN CONCAT(convert_float, VECTOR_WIDTH)
+#define convert_ucharN_sat_rte CONCAT(CONCAT(convert_uchar, VECTOR_WIDTH), _sat_rte)
+
+__kernel void Deinterleave (
+	__global const uchar* rgb,
+	__global uchar* planes,
+	const int pixelCount)
+{
+    const int i = get_global_id(0);
+    if (i >= pixelCount) {
+        return;
+    }
+
+    const uchar3 p = vload3(i, rgb);
+    planes[i] = p.x;
+    planes[pixelCount + i] = p.y;
+    planes[2*pixelCount + i] = p.z;
+}
+
+__kernel void Interleave (
+	__global const uchar* planes,
+	__global uchar* rgb,
+	const int pixelCount)
+{
+    const int i = get_global_id(0);
+    if (i >= pixelCount) {
+        return;
+    }
+
+    vstore3((uchar3)(planes[i], planes[pixelCount + i], planes[2*pixelCount + i]),
+        i, rgb);
+}
+
+// Each work item produces VECTOR_WIDTH consecutive pixels of one row of one
+// plane, the plane is get_global_id(2). Edges follow BORDER_MODE; vectors
+// touching the left or right edge fall back to scalar loads.
+__kernel void FilterPlanar (
+	__global const uchar* input,
+	__constant float* filterWeights,
+	__global uchar* output,
+	const int width,
+	const int height)
+{
+    const int x0 = get_global_id(0) * VECTOR_WIDTH;
+    const int y = get_global_id(1);
+    const int planeSize = width * height;
+
+    if (x0 >= width || y >= height) {
+        return;
+    }
+
+    __global const uchar* plane = input + get_global_id(2) * planeSize;
+    __global uchar* result = output + get_global_id(2) * planeSize;
+
+    if (x0 >= FILTER_SIZE && x0 + VECTOR_WIDTH + FILTER_SIZE <= width) {
+        floatN sum = (floatN)(0.0f);
+        for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+            const int sy = BorderCoordinate(y + dy, height);
+            if (sy < 0) {
+                continue;
+            }
+
+            __global const uchar* row = plane + sy * width;
+            for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+                sum += FilterValue(filterWeights, dx, dy)
+                    * convert_floatN(vloadN(0, row + x0 + dx));
+            }
+        }
+
+        vstoreN(convert_ucharN_sat_rte(sum), 0, result + y * width + x0);
+        return;
+    }
+
+    for(int x = x0; x < min(x0 + VECTOR_WIDTH, width); x++) {
+        float sum = 0.0f;
+        for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+            const int sy = BorderCoordinate(y + dy, height);
+            if (sy < 0) {
+                continue;
+            }
+
+            __global const uchar* row = plane + sy * width;
+            for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+                const int sx = BorderCoordinate(x + dx, width);
+                if (sx < 0) {
+                    continue;
+                }
+
+                sum += FilterValue(filterWeights, dx, dy) * row[sx];
+            }
+        }
+
+        result[y * width + x] = convert_uchar_sat_rte(sum);
+    }
+}
+
+// Micro-benchmarks for the device peaks the filters are compared against,
+// see MeasurePeaks. StreamCopy moves 32 bytes per work item and does no
+// arithmetic.
+__kernel void StreamCopy (
+	__global const float4* input,
+	__global float4* output)
+{
+    const int i = get_global_id(0);
+    output[i] = input[i];
+}
+
+// Four independent chains of float4 multiply-adds, 32 FLOPs per iteration.
+// The chains converge instead of overflowing, and the result is stored so
+// the compiler cannot drop them.
+__kernel void PeakFlops (
+	__global float* output,
+	const float scale,
+	const int iterations)
+{
+    const float x = get_global_id(0);
+    float4 a = (float4)(x, x + 1.0f, x + 2.0f, x + 3.0f);
+    float4 b = a + 4.0f;
+    float4 c = a + 8.0f;
+    float4 d = a + 12.0f;
+    const float4 s = (float4)(scale);
+    const float4 one = (float4)(1.0f);
+
+    for(int i = 0; i < iterations; i++) {
+        a = mad(a, s, one);
+        b = mad(b, s, one);
+        c = mad(c, s, one);
+        d = mad(d, s, one);
+    }
+
+    const float4 sum = a + b + c + d;
+    output[get_global_id(0)] = sum.x + sum.y + sum.z + sum.w;
+}
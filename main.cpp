@@ -1,303 +1,1506 @@
+#include "batchio.h"
+#include "engine.h"
+#include "filedescriptor.h"
+#include "image.h"
+#include "metrics.h"
+#include "remote.h"
+#include "scheduler.h"
+#include "sharding.h"
+#include "spscring.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
 #include <string>
-#include <fstream>
-#include <sstream>
+#include <thread>
 
-#ifdef __APPLE__
-	#include "OpenCL/opencl.h"
-#else
-	#include "CL/cl.h"
-#endif
+const std::size_t ProcessPerNode = std::size_t (-1);
 
-struct Image
+struct Options
 {
-	std::vector<char> pixel;
-	int width, height;
+	std::vector<std::string> inputs;
+	std::vector<std::string> outputs;
+	bool blocking;
+	bool chunked;
+	bool pipeline;
+	std::size_t awaitDepth;
+	std::size_t previews;
+	bool planar;
+	bool verify;
+	int vectorWidth;
+	std::string filterPath;
+	int borderMode;
+	std::vector<Rect> regions;
+	std::size_t tileCacheSize;
+	std::size_t memoryBudget;
+	int cacheTileSize;
+	std::size_t prefetch;
+	std::size_t batchSize;
+	std::size_t hostThreads;
+	HugePageMode hugePages;
+
+	// Worker processes and files per shard, see RunSharded. ProcessPerNode
+	// starts one per NUMA node.
+	std::size_t processes;
+	std::size_t shardSize;
+
+	// Worker processes fed over TCP loopback, and the port, see RunRemote
+	std::size_t remoteWorkers;
+	int port;
+
+	// Filter weights, a Gaussian if sigma or radius is set
+	double sigma;
+	int radius;
+	std::string weightsPath;
+
+	// Zero based, the command line counts from one like the device list
+	std::size_t platformIndex;
+	std::size_t deviceIndex;
+
+	std::size_t localSize [2];
+	int tileSize;
+	bool outOfOrder;
+	bool allDevices;
+	bool profile;
+	bool hostScaling;
+	std::string tracePath;
+	std::string metricsPath;
+	std::string variantCache;
+	double metricsInterval;
+	bool help;
 };
 
-Image LoadImage (const char* path)
+const char* const Usage =
+	"clTut [options] [input.ppm ...]\n"
+	"\n"
+	"Input and output\n"
+	"  --list FILE           read input paths from FILE, one per line\n"
+	"  -o, --output FILE     output path, only with a single input\n"
+	"  --output-dir DIR      write every output to DIR\n"
+	"  --blocking | --chunked | --prefetch K | --pipeline | --await N\n"
+	"  --batch N             filter N small images per kernel launch\n"
+	"  --roi x,y,w,h         only this rectangle changes between frames\n"
+	"  --previews N          N interactive previews between the scheduled inputs\n"
+	"  --threads N           host threads for conversions and --chunked I/O\n"
+	"  --huge-pages off|thp|explicit\n"
+	"  --processes N|numa    shard the inputs over N pinned worker processes\n"
+	"  --shard N             files a worker takes at a time, 8 by default\n"
+	"  --remote N            feed N worker processes over TCP loopback\n"
+	"  --port P              coordinator port for --remote, any free one by default\n"
+	"\n"
+	"Filter\n"
+	"  --sigma S             Gaussian blur, radius 3 * S unless given\n"
+	"  --radius R            Gaussian blur, sigma R / 3 unless given\n"
+	"  --weights FILE        (2R+1)^2 weights, row by row\n"
+	"  --border clamp|mirror|wrap|constant\n"
+	"\n"
+	"Device and kernel\n"
+	"  --platform N          platform to use, counting from 1\n"
+	"  --device N            device on that platform, counting from 1\n"
+	"  --kernel auto|image|buffer|float|local|blocked|separable|planar\n"
+	"  --variant-cache FILE  keep the kernel auto picks per device in FILE\n"
+	"  --vector-width 8|16   for the planar kernel\n"
+	"  --verify              compare the planar kernel with image2d first\n"
+	"  --local-size WxH      work-group size of the 2D launches\n"
+	"  --tile-size N         filter in N x N tiles to bound device memory\n"
+	"  --out-of-order        overlap the copies and kernels of those tiles\n"
+	"  --all-devices         share the tiles of a frame among all devices\n"
+	"  --tile-cache MiB [--cache-tile N]\n"
+	"  --memory-budget MiB   device memory to stay within, 3/4 of it by default\n"
+	"\n"
+	"Profiling\n"
+	"  --profile             print the device time of every kernel and copy,\n"
+	"                        and how close the kernels come to the device peaks\n"
+	"  --trace FILE          write a Chrome trace of host and device activity\n"
+	"  --metrics FILE        keep Prometheus metrics in FILE (e.g. clTut.prom)\n"
+	"  --metrics-interval S  seconds between metrics updates, 10 by default\n"
+	"  --host-scaling        time the host conversions on 1, 2, 4 ... threads\n";
+
+// Without inputs, filters test.ppm into output.ppm. Otherwise each input
+// foo.ppm is written to foo_filtered.ppm, next to it or in --output-dir.
+// --blocking uses the original ifstream/ofstream path for comparison,
+// --prefetch sets how many input files are read ahead of the device.
+// --batch packs that many inputs into one buffer and filters them with a
+// single launch, for thumbnails and other images too small to amortize a
+// launch each; it uses the buffer kernel whatever --kernel says.
+// --chunked splits each image into row bands which all cores read, convert
+// and write in parallel, which is better for a few huge images than for
+// many small ones. --pipeline reads, filters and writes on three threads
+// of their own, which hand --prefetch frames around through lock-free rings;
+// the time each stage waits for the others is reported at the end. --await
+// keeps up to N frames in flight from the main thread alone, as coroutines
+// which co_await the engine and resume when the device is done; it needs a
+// C++20 build.
+//
+// --previews mixes N interactive previews, 256 x 256 crops of the first
+// input, into the inputs, which become batch jobs of a scheduler. It splits
+// every job into --tile-size tiles (256 by default) and always sends the
+// next tile of the most urgent job to the device, so a preview only waits
+// for the tile in progress. The p50 and p99 latency of both are printed.
+//
+// The conversions between RGB and RGBA run in row bands on a work-stealing
+// pool of --threads threads, one per core by default, which --chunked also
+// reads and writes on. Without --batch, two frames are in flight, so the
+// conversions of one overlap with the device work of the other, while a
+// thread of its own submits to the device. --host-scaling times the
+// conversions of the first input on 1, 2, 4 ... up to that many threads and
+// exits, without touching OpenCL.
+//
+// --processes forks worker processes, numa one per NUMA node, which take
+// --shard files at a time from a queue in shared memory until none are
+// left. Each worker is pinned to the CPUs of a node, so its frames and the
+// threads of a CPU device's runtime stay on that node, and has an engine,
+// and so an OpenCL context, and a writer of its own; by default it converts
+// on as many threads as the node has CPUs. They filter their files like the
+// default mode, the other modes and --trace and --metrics do not apply.
+// How many files each worker filtered is printed at the end.
+//
+// --remote has a coordinator send the inputs to N worker processes over
+// TCP on 127.0.0.1 (--port, or any free port) as messages of a frame header
+// and the pixels, see remote.h, and write the results they send back. The
+// pixels go from the input files to the sockets with sendfile and from the
+// sockets to the output files with splice. Each worker has --prefetch
+// frames in flight and an engine of its own; if one goes away, the others
+// take over its frames. The frames, bytes and throughput of each worker
+// are printed at the end.
+//
+// --huge-pages backs frames of 2 MiB and more with huge pages, which saves
+// TLB misses in the conversions and in the copies to and from the device:
+// thp asks for transparent ones, explicit takes them from the hugetlbfs
+// pool (vm.nr_hugepages) and uses transparent ones when it is empty.
+// --host-scaling also compares the copy bandwidth of a frame in each mode.
+//
+// --kernel planar filters R, G and B planes with vector loads instead of an
+// RGBA image2d_t; it does not apply to --chunked, which always produces
+// RGBA. Otherwise the RGBA filter runs on an image2d_t or on a uchar4/float4
+// buffer; by default (auto) each device is calibrated on the first input
+// and the fastest one is used. local stages a tile in local memory, blocked
+// filters several rows per work item, separable runs a row and a column
+// pass when the weights allow it (a Gaussian does). --planar and
+// --filter-path are the older spellings of --kernel. With --variant-cache
+// the choice of auto is kept per device, driver, filter and frame size, so
+// later runs skip the calibration.
+//
+// --border selects how pixels outside the image are read (the BORDER_*
+// modes in kernels/image.cl), constant reads them as zero. With --roi (which
+// may be repeated) the inputs are successive frames of the same size in
+// which only those rectangles change; after the first frame, only they are
+// uploaded, filtered and read back. --tile-cache keeps up to that many MiB
+// of filtered N x N tiles (64 by default) and only sends tiles whose input
+// has not been seen before to the device.
+//
+// --tile-size filters in tiles of that size. With --out-of-order the tiles
+// are scheduled as a graph of events on an out-of-order queue, or on three
+// in-order queues if the device has none, so one tile's upload, another's
+// kernel and a third's readback run at the same time. Compare the images/s
+// of a batch with and without it.
+//
+// --all-devices filters every frame on all devices of the platform at once.
+// Each device takes the next tile (--tile-size, 256 by default) whenever it
+// is done with its last, so a faster or less busy device gets more of them;
+// how many each one filtered is printed at the end. The selected device
+// runs the other paths, such as --batch and --tile-cache, alone.
+//
+// Nothing is allocated on the device beyond --memory-budget. Frames whose
+// input and output do not fit it, or the device's largest allocation or
+// image, are filtered in the largest tiles that do, and batches are split
+// into launches that fit.
+//
+// --trace writes the file loads, conversions, filter calls and every device
+// command as JSON for chrome://tracing or ui.perfetto.dev. It turns on
+// profiling, so the device commands run one after another.
+//
+// --metrics rewrites FILE every --metrics-interval seconds and on exit with
+// counters, gauges and latency histograms for node_exporter's textfile
+// collector. The load and save stages are the time this thread waits for
+// them, which with --prefetch is only the part not hidden by the filter.
+//
+// Throws std::invalid_argument for unknown options and missing values.
+Options ParseOptions (int argc, char* argv [])
 {
-	std::ifstream in (path, std::ios::binary);
+	Options options;
+	options.blocking = false;
+	options.chunked = false;
+	options.pipeline = false;
+	options.awaitDepth = 0;
+	options.previews = 0;
+	options.planar = false;
+	options.verify = false;
+	options.vectorWidth = 8;
+	options.filterPath = "auto";
+	options.borderMode = 0;
+	options.tileCacheSize = 0;
+	options.memoryBudget = 0;
+	options.cacheTileSize = 64;
+	options.prefetch = 4;
+	options.batchSize = 1;
+	options.sigma = 0;
+	options.radius = 0;
+	options.platformIndex = 0;
+	options.deviceIndex = 0;
+	options.localSize [0] = options.localSize [1] = 0;
+	options.tileSize = 0;
+	options.outOfOrder = false;
+	options.allDevices = false;
+	options.profile = false;
+	options.hostScaling = false;
+	options.hostThreads = 0;
+	options.hugePages = HugePagesOff;
+	options.processes = 0;
+	options.shardSize = 8;
+	options.remoteWorkers = 0;
+	options.port = 0;
+	options.metricsInterval = 10;
+	options.help = false;
+
+	std::string output, outputDir;
+
+	for (int i = 1; i < argc; ++i) {
+		const char* const option = argv [i];
 
-	std::string s;
-	in >> s;
+		// The value of an option which takes one
+		auto value = [&] () -> const char* {
+			if (i + 1 == argc) {
+				throw std::invalid_argument (std::string (option) + " needs a value");
+			}
+			return argv [++i];
+		};
 
-	if (s != "P6") {
-		exit (1);
+		if (std::strcmp (option, "--help") == 0 || std::strcmp (option, "-h") == 0) {
+			options.help = true;
+		} else if (std::strcmp (option, "--blocking") == 0) {
+			options.blocking = true;
+		} else if (std::strcmp (option, "--chunked") == 0) {
+			options.chunked = true;
+		} else if (std::strcmp (option, "--pipeline") == 0) {
+			options.pipeline = true;
+		} else if (std::strcmp (option, "--previews") == 0) {
+			options.previews = std::max (1, std::atoi (value ()));
+		} else if (std::strcmp (option, "--await") == 0) {
+			options.awaitDepth = std::max (1, std::atoi (value ()));
+#ifndef CLTUT_HAVE_COROUTINES
+			throw std::invalid_argument ("--await needs a C++20 build");
+#endif
+		} else if (std::strcmp (option, "--planar") == 0) {
+			options.planar = true;
+		} else if (std::strcmp (option, "--verify") == 0) {
+			options.verify = true;
+		} else if (std::strcmp (option, "--filter-path") == 0) {
+			const std::string path = value ();
+			if (path != "auto" && !FindFilterVariant (path)) {
+				throw std::invalid_argument ("Unknown filter path " + path);
+			}
+			options.filterPath = path;
+		} else if (std::strcmp (option, "--kernel") == 0) {
+			const std::string kernel = value ();
+			if (kernel == "planar") {
+				options.planar = true;
+			} else if (kernel == "auto" || FindFilterVariant (kernel)) {
+				options.filterPath = kernel;
+			} else {
+				throw std::invalid_argument ("Unknown kernel " + kernel);
+			}
+		} else if (std::strcmp (option, "--border") == 0) {
+			static const char* modes [] = { "clamp", "mirror", "wrap", "constant" };
+			const char* mode = value ();
+			int border = 0;
+			while (border < 4 && std::strcmp (mode, modes [border]) != 0) {
+				++border;
+			}
+			if (border == 4) {
+				throw std::invalid_argument (std::string ("Unknown border mode ") + mode);
+			}
+			options.borderMode = border;
+		} else if (std::strcmp (option, "--roi") == 0) {
+			const char* text = value ();
+			Rect rect;
+			int end = 0;
+			if (std::sscanf (text, "%d,%d,%d,%d%n",
+				&rect.x, &rect.y, &rect.width, &rect.height, &end) != 4
+				|| text [end] != '\0' || rect.width <= 0 || rect.height <= 0) {
+				throw std::invalid_argument ("--roi needs x,y,w,h");
+			}
+			options.regions.push_back (rect);
+		} else if (std::strcmp (option, "--memory-budget") == 0) {
+			options.memoryBudget = std::size_t (std::max (1, std::atoi (value ()))) << 20;
+		} else if (std::strcmp (option, "--variant-cache") == 0) {
+			options.variantCache = value ();
+		} else if (std::strcmp (option, "--tile-cache") == 0) {
+			options.tileCacheSize = std::size_t (std::max (0, std::atoi (value ()))) << 20;
+		} else if (std::strcmp (option, "--cache-tile") == 0) {
+			options.cacheTileSize = std::max (8, std::atoi (value ()));
+		} else if (std::strcmp (option, "--vector-width") == 0) {
+			options.vectorWidth = std::atoi (value ()) == 16 ? 16 : 8;
+		} else if (std::strcmp (option, "--prefetch") == 0) {
+			options.prefetch = std::max (1, std::atoi (value ()));
+		} else if (std::strcmp (option, "--batch") == 0) {
+			options.batchSize = std::max (1, std::atoi (value ()));
+		} else if (std::strcmp (option, "--processes") == 0) {
+			const char* const count = value ();
+			options.processes = std::strcmp (count, "numa") == 0 ? ProcessPerNode
+				: std::size_t (std::max (1, std::atoi (count)));
+		} else if (std::strcmp (option, "--shard") == 0) {
+			options.shardSize = std::max (1, std::atoi (value ()));
+		} else if (std::strcmp (option, "--remote") == 0) {
+			options.remoteWorkers = std::max (1, std::atoi (value ()));
+		} else if (std::strcmp (option, "--port") == 0) {
+			options.port = std::atoi (value ());
+			if (options.port < 0 || options.port > 65535) {
+				throw std::invalid_argument ("--port needs a port number");
+			}
+		} else if (std::strcmp (option, "--threads") == 0) {
+			options.hostThreads = std::max (1, std::atoi (value ()));
+		} else if (std::strcmp (option, "--huge-pages") == 0) {
+			const std::string mode = value ();
+			if (mode == "off") {
+				options.hugePages = HugePagesOff;
+			} else if (mode == "thp") {
+				options.hugePages = HugePagesTransparent;
+			} else if (mode == "explicit") {
+				options.hugePages = HugePagesExplicit;
+			} else {
+				throw std::invalid_argument ("Unknown huge page mode " + mode);
+			}
+		} else if (std::strcmp (option, "--host-scaling") == 0) {
+			options.hostScaling = true;
+		} else if (std::strcmp (option, "--sigma") == 0) {
+			options.sigma = std::max (0.0, std::atof (value ()));
+		} else if (std::strcmp (option, "--radius") == 0) {
+			options.radius = std::max (0, std::atoi (value ()));
+		} else if (std::strcmp (option, "--weights") == 0) {
+			options.weightsPath = value ();
+		} else if (std::strcmp (option, "--platform") == 0) {
+			options.platformIndex = std::max (1, std::atoi (value ())) - 1;
+		} else if (std::strcmp (option, "--device") == 0) {
+			options.deviceIndex = std::max (1, std::atoi (value ())) - 1;
+		} else if (std::strcmp (option, "--local-size") == 0) {
+			unsigned width = 0, height = 0;
+			if (std::sscanf (value (), "%ux%u", &width, &height) != 2) {
+				throw std::invalid_argument ("--local-size needs WxH");
+			}
+			options.localSize [0] = width;
+			options.localSize [1] = height;
+		} else if (std::strcmp (option, "--tile-size") == 0) {
+			options.tileSize = std::max (0, std::atoi (value ()));
+		} else if (std::strcmp (option, "--out-of-order") == 0) {
+			options.outOfOrder = true;
+		} else if (std::strcmp (option, "--all-devices") == 0) {
+			options.allDevices = true;
+		} else if (std::strcmp (option, "--profile") == 0) {
+			options.profile = true;
+		} else if (std::strcmp (option, "--trace") == 0) {
+			options.tracePath = value ();
+		} else if (std::strcmp (option, "--metrics") == 0) {
+			options.metricsPath = value ();
+		} else if (std::strcmp (option, "--metrics-interval") == 0) {
+			options.metricsInterval = std::max (0.1, std::atof (value ()));
+		} else if (std::strcmp (option, "--list") == 0) {
+			const char* const path = value ();
+			std::ifstream list (path);
+			if (!list) {
+				throw std::invalid_argument (std::string (path) + ": cannot open list");
+			}
+
+			std::string line;
+			while (std::getline (list, line)) {
+				if (!line.empty () && line.back () == '\r') {
+					line.pop_back ();
+				}
+				if (!line.empty ()) {
+					options.inputs.push_back (line);
+				}
+			}
+		} else if (std::strcmp (option, "-o") == 0 || std::strcmp (option, "--output") == 0) {
+			output = value ();
+		} else if (std::strcmp (option, "--output-dir") == 0) {
+			outputDir = value ();
+		} else if (option [0] == '-' && option [1] != '\0') {
+			throw std::invalid_argument (std::string ("Unknown option ") + option);
+		} else {
+			options.inputs.push_back (option);
+		}
 	}
 
-	// Skip comments
-	for (;;) {
-		getline (in, s);
+	if (!output.empty () && options.inputs.size () > 1) {
+		throw std::invalid_argument ("--output needs a single input, use --output-dir");
+	}
+
+	if (options.inputs.empty ()) {
+		options.inputs.push_back ("test.ppm");
+		options.outputs.push_back (output.empty () ? "output.ppm" : output);
+		return options;
+	}
 
-		if (s.empty ()) {
+	for (const auto& input : options.inputs) {
+		if (!output.empty ()) {
+			options.outputs.push_back (output);
 			continue;
 		}
 
-		if (s [0] != '#') {
-			break;
+		const std::string::size_type dot = input.rfind (".ppm");
+		std::string name = input.substr (0, dot) + "_filtered.ppm";
+
+		if (!outputDir.empty ()) {
+			const std::string::size_type slash = name.find_last_of ('/');
+			if (slash != std::string::npos) {
+				name = name.substr (slash + 1);
+			}
+			name = outputDir + "/" + name;
 		}
+
+		options.outputs.push_back (name);
 	}
 
-	std::stringstream str (s);
-	int width, height, maxColor;
-	str >> width >> height;
-	in >> maxColor;
+	return options;
+}
 
-	if (maxColor != 255) {
-		exit (1);
-	}
+// One stage of clfilter_stage_seconds. The engine records its filter, queue
+// and batch stages in the same histogram, the load and save stages are ours.
+Histogram& StageLatency (MetricsRegistry& metrics, const std::string& stage)
+{
+	return metrics.GetHistogram ("clfilter_stage_seconds",
+		"Seconds spent in each stage of an image", "stage=\"" + stage + "\"");
+}
 
+// Sums the recorded device commands by name, and places the kernels on the
+// roofline of the device: the FLOP/s they can reach at their arithmetic
+// intensity is the lower of the FLOP peak and intensity times the streaming
+// bandwidth. The byte and FLOP counts are estimates, see FilterWork.
+void PrintProfile (const Profiler& profiler, const DevicePeaks& peaks)
+{
+	struct Total
 	{
-		// Skip until end of line
-		std::string tmp;
-		getline(in, tmp);
+		std::size_t count;
+		cl_ulong time;
+		double bytes;
+		double flops;
+	};
+	std::map<std::string, Total> totals;
+
+	for (const auto& command : profiler.Commands ()) {
+		Total& total = totals [command.name];
+		total.count += 1;
+		total.time += command.end - command.start;
+		total.bytes += command.bytes;
+		total.flops += command.flops;
 	}
 
-	std::vector<char> data (width * height * 3);
-	in.read (reinterpret_cast<char*> (data.data ()), data.size ());
+	std::cout << "Device peaks: " << peaks.bandwidth / 1e9 << " GB/s streaming copy, "
+		<< peaks.flops / 1e9 << " GFLOP/s" << std::endl;
+
+	// The kernel with the most device time decides the advice below
+	const Total* slowest = nullptr;
+	double slowestRoof = 0;
 
-	const Image img = { data, width, height };
-	return img;
+	std::cout << "Device profile:" << std::endl;
+	for (const auto& total : totals) {
+		const double ms = total.second.time / 1e6;
+		std::cout << "\t" << total.first << ": " << total.second.count << " x, "
+			<< ms << " ms, " << ms / total.second.count << " ms each";
+
+		const double seconds = total.second.time / 1e9;
+		if (total.second.bytes > 0 && seconds > 0) {
+			std::cout << ", " << total.second.bytes / seconds / 1e9 << " GB/s";
+		}
+
+		if (total.second.flops > 0 && seconds > 0) {
+			const double intensity = total.second.flops / total.second.bytes;
+			const double roof = std::min (peaks.flops, intensity * peaks.bandwidth);
+			const double achieved = total.second.flops / seconds;
+
+			std::cout << ", " << achieved / 1e9 << " GFLOP/s, "
+				<< intensity << " FLOP/byte, "
+				<< (roof < peaks.flops ? "memory" : "compute") << " bound at "
+				<< 100 * achieved / roof << "% of the roof";
+
+			if (!slowest || total.second.time > slowest->time) {
+				slowest = &total.second;
+				slowestRoof = roof;
+			}
+		}
+		std::cout << std::endl;
+	}
+
+	if (!slowest) {
+		return;
+	}
+
+	const double achieved = slowest->flops / (slowest->time / 1e9);
+	if (achieved < 0.25 * slowestRoof) {
+		std::cout << "Far below the roof, the launches rather than the device limit"
+			" the filter: try another --local-size, or --kernel planar" << std::endl;
+	} else if (slowestRoof < peaks.flops) {
+		std::cout << "Memory bound: try --kernel image for cached reads, planar"
+			" for fewer bytes per pixel, or --tile-cache" << std::endl;
+	} else {
+		std::cout << "Compute bound: try --kernel planar with --vector-width 16,"
+			" or a smaller filter" << std::endl;
+	}
 }
 
-void SaveImage (const Image& img, const char* path)
+// A frame slot of FilterPipeline. The slots go round from the reader to the
+// device stage, the writer and back, so no more than their number of frames
+// are ever held.
+struct PipelineFrame
+{
+	Image image;
+	Image result;
+	std::size_t index;
+
+	// Set once a stage failed, the later stages pass the frame on untouched
+	bool failed;
+};
+
+// Filters inputs into outputs with a reader, a device and a writer thread
+// connected by SPSC rings; the device thread is the only one which talks to
+// OpenCL. Every stage records the time it waited for a frame to work on or
+// for room to pass it on into clfilter_stage_wait_seconds. After a failure
+// the frames keep going round so no stage blocks, and the first error is
+// rethrown once all stopped. Returns the bytes read and written.
+std::size_t FilterPipeline (Engine& engine, const FilterParams& params,
+	const std::vector<std::string>& inputs, const std::vector<std::string>& outputs,
+	std::size_t depth)
 {
-	std::ofstream out (path, std::ios::binary);
+	auto waitLatency = [&] (const char* stage) -> Histogram& {
+		return engine.Metrics ().GetHistogram ("clfilter_stage_wait_seconds",
+			"Seconds a pipeline stage waited for the others, per frame",
+			std::string ("stage=\"") + stage + "\"");
+	};
+	Histogram& readWait = waitLatency ("read");
+	Histogram& filterWait = waitLatency ("filter");
+	Histogram& writeWait = waitLatency ("write");
+
+	std::vector<PipelineFrame> frames (depth);
+	SpscRing<PipelineFrame*> empty (depth), loaded (depth), filtered (depth);
+	for (auto& frame : frames) {
+		empty.Push (&frame);
+	}
+
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	auto fail = [&] (PipelineFrame* frame) {
+		frame->failed = true;
+		std::lock_guard<std::mutex> lock (errorMutex);
+		if (!error) {
+			error = std::current_exception ();
+		}
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	std::thread reader ([&] () {
+		for (std::size_t i = 0; i < inputs.size (); ++i) {
+			const auto start = Clock::now ();
+			PipelineFrame* frame = nullptr;
+			empty.Pop (frame);
+			auto waited = Clock::now () - start;
+
+			frame->index = i;
+			frame->failed = false;
+			try {
+				frame->image = LoadImage (inputs [i].c_str ());
+			} catch (...) {
+				fail (frame);
+			}
+
+			const auto pushed = Clock::now ();
+			loaded.Push (frame);
+			readWait.Record (waited + (Clock::now () - pushed));
+		}
+		loaded.Close ();
+	});
+
+	std::thread writer ([&] () {
+		for (;;) {
+			const auto start = Clock::now ();
+			PipelineFrame* frame = nullptr;
+			if (!filtered.Pop (frame)) {
+				break;
+			}
+			writeWait.Record (Clock::now () - start);
+
+			if (!frame->failed) {
+				try {
+					SaveImage (frame->result, outputs [frame->index].c_str ());
+				} catch (...) {
+					fail (frame);
+				}
+			}
+			empty.Push (frame);
+		}
+	});
+
+	// The device stage runs here
+	std::size_t bytes = 0;
+	for (;;) {
+		const auto start = Clock::now ();
+		PipelineFrame* frame = nullptr;
+		if (!loaded.Pop (frame)) {
+			break;
+		}
+		auto waited = Clock::now () - start;
+
+		if (!frame->failed) {
+			try {
+				engine.Filter (frame->image, frame->result, params);
+				bytes += 2 * frame->result.pixel.size ();
+			} catch (...) {
+				fail (frame);
+			}
+		}
+
+		const auto pushed = Clock::now ();
+		filtered.Push (frame);
+		filterWait.Record (waited + (Clock::now () - pushed));
+	}
+	filtered.Close ();
+
+	reader.join ();
+	writer.join ();
+
+	std::cout << "Pipeline waits per frame:" << std::endl;
+	for (const auto& stage : { std::make_pair ("read", &readWait),
+		std::make_pair ("filter", &filterWait), std::make_pair ("write", &writeWait) }) {
+		std::cout << "\t" << stage.first << ": p50 "
+			<< stage.second->Quantile (0.5).count () / 1e6 << " ms, p99 "
+			<< stage.second->Quantile (0.99).count () / 1e6 << " ms" << std::endl;
+	}
 
-	out << "P6\n";
-	out << img.width << " " << img.height << "\n";
-	out << "255\n";
-	out.write (img.pixel.data (), img.pixel.size ());
+	if (error) {
+		std::rethrow_exception (error);
+	}
+	return bytes;
 }
 
-Image RGBtoRGBA (const Image& input)
+#ifdef CLTUT_HAVE_COROUTINES
+// Coroutine which starts right away and frees itself when it is done
+struct DetachedTask
 {
-	Image result;
-	result.width = input.width;
-	result.height = input.height;
+	struct promise_type
+	{
+		DetachedTask get_return_object ()
+		{
+			return DetachedTask ();
+		}
+
+		std::suspend_never initial_suspend () noexcept
+		{
+			return std::suspend_never ();
+		}
+
+		std::suspend_never final_suspend () noexcept
+		{
+			return std::suspend_never ();
+		}
+
+		void return_void ()
+		{
+		}
+
+		void unhandled_exception ()
+		{
+			std::terminate ();
+		}
+	};
+};
+
+// Counts the frames of FilterAwaited which are not done yet, and keeps
+// their writes and the first error
+class FramesInFlight
+{
+public:
+	explicit FramesInFlight (std::size_t limit)
+		: limit_ (limit), count_ (0), bytes_ (0)
+	{
+	}
 
-	for (std::size_t i = 0; i < input.pixel.size (); i += 3) {
-		result.pixel.push_back (input.pixel [i + 0]);
-		result.pixel.push_back (input.pixel [i + 1]);
-		result.pixel.push_back (input.pixel [i + 2]);
-		result.pixel.push_back (0);
+	// Waits until fewer than limit frames are in flight, and adds one
+	void Start ()
+	{
+		std::unique_lock<std::mutex> lock (mutex_);
+		wakeup_.wait (lock, [this] () { return count_ < limit_; });
+		++count_;
 	}
 
-	return result;
+	// A frame is done, with the write of its bytes or with an error. Runs on
+	// event callback threads; it notifies under the lock, since Wait may
+	// return and the object be destroyed as soon as the lock is released.
+	void Finish (std::future<void> write, std::size_t bytes, std::exception_ptr error)
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		if (write.valid ()) {
+			writes_.push_back (std::move (write));
+		}
+		if (error && !error_) {
+			error_ = error;
+		}
+		bytes_ += bytes;
+		--count_;
+		wakeup_.notify_all ();
+	}
+
+	// Waits for all frames and their writes, and returns the bytes read and
+	// written. Rethrows the first error.
+	std::size_t Wait ()
+	{
+		std::unique_lock<std::mutex> lock (mutex_);
+		wakeup_.wait (lock, [this] () { return count_ == 0; });
+
+		for (auto& write : writes_) {
+			write.get ();
+		}
+		if (error_) {
+			std::rethrow_exception (error_);
+		}
+		return bytes_;
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	std::size_t limit_;
+	std::size_t count_;
+	std::size_t bytes_;
+	std::vector<std::future<void>> writes_;
+	std::exception_ptr error_;
+};
+
+// Filters one frame without holding a thread while it is on the device
+DetachedTask FilterAwaited (Engine& engine, const FilterParams& params, BatchIO& io,
+	Image image, std::string output, FramesInFlight& frames)
+{
+	try {
+		Image result = co_await engine.Filter (image, params);
+		const std::size_t bytes = 2 * result.pixel.size ();
+		frames.Finish (io.Write (output, std::move (result)), bytes, nullptr);
+	} catch (...) {
+		frames.Finish (std::future<void> (), 0, std::current_exception ());
+	}
 }
+#endif
 
-Image RGBAtoRGB (const Image& input)
+// Filters the inputs as batch jobs of a FilterScheduler, a few at a time,
+// while another thread asks for previews: crops of the first input, one
+// after the other like a user scrolling through it, each with a deadline
+// of PreviewDeadline. Prints the latency of both classes. Returns the bytes
+// read and written.
+std::size_t FilterScheduled (Engine& engine, const FilterParams& params,
+	const Options& options)
 {
-	Image result;
-	result.width = input.width;
-	result.height = input.height;
+	const int PreviewSize = 256;
+	const std::chrono::milliseconds PreviewDeadline (50);
+	const std::chrono::milliseconds PreviewInterval (20);
+
+	FilterScheduler scheduler (engine, options.tileSize > 0 ? options.tileSize : 256);
 
-	for (std::size_t i = 0; i < input.pixel.size (); i += 4) {
-		result.pixel.push_back (input.pixel [i + 0]);
-		result.pixel.push_back (input.pixel [i + 1]);
-		result.pixel.push_back (input.pixel [i + 2]);
+	const Image first = RGBtoRGBA (LoadImage (options.inputs [0].c_str ()));
+	const Rect crop = { std::max (0, first.width / 2 - PreviewSize / 2),
+		std::max (0, first.height / 2 - PreviewSize / 2),
+		std::min (PreviewSize, first.width), std::min (PreviewSize, first.height) };
+	const Image preview = CropImage (first, crop, 0, params.borderMode);
+
+	std::exception_ptr previewError;
+	std::thread previews ([&] () {
+		try {
+			for (std::size_t i = 0; i < options.previews; ++i) {
+				scheduler.Submit (preview, params, InteractiveJob,
+					FilterScheduler::Clock::now () + PreviewDeadline).get ();
+				std::this_thread::sleep_for (PreviewInterval);
+			}
+		} catch (...) {
+			previewError = std::current_exception ();
+		}
+	});
+
+	std::size_t bytes = 0;
+	std::deque<std::pair<std::size_t, std::future<Image>>> jobs;
+	auto finishJob = [&] () {
+		Image result = jobs.front ().second.get ();
+		SaveImage (result, options.outputs [jobs.front ().first].c_str ());
+		bytes += 2 * result.pixel.size ();
+		jobs.pop_front ();
+	};
+
+	try {
+		for (std::size_t i = 0; i < options.inputs.size (); ++i) {
+			jobs.emplace_back (i, scheduler.Submit (LoadImage (options.inputs [i].c_str ()),
+				params, BatchJob));
+			if (jobs.size () > options.prefetch) {
+				finishJob ();
+			}
+		}
+		while (!jobs.empty ()) {
+			finishJob ();
+		}
+	} catch (...) {
+		previews.join ();
+		throw;
+	}
+
+	previews.join ();
+	if (previewError) {
+		std::rethrow_exception (previewError);
 	}
 
-	return result;
+	std::cout << "Scheduled job latency:" << std::endl;
+	for (const JobClass jobClass : { InteractiveJob, BatchJob }) {
+		const Histogram& latency = scheduler.Latency (jobClass);
+		std::cout << "\t" << JobClassName (jobClass) << ": " << latency.Count ()
+			<< " job(s), p50 " << latency.Quantile (0.5).count () / 1e6 << " ms, p99 "
+			<< latency.Quantile (0.99).count () / 1e6 << " ms, "
+			<< scheduler.DeadlineMisses (jobClass) << " deadline miss(es)" << std::endl;
+	}
+
+	return bytes;
+}
+
+// Times the conversion of image to RGBA and back on pools of 1, 2, 4 ...
+// up to maxThreads threads, and prints the throughput and the speedup over
+// one thread. The timing runs on a worker of the pool, which helps with its
+// own bands, so a pool of N threads uses exactly N cores.
+void PrintHostScaling (const Image& image, std::size_t maxThreads)
+{
+	const int Repetitions = 5;
+	const double megapixels = double (image.width) * image.height / 1e6;
+	double single = 0;
+
+	std::cout << "Host conversion scaling, " << image.width << "x" << image.height
+		<< ":" << std::endl;
+
+	for (std::size_t threads = 1;; threads = std::min (2 * threads, maxThreads)) {
+		ThreadPool pool (threads);
+		const double seconds = pool.Submit ([&] () {
+			// Once to warm up the caches and the allocator
+			RGBAtoRGB (RGBtoRGBA (image, pool), pool);
+
+			const auto start = std::chrono::steady_clock::now ();
+			for (int i = 0; i < Repetitions; ++i) {
+				RGBAtoRGB (RGBtoRGBA (image, pool), pool);
+			}
+			return std::chrono::duration<double> (
+				std::chrono::steady_clock::now () - start).count ();
+		}).get ();
+
+		const double rate = Repetitions * megapixels / seconds;
+		if (threads == 1) {
+			single = rate;
+		}
+
+		std::cout << "\t" << threads << " thread(s): " << rate << " MPixel/s, "
+			<< rate / single << "x" << std::endl;
+
+		if (threads == maxThreads) {
+			break;
+		}
+	}
 }
 
-std::string GetPlatformName (cl_platform_id id)
+// Copies an RGBA frame of the size of image in each huge page mode and
+// prints the bandwidth, counting the bytes read and written. Every mode
+// gets fresh buffers, which are touched once before the timing so page
+// faults are not counted.
+void PrintCopyBandwidth (const Image& image)
 {
-	size_t size = 0;
-	clGetPlatformInfo (id, CL_PLATFORM_NAME, 0, nullptr, &size);
+	static const struct
+	{
+		HugePageMode mode;
+		const char* name;
+	} modes [] = {
+		{ HugePagesOff, "off" },
+		{ HugePagesTransparent, "thp" },
+		{ HugePagesExplicit, "explicit" }
+	};
+
+	const int Repetitions = 10;
+	const std::size_t bytes = std::size_t (image.width) * image.height * 4;
+	const HugePageMode previous = GetHugePageMode ();
+
+	std::cout << "Host copy bandwidth, " << bytes / double (1 << 20) << " MiB:" << std::endl;
+	for (const auto& mode : modes) {
+		SetHugePageMode (mode.mode);
+		const std::size_t fallbacks = HugePageFallbacks ();
+		PixelBuffer source (bytes, 1), destination (bytes);
+
+		const auto start = std::chrono::steady_clock::now ();
+		for (int i = 0; i < Repetitions; ++i) {
+			std::memcpy (destination.data (), source.data (), bytes);
+		}
+		const std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now () - start;
 
-	std::string result;
-	result.resize (size);
-	clGetPlatformInfo (id, CL_PLATFORM_NAME, size,
-		const_cast<char*> (result.data ()), nullptr);
+		std::cout << "\t" << mode.name << ": "
+			<< 2.0 * Repetitions * bytes / elapsed.count () / 1e9 << " GB/s"
+			<< (HugePageFallbacks () != fallbacks ? " (fell back to thp)" : "")
+			<< std::endl;
+	}
+	SetHugePageMode (previous);
+}
 
-	return result;
+EngineOptions CreateEngineOptions (const Options& options)
+{
+	EngineOptions engineOptions;
+	engineOptions.platformIndex = options.platformIndex;
+	engineOptions.deviceIndex = options.deviceIndex;
+	engineOptions.profiling = options.profile || !options.tracePath.empty ();
+	engineOptions.outOfOrder = options.outOfOrder;
+	engineOptions.multiDevice = options.allDevices;
+	engineOptions.hostThreads = options.hostThreads;
+	engineOptions.tileCacheSize = options.tileCacheSize;
+	engineOptions.memoryBudget = options.memoryBudget;
+	engineOptions.cacheTileSize = options.cacheTileSize;
+	engineOptions.variantCache = options.variantCache;
+	return engineOptions;
 }
 
-std::string GetDeviceName (cl_device_id id)
+// The filter of the options. With --kernel auto, the engine's device is
+// calibrated on the first input.
+FilterParams CreateParams (const Options& options, Engine& engine)
 {
-	size_t size = 0;
-	clGetDeviceInfo (id, CL_DEVICE_NAME, 0, nullptr, &size);
+	FilterParams params;
+	params.borderMode = options.borderMode;
+	params.planar = options.planar;
+	params.vectorWidth = options.vectorWidth;
+	params.localSize [0] = options.localSize [0];
+	params.localSize [1] = options.localSize [1];
+	params.tileSize = options.tileSize;
 
-	std::string result;
-	result.resize (size);
-	clGetDeviceInfo (id, CL_DEVICE_NAME, size,
-		const_cast<char*> (result.data ()), nullptr);
+	if (!options.weightsPath.empty ()) {
+		params.weights = LoadWeights (options.weightsPath);
+	} else if (options.sigma > 0 || options.radius > 0) {
+		const int radius = options.radius > 0 ? options.radius
+			: std::max (1, static_cast<int> (std::ceil (3 * options.sigma)));
+		const double sigma = options.sigma > 0 ? options.sigma : radius / 3.0;
+		params.weights = GaussianWeights (sigma, radius);
+	}
+
+	if (const FilterVariant* variant = FindFilterVariant (options.filterPath)) {
+		params.path = variant->path;
+	} else if (options.filterPath == "auto" && !options.planar) {
+		params.path = engine.Calibrate (RGBtoRGBA (LoadImage (options.inputs [0].c_str ())),
+			params);
+	}
 
-	return result;
+	return params;
 }
 
-void CheckError (cl_int error)
+// One process of RunSharded. Filters the files of the shards it takes from
+// queue until there are none left, with an engine and writer of its own.
+int RunShardWorker (const Options& options, ShardQueue& queue,
+	std::size_t worker, const NumaNode& node)
 {
-	if (error != CL_SUCCESS) {
-		std::cerr << "OpenCL call failed with error " << error << std::endl;
-		std::exit (1);
+	PinToCpus (node.cpus);
+
+	EngineOptions engineOptions = CreateEngineOptions (options);
+	engineOptions.profiling = false;
+	if (!engineOptions.hostThreads) {
+		engineOptions.hostThreads = node.cpus.size ();
+	}
+	Engine engine (engineOptions);
+	const FilterParams params = CreateParams (options, engine);
+
+	auto io = CreateBatchIO (2 * options.prefetch);
+	std::size_t shard;
+	while (queue.Next (shard)) {
+		const std::size_t begin = shard * options.shardSize;
+		const std::size_t end = std::min (options.inputs.size (), begin + options.shardSize);
+		const std::vector<std::string> inputs (options.inputs.begin () + begin,
+			options.inputs.begin () + end);
+
+		Prefetcher prefetcher (*io, inputs, options.prefetch);
+		std::deque<std::future<void>> writes;
+		for (std::size_t i = begin; i < end; ++i) {
+			Image result;
+			engine.Filter (prefetcher.Next (), result, params);
+			writes.push_back (io->Write (options.outputs [i], std::move (result)));
+
+			// Bound the memory held by pending writes
+			while (writes.size () > options.prefetch) {
+				writes.front ().get ();
+				writes.pop_front ();
+			}
+		}
+
+		for (auto& write : writes) {
+			write.get ();
+		}
+		queue.Done (worker, end - begin);
 	}
+
+	return 0;
 }
 
-std::string LoadKernel (const char* name)
+// --processes: the coordinator only sets up the shard queue and forks, it
+// never touches OpenCL itself, whose state would not survive the fork
+int RunSharded (const Options& options)
 {
-	std::ifstream in (name);
-	std::string result (
-		(std::istreambuf_iterator<char> (in)),
-		std::istreambuf_iterator<char> ());
-	return result;
+	const std::vector<NumaNode> nodes = GetNumaNodes ();
+	const std::size_t workers = options.processes == ProcessPerNode ? nodes.size ()
+		: options.processes;
+	const std::size_t shards = (options.inputs.size () + options.shardSize - 1)
+		/ options.shardSize;
+	ShardQueue queue (shards, workers);
+
+	std::cout << "Sharding " << options.inputs.size () << " file(s) in " << shards
+		<< " shard(s) over " << workers << " process(es) on " << nodes.size ()
+		<< " NUMA node(s)" << std::endl;
+
+	const auto start = std::chrono::steady_clock::now ();
+	const std::size_t failed = RunWorkers (workers, [&] (std::size_t worker) {
+		return RunShardWorker (options, queue, worker, nodes [worker % nodes.size ()]);
+	});
+	const std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now () - start;
+
+	std::size_t files = 0;
+	for (std::size_t i = 0; i < workers; ++i) {
+		std::cout << "Worker " << i << " (node " << nodes [i % nodes.size ()].id
+			<< "): " << queue.Items (i) << " file(s), "
+			<< queue.Items (i) / elapsed.count () << " images/s" << std::endl;
+		files += queue.Items (i);
+	}
+
+	std::cout << "Processed " << files << " image(s) in " << elapsed.count ()
+		<< " s (" << files / elapsed.count () << " images/s)" << std::endl;
+
+	if (failed) {
+		std::cerr << failed << " worker(s) failed, " << options.inputs.size () - files
+			<< " file(s) were not written" << std::endl;
+		return 1;
+	}
+	return 0;
 }
 
-cl_program CreateProgram (const std::string& source,
-	cl_context context)
+// --remote: like RunSharded, the coordinator forks the workers before
+// anything touches OpenCL, and leaves OpenCL to them
+int RunRemote (const Options& options)
 {
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateProgramWithSource.html
-	size_t lengths [1] = { source.size () };
-	const char* sources [1] = { source.data () };
+	std::uint16_t port = static_cast<std::uint16_t> (options.port);
+	FileDescriptor listener (ListenLoopback (port));
+	std::cout << "Coordinating " << options.remoteWorkers << " worker(s) on 127.0.0.1:"
+		<< port << std::endl;
+
+	const std::vector<pid_t> workers = StartWorkers (options.remoteWorkers,
+		[&] (std::size_t) {
+			close (listener.Release ());
+			FileDescriptor connection (ConnectLoopback (port));
+
+			EngineOptions engineOptions = CreateEngineOptions (options);
+			engineOptions.profiling = false;
+			Engine engine (engineOptions);
+			ServeFrames (connection.Get (), engine, CreateParams (options, engine),
+				options.prefetch);
+			return 0;
+		});
+
+	const auto start = std::chrono::steady_clock::now ();
+	std::vector<WorkerStats> stats;
+	std::size_t failed = 0;
+	try {
+		failed = CoordinateFrames (listener.Get (), workers.size (), options.inputs,
+			options.outputs, options.prefetch, stats);
+	} catch (...) {
+		// The workers see their connections close and exit. Those which
+		// connect late, or still wait in the backlog, are refused or reset.
+		close (listener.Release ());
+		WaitWorkers (workers);
+		throw;
+	}
+	const std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now () - start;
+	close (listener.Release ());
+	WaitWorkers (workers);
 
-	cl_int error = 0;
-	cl_program program = clCreateProgramWithSource (context, 1, sources, lengths, &error);
-	CheckError (error);
+	std::size_t frames = 0;
+	for (std::size_t i = 0; i < stats.size (); ++i) {
+		const WorkerStats& worker = stats [i];
+		const double seconds = std::max (worker.seconds, 1e-9);
+		std::cout << "Worker " << i << ": " << worker.frames << " frame(s), "
+			<< worker.frames / seconds << " frames/s, "
+			<< worker.bytesSent / seconds / (1 << 20) << " MiB/s out, "
+			<< worker.bytesReceived / seconds / (1 << 20) << " MiB/s back"
+			<< (worker.lost ? " (lost)" : "") << std::endl;
+		frames += worker.frames;
+	}
+
+	std::cout << "Processed " << frames << " image(s) in " << elapsed.count ()
+		<< " s (" << frames / elapsed.count () << " images/s)" << std::endl;
 
-	return program;
+	if (failed) {
+		std::cerr << failed << " frame(s) failed" << std::endl;
+		return 1;
+	}
+	return 0;
 }
 
-int main ()
+int Run (const Options& options)
 {
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetPlatformIDs.html
-	cl_uint platformIdCount = 0;
-	clGetPlatformIDs (0, nullptr, &platformIdCount);
+	SetHugePageMode (options.hugePages);
 
-	if (platformIdCount == 0) {
+	if (options.hostScaling) {
+		const Image image = LoadImage (options.inputs [0].c_str ());
+		const std::size_t threads = options.hostThreads ? options.hostThreads
+			: std::max (1u, std::thread::hardware_concurrency ());
+		PrintHostScaling (image, threads);
+		PrintCopyBandwidth (image);
+		return 0;
+	}
+
+	const std::vector<cl_platform_id> platformIds = GetPlatformIds ();
+
+	if (platformIds.empty ()) {
 		std::cerr << "No OpenCL platform found" << std::endl;
 		return 1;
 	} else {
-		std::cout << "Found " << platformIdCount << " platform(s)" << std::endl;
+		std::cout << "Found " << platformIds.size () << " platform(s)" << std::endl;
 	}
 
-	std::vector<cl_platform_id> platformIds (platformIdCount);
-	clGetPlatformIDs (platformIdCount, platformIds.data (), nullptr);
-
-	for (cl_uint i = 0; i < platformIdCount; ++i) {
+	for (std::size_t i = 0; i < platformIds.size (); ++i) {
 		std::cout << "\t (" << (i+1) << ") : " << GetPlatformName (platformIds [i]) << std::endl;
 	}
 
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetDeviceIDs.html
-	cl_uint deviceIdCount = 0;
-	clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_ALL, 0, nullptr,
-		&deviceIdCount);
+	if (options.platformIndex >= platformIds.size ()) {
+		std::cerr << "There is no platform " << options.platformIndex + 1 << std::endl;
+		return 1;
+	}
 
-	if (deviceIdCount == 0) {
+	const std::vector<cl_device_id> deviceIds = GetDeviceIds (platformIds [options.platformIndex]);
+
+	if (deviceIds.empty ()) {
 		std::cerr << "No OpenCL devices found" << std::endl;
 		return 1;
 	} else {
-		std::cout << "Found " << deviceIdCount << " device(s)" << std::endl;
+		std::cout << "Found " << deviceIds.size () << " device(s)" << std::endl;
 	}
 
-	std::vector<cl_device_id> deviceIds (deviceIdCount);
-	clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_ALL, deviceIdCount,
-		deviceIds.data (), nullptr);
-
-	for (cl_uint i = 0; i < deviceIdCount; ++i) {
+	for (std::size_t i = 0; i < deviceIds.size (); ++i) {
 		std::cout << "\t (" << (i+1) << ") : " << GetDeviceName (deviceIds [i]) << std::endl;
 	}
 
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateContext.html
-	const cl_context_properties contextProperties [] =
-	{
-		CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties> (platformIds [0]),
-		0, 0
-	};
+	if (!options.tracePath.empty ()) {
+		StartTrace ();
+	}
 
-	cl_int error = CL_SUCCESS;
-	cl_context context = clCreateContext (contextProperties, deviceIdCount,
-		deviceIds.data (), nullptr, nullptr, &error);
-	CheckError (error);
+	Engine engine (CreateEngineOptions (options));
 
-	std::cout << "Context created" << std::endl;
+	std::cout << "Context created, using " << GetDeviceName (engine.Device ()).c_str () << std::endl;
+	if (options.outOfOrder) {
+		std::cout << "Tiles run on " << engine.QueueMode () << std::endl;
+	}
 
-	// Simple Gaussian blur filter
-	float filter [] = {
-		1, 2, 1,
-		2, 4, 2,
-		1, 2, 1
-	};
+	Histogram& loadLatency = StageLatency (engine.Metrics (), "load");
+	Histogram& saveLatency = StageLatency (engine.Metrics (), "save");
+	Gauge& pendingWrites = engine.Metrics ().GetGauge ("clfilter_pending_writes",
+		"Filtered images waiting to be written");
+
+	// Destroyed before the engine, with a last write of the final values
+	std::unique_ptr<MetricsWriter> metricsWriter;
+	if (!options.metricsPath.empty ()) {
+		metricsWriter.reset (new MetricsWriter (engine.Metrics (), options.metricsPath,
+			std::chrono::milliseconds (static_cast<long> (options.metricsInterval * 1000))));
+	}
+
+	const FilterParams params = CreateParams (options, engine);
+
+	if (options.verify && options.planar && !options.chunked) {
+		// Check the planar path against the image2d one on the first input.
+		// Only on request, since it filters that input twice more.
+		const auto image = LoadImage (options.inputs [0].c_str ());
+		FilterParams imageParams = params;
+		imageParams.planar = false;
+		imageParams.path = ImagePath;
+
+		Image reference, planar;
+		engine.Filter (image, reference, imageParams);
+		engine.Filter (image, planar, params);
+
+		std::cout << "Planar vs. image2d: max channel difference "
+			<< MaxDifference (reference, planar) << std::endl;
+	}
+
+	std::size_t bytesMoved = 0;
+	const auto start = std::chrono::steady_clock::now ();
+
+	if (!options.regions.empty ()) {
+		std::unique_ptr<RegionFilter> regionFilter;
+		Image result;
+
+		for (std::size_t i = 0; i < options.inputs.size (); ++i) {
+			Image image;
+			{
+				ScopedLatency latency (loadLatency);
+				image = RGBtoRGBA (LoadImage (options.inputs [i].c_str ()));
+			}
+
+			if (!regionFilter) {
+				regionFilter = engine.CreateRegionFilter (image.width, image.height, params);
+				result = regionFilter->Filter (image);
+			} else if (image.width != result.width || image.height != result.height) {
+				std::cerr << options.inputs [i] << ": frame size differs from the first frame" << std::endl;
+				return 1;
+			} else {
+				regionFilter->FilterRegions (image, options.regions, result);
+			}
+
+			{
+				ScopedLatency latency (saveLatency);
+				SaveImage (RGBAtoRGB (result), options.outputs [i].c_str ());
+			}
+			bytesMoved += 2 * result.pixel.size () / 4 * 3;
+		}
+	} else if (options.blocking) {
+		for (std::size_t i = 0; i < options.inputs.size (); ++i) {
+			Image image, result;
+			{
+				ScopedLatency latency (loadLatency);
+				image = LoadImage (options.inputs [i].c_str ());
+			}
+			engine.Filter (image, result, params);
+
+			{
+				ScopedLatency latency (saveLatency);
+				SaveImage (result, options.outputs [i].c_str ());
+			}
+			bytesMoved += 2 * result.pixel.size ();
+		}
+#ifdef CLTUT_HAVE_COROUTINES
+	} else if (options.awaitDepth > 0) {
+		auto io = CreateBatchIO (2 * options.prefetch);
+		Prefetcher prefetcher (*io, options.inputs, options.prefetch);
+		FramesInFlight frames (options.awaitDepth);
+
+		for (std::size_t i = 0; i < options.inputs.size (); ++i) {
+			Image image;
+			{
+				ScopedLatency latency (loadLatency);
+				image = prefetcher.Next ();
+			}
+
+			frames.Start ();
+			FilterAwaited (engine, params, *io, std::move (image), options.outputs [i], frames);
+		}
+
+		bytesMoved = frames.Wait ();
+#endif
+	} else if (options.previews > 0) {
+		bytesMoved = FilterScheduled (engine, params, options);
+	} else if (options.pipeline) {
+		bytesMoved = FilterPipeline (engine, params, options.inputs, options.outputs,
+			std::max<std::size_t> (options.prefetch, 2));
+	} else if (options.chunked) {
+		ThreadPool& pool = engine.HostPool ();
+
+		for (std::size_t i = 0; i < options.inputs.size (); ++i) {
+			Image image, result;
+			{
+				ScopedLatency latency (loadLatency);
+				image = LoadImageRGBA (options.inputs [i], pool);
+			}
+			engine.Filter (image, result, params);
+
+			{
+				ScopedLatency latency (saveLatency);
+				SaveImageRGBA (result, options.outputs [i], pool);
+			}
+			bytesMoved += 2 * result.pixel.size () / 4 * 3;
+		}
+	} else {
+		// Reads for the next files and writes of finished ones run while
+		// the current frames are on the device. At least a whole batch is
+		// read ahead.
+		const std::size_t depth = std::max (options.prefetch, options.batchSize);
+		auto io = CreateBatchIO (2 * depth);
+		Prefetcher prefetcher (*io, options.inputs, depth);
+		std::deque<std::future<void>> writes;
+
+		// Frames on their way through FilterAsync, which keeps references
+		// to image and result
+		struct Frame
+		{
+			Image image;
+			Image result;
+			std::future<void> done;
+			std::size_t index;
+		};
+		const std::size_t InFlight = 2;
+		std::deque<std::unique_ptr<Frame>> frames;
+
+		// The engine's worker uses the images of the frames in flight until
+		// their futures are ready, so an error must not unwind past them
+		struct FrameDrain
+		{
+			~FrameDrain ()
+			{
+				for (const auto& frame : frames) {
+					if (frame->done.valid ()) {
+						frame->done.wait ();
+					}
+				}
+			}
+
+			std::deque<std::unique_ptr<Frame>>& frames;
+		} drain = { frames };
+
+		auto finishFrame = [&] () {
+			Frame& frame = *frames.front ();
+			frame.done.get ();
+			bytesMoved += 2 * frame.result.pixel.size ();
+			writes.push_back (io->Write (options.outputs [frame.index], std::move (frame.result)));
+			frames.pop_front ();
+		};
+
+		for (std::size_t i = 0; i < options.inputs.size (); i += options.batchSize) {
+			const std::size_t count = std::min (options.batchSize, options.inputs.size () - i);
+
+			if (options.batchSize == 1) {
+				std::unique_ptr<Frame> frame (new Frame);
+				frame->index = i;
+				{
+					ScopedLatency latency (loadLatency);
+					frame->image = prefetcher.Next ();
+				}
 
-	// Normalize the filter
-	for (int i = 0; i < 9; ++i) {
-		filter [i] /= 16.0f;
-	}
-
-	// Create a program from source
-	cl_program program = CreateProgram (LoadKernel ("kernels/image.cl"),
-		context);
-
-	CheckError (clBuildProgram (program, deviceIdCount, deviceIds.data (), 
-		"-D FILTER_SIZE=1", nullptr, nullptr));
-
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateKernel.html
-	cl_kernel kernel = clCreateKernel (program, "Filter", &error);
-	CheckError (error);
-
-	// OpenCL only supports RGBA, so we need to convert here
-	const auto image = RGBtoRGBA (LoadImage ("test.ppm"));
-
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateImage2D.html
-	static const cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
-	cl_mem inputImage = clCreateImage2D (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format,
-		image.width, image.height, 0,
-		// This is a bug in the spec
-		const_cast<char*> (image.pixel.data ()),
-		&error);
-	CheckError (error);
-
-	cl_mem outputImage = clCreateImage2D (context, CL_MEM_WRITE_ONLY, &format,
-		image.width, image.height, 0,
-		nullptr, &error);
-	CheckError (error);
-
-	// Create a buffer for the filter weights
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateBuffer.html
-	cl_mem filterWeightsBuffer = clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		sizeof (float) * 9, filter, &error);
-	CheckError (error);
-
-	// Setup the kernel arguments
-	clSetKernelArg (kernel, 0, sizeof (cl_mem), &inputImage);
-	clSetKernelArg (kernel, 1, sizeof (cl_mem), &filterWeightsBuffer);
-	clSetKernelArg (kernel, 2, sizeof (cl_mem), &outputImage);
-	
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateCommandQueue.html
-	cl_command_queue queue = clCreateCommandQueue (context, deviceIds [0],
-		0, &error);
-	CheckError (error);
-
-	// Run the processing
-	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clEnqueueNDRangeKernel.html
-	std::size_t offset [3] = { 0 };
-	std::size_t size [3] = { image.width, image.height, 1 };
-	CheckError (clEnqueueNDRangeKernel (queue, kernel, 2, offset, size, nullptr,
-		0, nullptr, nullptr));
-	
-	// Prepare the result image, set to black
-	Image result = image;
-	std::fill (result.pixel.begin (), result.pixel.end (), 0);
-
-	// Get the result back to the host
-	std::size_t origin [3] = { 0 };
-	std::size_t region [3] = { result.width, result.height, 1 };
-	clEnqueueReadImage (queue, outputImage, CL_TRUE,
-		origin, region, 0, 0,
-		result.pixel.data (), 0, nullptr, nullptr);
-
-	SaveImage (RGBAtoRGB (result), "output.ppm");
-
-	clReleaseMemObject (outputImage);
-	clReleaseMemObject (filterWeightsBuffer);
-	clReleaseMemObject (inputImage);
-
-	clReleaseCommandQueue (queue);
-	
-	clReleaseKernel (kernel);
-	clReleaseProgram (program);
-
-	clReleaseContext (context);
-}
\ No newline at end of file
+				frame->done = engine.FilterAsync (frame->image, frame->result, params);
+				frames.push_back (std::move (frame));
+				if (frames.size () >= InFlight) {
+					finishFrame ();
+				}
+			} else {
+				std::vector<Image> images (count), results (count);
+				{
+					ScopedLatency latency (loadLatency);
+					for (auto& image : images) {
+						image = prefetcher.Next ();
+					}
+				}
+
+				engine.FilterBatch (images, results, params);
+
+				for (std::size_t j = 0; j < count; ++j) {
+					bytesMoved += 2 * results [j].pixel.size ();
+					writes.push_back (io->Write (options.outputs [i + j], std::move (results [j])));
+				}
+			}
+
+			// Bound the memory held by pending writes
+			while (writes.size () > depth) {
+				ScopedLatency latency (saveLatency);
+				writes.front ().get ();
+				writes.pop_front ();
+			}
+			pendingWrites.Set (static_cast<std::int64_t> (writes.size ()));
+		}
+
+		while (!frames.empty ()) {
+			finishFrame ();
+		}
+
+		for (auto& write : writes) {
+			ScopedLatency latency (saveLatency);
+			write.get ();
+		}
+		pendingWrites.Set (0);
+
+		std::cout << "Batch I/O backend: " << io->Name () << std::endl;
+	}
+
+	const std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now () - start;
+	std::cout << "Processed " << options.inputs.size () << " image(s) in "
+		<< elapsed.count () << " s ("
+		<< options.inputs.size () / elapsed.count () << " images/s, "
+		<< bytesMoved / elapsed.count () / (1 << 20) << " MiB/s)" << std::endl;
+
+	const MemoryBudget& budget = engine.Budget ();
+	std::cout << "Device memory: peak " << (budget.Peak () >> 20) << " MiB of a "
+		<< (budget.Budget () >> 20) << " MiB budget" << std::endl;
+
+	if (options.allDevices) {
+		std::uint64_t tiles = 0;
+		for (std::size_t i = 0; i < engine.Devices ().size (); ++i) {
+			tiles += engine.DeviceTiles (i);
+		}
+
+		for (std::size_t i = 0; i < engine.Devices ().size (); ++i) {
+			std::cout << "Device " << (i + 1) << ": " << engine.DeviceTiles (i)
+				<< " tile(s), " << (tiles ? 100.0 * engine.DeviceTiles (i) / tiles : 0)
+				<< "% (" << GetDeviceName (engine.Devices () [i]) << ")" << std::endl;
+		}
+	}
+
+	if (options.tileCacheSize) {
+		const TileCache& tileCache = engine.Cache ();
+		const double tileDeviceTime = engine.TileDeviceTime ();
+		const std::size_t lookups = tileCache.Hits () + tileCache.Misses ();
+		const double perMiss = tileCache.Misses () ? tileDeviceTime / tileCache.Misses () : 0;
+
+		std::cout << "Tile cache: " << tileCache.Hits () << " hit(s), "
+			<< tileCache.Misses () << " miss(es), "
+			<< (lookups ? 100.0 * tileCache.Hits () / lookups : 0) << "% hit rate, "
+			<< tileDeviceTime << " ms on the device, about "
+			<< perMiss * tileCache.Hits () << " ms saved" << std::endl;
+	}
+
+	if (options.hugePages == HugePagesExplicit && HugePageFallbacks () > 0) {
+		std::cout << HugePageFallbacks () << " frame(s) got transparent instead of"
+			" explicit huge pages, see vm.nr_hugepages" << std::endl;
+	}
+
+	if (metricsWriter) {
+		const Histogram& filterLatency = StageLatency (engine.Metrics (), "filter");
+		std::cout << "Filter latency: p50 "
+			<< filterLatency.Quantile (0.5).count () / 1e6 << " ms, p99 "
+			<< filterLatency.Quantile (0.99).count () / 1e6 << " ms" << std::endl;
+	}
+
+	if (options.profile) {
+		PrintProfile (engine.Profile (), engine.MeasurePeaks (params));
+	}
+
+	if (!options.tracePath.empty ()) {
+		WriteTrace (options.tracePath, &engine.Profile (), GetDeviceName (engine.Device ()));
+		std::cout << "Trace written to " << options.tracePath << std::endl;
+	}
+
+	return 0;
+}
+
+int main (int argc, char* argv [])
+{
+	// Everything created in Run is released by its handles on the way out
+	try {
+		const Options options = ParseOptions (argc, argv);
+		if (options.help) {
+			std::cout << Usage;
+			return 0;
+		}
+
+		if (options.remoteWorkers) {
+			return RunRemote (options);
+		}
+		return options.processes ? RunSharded (options) : Run (options);
+	} catch (const std::invalid_argument& e) {
+		std::cerr << e.what () << "\n\n" << Usage;
+		return 1;
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+}
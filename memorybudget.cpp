@@ -0,0 +1,119 @@
+#include "memorybudget.h"
+
+#include <algorithm>
+
+namespace {
+// Tile sizes Plan chooses from, in powers of two
+const int MaxPlanTileSize = 4096;
+const int MinPlanTileSize = 64;
+
+template <typename T>
+T GetDeviceInfo (cl_device_id device, cl_device_info info)
+{
+	T value = 0;
+	CheckError (clGetDeviceInfo (device, info, sizeof (value), &value, nullptr));
+	return value;
+}
+}
+
+DeviceMemoryLimits::DeviceMemoryLimits ()
+	: globalSize (0), maxAllocSize (0), imageMaxWidth (0), imageMaxHeight (0)
+{
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetDeviceInfo.html
+DeviceMemoryLimits GetDeviceMemoryLimits (cl_device_id device)
+{
+	DeviceMemoryLimits limits;
+	limits.globalSize = static_cast<std::size_t> (
+		GetDeviceInfo<cl_ulong> (device, CL_DEVICE_GLOBAL_MEM_SIZE));
+	limits.maxAllocSize = static_cast<std::size_t> (
+		GetDeviceInfo<cl_ulong> (device, CL_DEVICE_MAX_MEM_ALLOC_SIZE));
+
+	if (GetDeviceInfo<cl_bool> (device, CL_DEVICE_IMAGE_SUPPORT)) {
+		limits.imageMaxWidth = GetDeviceInfo<std::size_t> (device, CL_DEVICE_IMAGE2D_MAX_WIDTH);
+		limits.imageMaxHeight = GetDeviceInfo<std::size_t> (device, CL_DEVICE_IMAGE2D_MAX_HEIGHT);
+	}
+
+	return limits;
+}
+
+MemoryBudget::MemoryBudget (const DeviceMemoryLimits& limits, std::size_t budget)
+	: limits_ (limits), budget_ (budget ? budget : limits.globalSize / 4 * 3),
+	inUse_ (0), peak_ (0)
+{
+	if (limits_.globalSize) {
+		budget_ = std::min (budget_, limits_.globalSize);
+	}
+}
+
+void MemoryBudget::Reserve (std::size_t bytes)
+{
+	if (bytes > limits_.maxAllocSize) {
+		throw CLError (CL_INVALID_BUFFER_SIZE);
+	}
+
+	if (inUse_ + bytes > budget_) {
+		throw CLError (CL_MEM_OBJECT_ALLOCATION_FAILURE);
+	}
+
+	inUse_ += bytes;
+	peak_ = std::max (peak_, inUse_);
+}
+
+void MemoryBudget::Release (std::size_t bytes)
+{
+	inUse_ -= std::min (inUse_, bytes);
+}
+
+FramePlan MemoryBudget::Plan (int width, int height, int filterSize,
+	std::size_t pixelBytes, bool image, std::size_t maxSlots, int tileSize) const
+{
+	FramePlan plan;
+	plan.tileSize = tileSize;
+	plan.tileSlots = 1;
+	plan.framesInFlight = 1;
+
+	// Whole frames need an input and an output, the pitch padding of the
+	// buffer path is small enough to ignore
+	const std::size_t frameBytes = std::size_t (width) * height * pixelBytes;
+	const bool imageFits = !image || (std::size_t (width) <= limits_.imageMaxWidth
+		&& std::size_t (height) <= limits_.imageMaxHeight);
+
+	if (tileSize <= 0 && imageFits && frameBytes <= limits_.maxAllocSize
+		&& 2 * frameBytes <= budget_) {
+		plan.tileSize = 0;
+		plan.framesInFlight = budget_ / std::max<std::size_t> (2 * frameBytes, 1);
+		return plan;
+	}
+
+	// Tiles always go through RGBA byte buffers
+	auto slotBytes = [filterSize] (int size) {
+		const std::size_t slot = std::size_t (size + 2 * filterSize);
+		return slot * slot * 4;
+	};
+	// The largest tile which fits, with as many slots as fit; a larger tile
+	// wins over more slots, since it needs fewer launches
+	if (tileSize <= 0) {
+		const int largest = std::max (width, height);
+		plan.tileSize = MinPlanTileSize;
+		for (int size = MaxPlanTileSize; size >= MinPlanTileSize; size /= 2) {
+			if (size / 2 >= largest) {
+				continue;
+			}
+
+			const std::size_t bytes = slotBytes (size);
+			if (bytes <= limits_.maxAllocSize && 2 * bytes <= budget_) {
+				plan.tileSize = size;
+				break;
+			}
+		}
+	}
+
+	const std::size_t bytes = slotBytes (plan.tileSize);
+	while (plan.tileSlots < maxSlots && 2 * (plan.tileSlots + 1) * bytes <= budget_) {
+		++plan.tileSlots;
+	}
+
+	return plan;
+}
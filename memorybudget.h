@@ -0,0 +1,99 @@
+#ifndef CLTUT_MEMORYBUDGET_H
+#define CLTUT_MEMORYBUDGET_H
+
+#include "clhandle.h"
+
+#include <cstddef>
+
+// What a device allows for memory objects
+struct DeviceMemoryLimits
+{
+	DeviceMemoryLimits ();
+
+	// CL_DEVICE_GLOBAL_MEM_SIZE and CL_DEVICE_MAX_MEM_ALLOC_SIZE
+	std::size_t globalSize;
+	std::size_t maxAllocSize;
+
+	// CL_DEVICE_IMAGE2D_MAX_WIDTH and _HEIGHT, 0 without image support
+	std::size_t imageMaxWidth;
+	std::size_t imageMaxHeight;
+};
+
+DeviceMemoryLimits GetDeviceMemoryLimits (cl_device_id device);
+
+// How one frame should go through the device
+struct FramePlan
+{
+	// 0 to filter the whole frame at once, otherwise the tile size
+	int tileSize;
+
+	// Tiles in flight at once, each with an input and an output buffer
+	std::size_t tileSlots;
+
+	// Frames of this size whose input and output fit into the budget at
+	// the same time, at least 1
+	std::size_t framesInFlight;
+};
+
+// Keeps the device memory in use under a budget. The buffer pool reserves
+// every object before it creates one, so going over the budget shows up as
+// CL_MEM_OBJECT_ALLOCATION_FAILURE before the device is asked, and Plan
+// picks tiles which fit before a frame starts. Not thread safe, like the
+// pool.
+class MemoryBudget
+{
+public:
+	// budget 0 takes three quarters of the global memory, which leaves room
+	// for the programs and whatever else shares the device
+	MemoryBudget (const DeviceMemoryLimits& limits, std::size_t budget);
+
+	// Counts bytes as in use. Throws a CLError with
+	// CL_MEM_OBJECT_ALLOCATION_FAILURE if that goes over the budget, or
+	// CL_INVALID_BUFFER_SIZE if a single object of that size is not allowed.
+	void Reserve (std::size_t bytes);
+	void Release (std::size_t bytes);
+
+	// Whether Reserve would succeed
+	bool Fits (std::size_t bytes) const
+	{
+		return bytes <= limits_.maxAllocSize && inUse_ + bytes <= budget_;
+	}
+
+	// Plans a width x height RGBA frame with pixelBytes per pixel in each of
+	// its device buffers (4, 12 for the separable filter, or 16 for float
+	// pixels). image is set for the image2d path, whose frames must also fit
+	// the image size limits. Up to maxSlots tiles may be in flight. A
+	// tileSize greater than 0 is kept, and only the slots are planned. If
+	// not even the smallest tile fits, plans that anyway; the filter falls
+	// back to the CPU once the device refuses.
+	FramePlan Plan (int width, int height, int filterSize, std::size_t pixelBytes,
+		bool image, std::size_t maxSlots, int tileSize) const;
+
+	std::size_t Budget () const
+	{
+		return budget_;
+	}
+
+	std::size_t InUse () const
+	{
+		return inUse_;
+	}
+
+	std::size_t Peak () const
+	{
+		return peak_;
+	}
+
+	const DeviceMemoryLimits& Limits () const
+	{
+		return limits_;
+	}
+
+private:
+	DeviceMemoryLimits limits_;
+	std::size_t budget_;
+	std::size_t inUse_;
+	std::size_t peak_;
+};
+
+#endif
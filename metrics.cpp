@@ -0,0 +1,258 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+// The braces of a sample, with an extra label appended to the given ones
+std::string Labels (const std::string& labels, const std::string& extra = std::string ())
+{
+	if (labels.empty () && extra.empty ()) {
+		return std::string ();
+	}
+
+	const std::string separator = !labels.empty () && !extra.empty () ? "," : "";
+	return "{" + labels + separator + extra + "}";
+}
+
+// Exported histogram buckets, 2^10 ns to 2^37 ns
+const int MinExportExponent = 10;
+const int MaxExportExponent = 37;
+
+const char* const CounterType = "counter";
+const char* const GaugeType = "gauge";
+const char* const HistogramType = "histogram";
+}
+
+void Counter::Write (std::ostream& out, const std::string& name,
+	const std::string& labels) const
+{
+	out << name << Labels (labels) << ' ' << Value () << '\n';
+}
+
+void Gauge::Write (std::ostream& out, const std::string& name,
+	const std::string& labels) const
+{
+	out << name << Labels (labels) << ' ' << Value () << '\n';
+}
+
+Histogram::Histogram ()
+	: count_ (0), sum_ (0)
+{
+	for (auto& bucket : buckets_) {
+		bucket.store (0, std::memory_order_relaxed);
+	}
+}
+
+void Histogram::Record (std::chrono::nanoseconds duration)
+{
+	const std::uint64_t value = duration.count () > 0
+		? static_cast<std::uint64_t> (duration.count ()) : 0;
+
+	buckets_ [Index (value > 0 ? value - 1 : 0)].fetch_add (1, std::memory_order_relaxed);
+	count_.fetch_add (1, std::memory_order_relaxed);
+	sum_.fetch_add (value, std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds Histogram::Quantile (double q) const
+{
+	const std::uint64_t count = Count ();
+	if (count == 0) {
+		return std::chrono::nanoseconds (0);
+	}
+
+	const std::uint64_t rank = std::max<std::uint64_t> (1,
+		static_cast<std::uint64_t> (std::ceil (q * count)));
+
+	std::uint64_t seen = 0;
+	int index = 0;
+	for (; index < BucketCount - 1; ++index) {
+		seen += buckets_ [index].load (std::memory_order_relaxed);
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	return std::chrono::nanoseconds (UpperBound (index) + 1);
+}
+
+void Histogram::Write (std::ostream& out, const std::string& name,
+	const std::string& labels) const
+{
+	// Read each bucket once, so the cumulative counts are consistent even
+	// while other threads record
+	std::uint64_t cumulative = 0;
+	int exponent = MinExportExponent;
+	for (int index = 0; index < BucketCount; ++index) {
+		cumulative += buckets_ [index].load (std::memory_order_relaxed);
+
+		// The last bucket below 2^exponent ends right at it
+		if (exponent <= MaxExportExponent
+			&& index == Index ((std::uint64_t (1) << exponent) - 1)) {
+			// Enough digits to print 2^exponent ns exactly
+			std::ostringstream le;
+			le.precision (12);
+			le << "le=\"" << std::ldexp (1.0, exponent) / 1e9 << "\"";
+
+			out << name << "_bucket" << Labels (labels, le.str ()) << ' ' << cumulative << '\n';
+			++exponent;
+		}
+	}
+
+	out << name << "_bucket" << Labels (labels, "le=\"+Inf\"") << ' ' << cumulative << '\n';
+	out << name << "_sum" << Labels (labels) << ' '
+		<< sum_.load (std::memory_order_relaxed) / 1e9 << '\n';
+	out << name << "_count" << Labels (labels) << ' ' << cumulative << '\n';
+}
+
+int Histogram::Index (std::uint64_t value)
+{
+	if (value < SubBuckets) {
+		return static_cast<int> (value);
+	}
+
+	int exponent = SubBucketBits;
+	while (exponent < 63 && (value >> (exponent + 1)) != 0) {
+		++exponent;
+	}
+
+	if (exponent > MaxExponent) {
+		return BucketCount - 1;
+	}
+
+	const int shift = exponent - SubBucketBits;
+	return SubBuckets * (shift + 1) + static_cast<int> ((value >> shift) & (SubBuckets - 1));
+}
+
+std::uint64_t Histogram::UpperBound (int index)
+{
+	if (index < SubBuckets) {
+		return static_cast<std::uint64_t> (index);
+	}
+
+	const int shift = index / SubBuckets - 1;
+	const std::uint64_t lower = std::uint64_t (SubBuckets + index % SubBuckets) << shift;
+	return lower + (std::uint64_t (1) << shift) - 1;
+}
+
+Counter& MetricsRegistry::GetCounter (const std::string& name,
+	const std::string& help, const std::string& labels)
+{
+	return static_cast<Counter&> (Get (name, help, labels, CounterType,
+		[] () -> Metric* { return new Counter; }));
+}
+
+Gauge& MetricsRegistry::GetGauge (const std::string& name,
+	const std::string& help, const std::string& labels)
+{
+	return static_cast<Gauge&> (Get (name, help, labels, GaugeType,
+		[] () -> Metric* { return new Gauge; }));
+}
+
+Histogram& MetricsRegistry::GetHistogram (const std::string& name,
+	const std::string& help, const std::string& labels)
+{
+	return static_cast<Histogram&> (Get (name, help, labels, HistogramType,
+		[] () -> Metric* { return new Histogram; }));
+}
+
+std::string MetricsRegistry::Text () const
+{
+	std::ostringstream out;
+	out.precision (9);
+
+	std::lock_guard<std::mutex> lock (mutex_);
+	for (const auto& family : families_) {
+		out << "# HELP " << family.first << ' ' << family.second.help << '\n';
+		out << "# TYPE " << family.first << ' ' << family.second.type << '\n';
+
+		for (const auto& metric : family.second.metrics) {
+			metric.second->Write (out, family.first, metric.first);
+		}
+	}
+
+	return out.str ();
+}
+
+// https://github.com/prometheus/node_exporter#textfile-collector
+void MetricsRegistry::WriteFile (const std::string& path) const
+{
+	const std::string text = Text ();
+	const std::string temporary = path + ".tmp";
+
+	{
+		std::ofstream out (temporary, std::ios::binary);
+		if (!out || !out.write (text.data (), text.size ()) || !out.flush ()) {
+			throw std::runtime_error (temporary + ": cannot write metrics");
+		}
+	}
+
+	// Replaces path in one step on POSIX systems
+	if (std::rename (temporary.c_str (), path.c_str ()) != 0) {
+		std::remove (temporary.c_str ());
+		throw std::runtime_error (path + ": cannot replace metrics file");
+	}
+}
+
+Metric& MetricsRegistry::Get (const std::string& name, const std::string& help,
+	const std::string& labels, const char* type, Metric* (*create) ())
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+
+	const auto entry = families_.insert (std::make_pair (name, Family ()));
+	Family& family = entry.first->second;
+	if (entry.second) {
+		family.help = help;
+		family.type = type;
+	} else if (family.type != type) {
+		throw std::invalid_argument (name + " is already registered as a "
+			+ family.type);
+	}
+
+	std::unique_ptr<Metric>& metric = family.metrics [labels];
+	if (!metric) {
+		metric.reset (create ());
+	}
+
+	return *metric;
+}
+
+MetricsWriter::MetricsWriter (const MetricsRegistry& registry,
+	const std::string& path, std::chrono::milliseconds interval)
+	: registry_ (registry), path_ (path), interval_ (interval), stop_ (false)
+{
+	registry_.WriteFile (path_);
+	thread_ = std::thread (&MetricsWriter::Run, this);
+}
+
+MetricsWriter::~MetricsWriter ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		stop_ = true;
+	}
+	wakeup_.notify_one ();
+	thread_.join ();
+}
+
+void MetricsWriter::Run ()
+{
+	std::unique_lock<std::mutex> lock (mutex_);
+	for (;;) {
+		const bool stop = wakeup_.wait_for (lock, interval_, [this] () { return stop_; });
+
+		try {
+			registry_.WriteFile (path_);
+		} catch (const std::exception&) {
+			// Tried again at the next interval
+		}
+
+		if (stop) {
+			return;
+		}
+	}
+}
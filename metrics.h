@@ -0,0 +1,217 @@
+#ifndef CLTUT_METRICS_H
+#define CLTUT_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// One value of a metric family, with its own labels
+class Metric
+{
+public:
+	virtual ~Metric () {}
+
+	// Writes the sample lines in the Prometheus text format
+	virtual void Write (std::ostream& out, const std::string& name,
+		const std::string& labels) const = 0;
+};
+
+// Monotonic count. Add is lock free and may be called from any thread.
+class Counter : public Metric
+{
+public:
+	Counter ()
+		: value_ (0)
+	{
+	}
+
+	void Add (std::uint64_t n = 1)
+	{
+		value_.fetch_add (n, std::memory_order_relaxed);
+	}
+
+	std::uint64_t Value () const
+	{
+		return value_.load (std::memory_order_relaxed);
+	}
+
+	void Write (std::ostream& out, const std::string& name,
+		const std::string& labels) const override;
+
+private:
+	std::atomic<std::uint64_t> value_;
+};
+
+// Value which goes up and down, lock free like Counter
+class Gauge : public Metric
+{
+public:
+	Gauge ()
+		: value_ (0)
+	{
+	}
+
+	void Set (std::int64_t value)
+	{
+		value_.store (value, std::memory_order_relaxed);
+	}
+
+	void Add (std::int64_t n)
+	{
+		value_.fetch_add (n, std::memory_order_relaxed);
+	}
+
+	std::int64_t Value () const
+	{
+		return value_.load (std::memory_order_relaxed);
+	}
+
+	void Write (std::ostream& out, const std::string& name,
+		const std::string& labels) const override;
+
+private:
+	std::atomic<std::int64_t> value_;
+};
+
+// Latency histogram in the style of HdrHistogram: every power of two of
+// nanoseconds is split into SubBuckets linear buckets, so any recorded
+// value is known to within 1/SubBuckets of itself, up to 2^MaxExponent ns
+// (about 18 minutes). Record is lock free.
+//
+// Exported in seconds with a bucket per power of two from about 1 us to
+// 137 s, which the finer buckets add up to exactly; Quantile uses all of
+// them.
+class Histogram : public Metric
+{
+public:
+	static const int SubBucketBits = 3;
+	static const int SubBuckets = 1 << SubBucketBits;
+	static const int MaxExponent = 40;
+	static const int BucketCount = SubBuckets * (MaxExponent - SubBucketBits + 2);
+
+	Histogram ();
+
+	void Record (std::chrono::nanoseconds duration);
+
+	std::uint64_t Count () const
+	{
+		return count_.load (std::memory_order_relaxed);
+	}
+
+	// Upper bound of the bucket holding the q-th quantile, 0 if empty
+	std::chrono::nanoseconds Quantile (double q) const;
+
+	void Write (std::ostream& out, const std::string& name,
+		const std::string& labels) const override;
+
+private:
+	// Buckets hold the values in (lower, upper], like Prometheus buckets,
+	// so they are indexed by value - 1
+	static int Index (std::uint64_t value);
+	static std::uint64_t UpperBound (int index);
+
+	std::atomic<std::uint64_t> buckets_ [BucketCount];
+	std::atomic<std::uint64_t> count_;
+	std::atomic<std::uint64_t> sum_;
+};
+
+// Records the time from construction to destruction into a histogram
+class ScopedLatency
+{
+public:
+	explicit ScopedLatency (Histogram& histogram)
+		: histogram_ (histogram), start_ (std::chrono::steady_clock::now ())
+	{
+	}
+
+	~ScopedLatency ()
+	{
+		histogram_.Record (std::chrono::steady_clock::now () - start_);
+	}
+
+	ScopedLatency (const ScopedLatency&) = delete;
+	ScopedLatency& operator= (const ScopedLatency&) = delete;
+
+private:
+	Histogram& histogram_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+// Named metrics in the Prometheus text exposition format. The Get functions
+// register a metric on first use and return the same object afterwards; it
+// lives as long as the registry. labels is the inside of the braces, e.g.
+// stage="load", and empty for none. Registering a name again with another
+// type throws std::invalid_argument.
+//
+// https://prometheus.io/docs/instrumenting/exposition_formats/
+class MetricsRegistry
+{
+public:
+	MetricsRegistry () {}
+
+	MetricsRegistry (const MetricsRegistry&) = delete;
+	MetricsRegistry& operator= (const MetricsRegistry&) = delete;
+
+	Counter& GetCounter (const std::string& name, const std::string& help,
+		const std::string& labels = std::string ());
+	Gauge& GetGauge (const std::string& name, const std::string& help,
+		const std::string& labels = std::string ());
+	Histogram& GetHistogram (const std::string& name, const std::string& help,
+		const std::string& labels = std::string ());
+
+	std::string Text () const;
+
+	// Writes Text to path.tmp and renames it over path, so a reader like
+	// node_exporter's textfile collector never sees a partial file. Throws
+	// std::runtime_error on failure.
+	void WriteFile (const std::string& path) const;
+
+private:
+	struct Family
+	{
+		std::string help;
+		const char* type;
+		std::map<std::string, std::unique_ptr<Metric>> metrics;
+	};
+
+	// Looks up a metric, or adds the one create returns
+	Metric& Get (const std::string& name, const std::string& help,
+		const std::string& labels, const char* type, Metric* (*create) ());
+
+	mutable std::mutex mutex_;
+	std::map<std::string, Family> families_;
+};
+
+// Writes a registry to a file every interval, and once more when destroyed
+class MetricsWriter
+{
+public:
+	// Writes the file right away, so a bad path throws here. Failures of the
+	// later writes are ignored, the next interval tries again.
+	MetricsWriter (const MetricsRegistry& registry, const std::string& path,
+		std::chrono::milliseconds interval);
+	~MetricsWriter ();
+
+	MetricsWriter (const MetricsWriter&) = delete;
+	MetricsWriter& operator= (const MetricsWriter&) = delete;
+
+private:
+	void Run ();
+
+	const MetricsRegistry& registry_;
+	std::string path_;
+	std::chrono::milliseconds interval_;
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	bool stop_;
+	std::thread thread_;
+};
+
+#endif
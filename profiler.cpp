@@ -0,0 +1,88 @@
+#include "profiler.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <limits>
+
+Profiler::Profiler ()
+	: hostOffset_ (std::numeric_limits<std::int64_t>::min ()), synchronized_ (false)
+{
+}
+
+Profiler::~Profiler ()
+{
+	for (const auto& pending : pending_) {
+		if (pending.event) {
+			clReleaseEvent (pending.event);
+		}
+	}
+}
+
+cl_event* Profiler::Track (const std::string& name, double bytes, double flops)
+{
+	const Pending pending = { name, bytes, flops, nullptr, TraceClock () };
+	pending_.push_back (pending);
+	return &pending_.back ().event;
+}
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetEventProfilingInfo.html
+void Profiler::Collect ()
+{
+	while (!pending_.empty ()) {
+		// Owns the event from here on, whatever happens. The event is null
+		// if the command failed to enqueue.
+		const std::string name = pending_.front ().name;
+		const double bytes = pending_.front ().bytes;
+		const double flops = pending_.front ().flops;
+		const std::int64_t hostQueued = pending_.front ().hostQueued;
+		const CLEvent event (pending_.front ().event);
+		pending_.pop_front ();
+
+		if (!event) {
+			continue;
+		}
+
+		const cl_event events [1] = { event };
+		CheckError (clWaitForEvents (1, events));
+
+		Command command = { name, 0, 0, 0, bytes, flops };
+		CheckError (clGetEventProfilingInfo (event, CL_PROFILING_COMMAND_QUEUED,
+			sizeof (cl_ulong), &command.queued, nullptr));
+		CheckError (clGetEventProfilingInfo (event, CL_PROFILING_COMMAND_START,
+			sizeof (cl_ulong), &command.start, nullptr));
+		CheckError (clGetEventProfilingInfo (event, CL_PROFILING_COMMAND_END,
+			sizeof (cl_ulong), &command.end, nullptr));
+		commands_.push_back (command);
+
+		// The device takes its queued time after the host took hostQueued,
+		// so the largest difference is the closest to the real offset
+		if (!synchronized_) {
+			hostOffset_ = std::max (hostOffset_,
+				hostQueued - static_cast<std::int64_t> (command.queued));
+		}
+	}
+}
+
+void Profiler::Synchronize (cl_device_id device)
+{
+#ifdef CL_VERSION_2_1
+	// http://www.khronos.org/registry/OpenCL/sdk/2.1/docs/man/xhtml/clGetDeviceAndHostTimer.html
+	// Which clock the host timer uses is up to the implementation, so the
+	// device time is matched against steady_clock around the call instead
+	cl_ulong deviceTime = 0, hostTime = 0;
+	const std::int64_t before = TraceClock ();
+	if (clGetDeviceAndHostTimer (device, &deviceTime, &hostTime) == CL_SUCCESS) {
+		const std::int64_t after = TraceClock ();
+		hostOffset_ = before + (after - before) / 2 - static_cast<std::int64_t> (deviceTime);
+		synchronized_ = true;
+	}
+#else
+	(void) device;
+#endif
+}
+
+void Profiler::Clear ()
+{
+	commands_.clear ();
+}
@@ -0,0 +1,80 @@
+#ifndef CLTUT_PROFILER_H
+#define CLTUT_PROFILER_H
+
+#include "clhandle.h"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Records the device time of commands on a queue created with
+// CL_QUEUE_PROFILING_ENABLE
+class Profiler
+{
+public:
+	struct Command
+	{
+		std::string name;
+
+		// Device clock in nanoseconds
+		cl_ulong queued;
+		cl_ulong start;
+		cl_ulong end;
+
+		// Estimated bytes moved and floating point operations, 0 if unknown
+		double bytes;
+		double flops;
+	};
+
+	Profiler ();
+	~Profiler ();
+
+	Profiler (const Profiler&) = delete;
+	Profiler& operator= (const Profiler&) = delete;
+
+	// Returns the event argument for a command that is about to be enqueued.
+	// bytes and flops are the work it does, see Command.
+	cl_event* Track (const std::string& name, double bytes = 0, double flops = 0);
+
+	// Reads the offset between the device and the host clock with
+	// clGetDeviceAndHostTimer, if the device and headers support it.
+	// Otherwise it is estimated from the time each command was enqueued.
+	void Synchronize (cl_device_id device);
+
+	// Add to a device time to get TraceClock nanoseconds
+	std::int64_t HostOffset () const
+	{
+		return hostOffset_;
+	}
+
+	// Waits for the tracked commands and adds their times to Commands
+	void Collect ();
+
+	const std::vector<Command>& Commands () const
+	{
+		return commands_;
+	}
+
+	void Clear ();
+
+private:
+	struct Pending
+	{
+		std::string name;
+		double bytes;
+		double flops;
+		cl_event event;
+
+		// TraceClock right before the command was enqueued
+		std::int64_t hostQueued;
+	};
+
+	// A deque, so the events handed out by Track stay where they are
+	std::deque<Pending> pending_;
+	std::vector<Command> commands_;
+	std::int64_t hostOffset_;
+	bool synchronized_;
+};
+
+#endif
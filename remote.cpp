@@ -0,0 +1,632 @@
+#include "remote.h"
+
+#include "engine.h"
+#include "filedescriptor.h"
+#include "image.h"
+#include "spscring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
+
+namespace {
+// Milliseconds CoordinateFrames waits for each worker to connect
+const int ConnectTimeout = 60000;
+
+// The most a PPM header of LoadImage's kind takes, comments included
+const std::size_t MaxPPMHeader = 4096;
+
+std::system_error MakeError (const char* what)
+{
+	return std::system_error (errno, std::generic_category (), what);
+}
+
+void Put (unsigned char* p, std::uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i) {
+		p [i] = static_cast<unsigned char> (value >> (8 * i));
+	}
+}
+
+std::uint64_t Get (const unsigned char* p, int bytes)
+{
+	std::uint64_t value = 0;
+	for (int i = 0; i < bytes; ++i) {
+		value |= std::uint64_t (p [i]) << (8 * i);
+	}
+	return value;
+}
+
+void SendAll (int socket, const void* data, std::size_t bytes, int flags = 0)
+{
+	const char* p = static_cast<const char*> (data);
+	while (bytes > 0) {
+		// MSG_NOSIGNAL: a closed peer is an error here, not SIGPIPE
+		const ssize_t sent = send (socket, p, bytes, flags | MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		} else if (sent < 0) {
+			throw MakeError ("send");
+		}
+		p += sent;
+		bytes -= sent;
+	}
+}
+
+void ReceiveAll (int socket, void* data, std::size_t bytes)
+{
+	char* p = static_cast<char*> (data);
+	while (bytes > 0) {
+		const ssize_t received = recv (socket, p, bytes, 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		} else if (received < 0) {
+			throw MakeError ("recv");
+		} else if (received == 0) {
+			throw std::runtime_error ("Connection closed");
+		}
+		p += received;
+		bytes -= received;
+	}
+}
+
+// An input file whose header was parsed, ready to send
+struct InputFrame
+{
+	std::unique_ptr<FileDescriptor> file;
+	off_t offset;
+	int width, height;
+	std::size_t payload;
+};
+
+// Throws std::runtime_error if path is not an 8 bit binary PPM
+InputFrame OpenInput (const std::string& path)
+{
+	InputFrame frame;
+	frame.file.reset (new FileDescriptor (open (path.c_str (), O_RDONLY | O_CLOEXEC)));
+	if (frame.file->Get () < 0) {
+		throw std::system_error (errno, std::generic_category (), path);
+	}
+
+	char header [MaxPPMHeader];
+	const ssize_t got = pread (frame.file->Get (), header, sizeof (header), 0);
+	std::size_t headerSize = 0;
+	if (got < 0 || !ParsePPMHeader (header, std::size_t (got), frame.width, frame.height, headerSize)) {
+		throw std::runtime_error (path + ": not an 8 bit binary PPM");
+	}
+
+	struct stat info;
+	frame.offset = off_t (headerSize);
+	frame.payload = std::size_t (frame.width) * frame.height * 3;
+	if (fstat (frame.file->Get (), &info) != 0
+		|| std::size_t (info.st_size) - headerSize < frame.payload) {
+		throw std::runtime_error (path + ": truncated pixel data");
+	}
+
+	return frame;
+}
+
+// Sends bytes of file from offset on
+void SendFileRange (int socket, int file, off_t offset, std::size_t bytes)
+{
+#ifdef __linux__
+	// http://man7.org/linux/man-pages/man2/sendfile.2.html
+	while (bytes > 0) {
+		const ssize_t sent = sendfile (socket, file, &offset, bytes);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		} else if (sent < 0) {
+			throw MakeError ("sendfile");
+		} else if (sent == 0) {
+			throw std::runtime_error ("Input file shrank while it was sent");
+		}
+		bytes -= sent;
+	}
+#else
+	std::vector<char> buffer (std::min<std::size_t> (bytes, 1 << 20));
+	while (bytes > 0) {
+		const ssize_t got = pread (file, buffer.data (), std::min (bytes, buffer.size ()), offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		} else if (got <= 0) {
+			throw MakeError ("pread");
+		}
+		SendAll (socket, buffer.data (), got);
+		offset += got;
+		bytes -= got;
+	}
+#endif
+}
+
+// A pipe for splicing from a socket into a file, which has to go through
+// one
+class SplicePipe
+{
+public:
+	SplicePipe ()
+		: capacity_ (64 << 10)
+	{
+#ifdef __linux__
+		int fds [2];
+		if (pipe2 (fds, O_CLOEXEC) != 0) {
+			throw MakeError ("pipe2");
+		}
+		in_.reset (new FileDescriptor (fds [0]));
+		out_.reset (new FileDescriptor (fds [1]));
+
+		// Fewer round trips per frame with a larger pipe, if the limit
+		// in /proc/sys/fs/pipe-max-size allows
+		const int capacity = fcntl (fds [1], F_SETPIPE_SZ, 1 << 20);
+		if (capacity > 0) {
+			capacity_ = std::size_t (capacity);
+		}
+#endif
+	}
+
+	// Moves bytes from socket to the current offset of file. If writing
+	// fails, or file is -1, the rest is still read and dropped, so the
+	// connection stays in step; the write error is returned, 0 if none.
+	// Throws if the socket fails.
+	int Receive (int socket, int file, std::uint64_t bytes);
+
+private:
+	std::unique_ptr<FileDescriptor> in_, out_;
+	std::size_t capacity_;
+};
+
+int SplicePipe::Receive (int socket, int file, std::uint64_t bytes)
+{
+	int error = file < 0 ? EBADF : 0;
+	std::vector<char> scratch;
+
+#ifdef __linux__
+	// http://man7.org/linux/man-pages/man2/splice.2.html
+	while (bytes > 0) {
+		ssize_t moved = splice (socket, nullptr, out_->Get (), nullptr,
+			std::min<std::uint64_t> (bytes, capacity_), SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (moved < 0 && errno == EINTR) {
+			continue;
+		} else if (moved < 0) {
+			throw MakeError ("splice");
+		} else if (moved == 0) {
+			throw std::runtime_error ("Connection closed");
+		}
+		bytes -= moved;
+
+		// Empty the pipe again before the next bytes go in
+		while (moved > 0) {
+			ssize_t written;
+			if (!error) {
+				written = splice (in_->Get (), nullptr, file, nullptr, moved, SPLICE_F_MOVE);
+				if (written < 0 && errno == EINTR) {
+					continue;
+				} else if (written <= 0) {
+					error = written < 0 ? errno : EIO;
+					continue;
+				}
+			} else {
+				scratch.resize (moved);
+				written = read (in_->Get (), scratch.data (), moved);
+				if (written < 0 && errno == EINTR) {
+					continue;
+				} else if (written <= 0) {
+					throw MakeError ("read");
+				}
+			}
+			moved -= written;
+		}
+	}
+#else
+	scratch.resize (capacity_);
+	while (bytes > 0) {
+		const std::size_t chunk = std::min<std::uint64_t> (bytes, scratch.size ());
+		ReceiveAll (socket, scratch.data (), chunk);
+		bytes -= chunk;
+
+		for (std::size_t done = 0; !error && done < chunk; ) {
+			const ssize_t written = write (file, scratch.data () + done, chunk - done);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			} else if (written <= 0) {
+				error = written < 0 ? errno : EIO;
+			} else {
+				done += written;
+			}
+		}
+	}
+#endif
+
+	return error;
+}
+
+// A worker's connection on the coordinator side
+struct Connection
+{
+	std::unique_ptr<FileDescriptor> socket;
+
+	// Frames sent and not answered yet, oldest first
+	std::deque<std::size_t> inFlight;
+	std::chrono::steady_clock::time_point busySince;
+};
+}
+
+void SendHeader (int socket, const MessageHeader& header)
+{
+	unsigned char bytes [MessageHeaderSize];
+	Put (bytes, header.type, 4);
+	Put (bytes + 4, header.index, 4);
+	Put (bytes + 8, std::uint32_t (header.width), 4);
+	Put (bytes + 12, std::uint32_t (header.height), 4);
+	Put (bytes + 16, header.payloadBytes, 8);
+
+	// The payload follows right away, so both may go in one segment
+	SendAll (socket, bytes, sizeof (bytes), header.payloadBytes ? MSG_MORE : 0);
+}
+
+MessageHeader ReceiveHeader (int socket)
+{
+	unsigned char bytes [MessageHeaderSize];
+	ReceiveAll (socket, bytes, sizeof (bytes));
+
+	MessageHeader header;
+	const std::uint64_t type = Get (bytes, 4);
+	if (type < FrameMessage || type > DoneMessage) {
+		throw std::runtime_error ("Unknown message type " + std::to_string (type));
+	}
+	header.type = static_cast<MessageType> (type);
+	header.index = static_cast<std::uint32_t> (Get (bytes + 4, 4));
+	header.width = static_cast<std::int32_t> (Get (bytes + 8, 4));
+	header.height = static_cast<std::int32_t> (Get (bytes + 12, 4));
+	header.payloadBytes = Get (bytes + 16, 8);
+	return header;
+}
+
+int ListenLoopback (std::uint16_t& port)
+{
+	FileDescriptor listener (socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+	if (listener.Get () < 0) {
+		throw MakeError ("socket");
+	}
+
+	const int reuse = 1;
+	setsockopt (listener.Get (), SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+
+	sockaddr_in address = sockaddr_in ();
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	address.sin_port = htons (port);
+	if (bind (listener.Get (), reinterpret_cast<const sockaddr*> (&address), sizeof (address)) != 0) {
+		throw MakeError ("bind");
+	}
+
+	if (listen (listener.Get (), SOMAXCONN) != 0) {
+		throw MakeError ("listen");
+	}
+
+	socklen_t size = sizeof (address);
+	if (getsockname (listener.Get (), reinterpret_cast<sockaddr*> (&address), &size) != 0) {
+		throw MakeError ("getsockname");
+	}
+	port = ntohs (address.sin_port);
+
+	return listener.Release ();
+}
+
+int ConnectLoopback (std::uint16_t port)
+{
+	FileDescriptor connection (socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+	if (connection.Get () < 0) {
+		throw MakeError ("socket");
+	}
+
+	sockaddr_in address = sockaddr_in ();
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	address.sin_port = htons (port);
+	if (connect (connection.Get (), reinterpret_cast<const sockaddr*> (&address), sizeof (address)) != 0) {
+		throw MakeError ("connect");
+	}
+
+	// Results are sent as a header and the pixels, which should not wait
+	// for each other
+	const int noDelay = 1;
+	setsockopt (connection.Get (), IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay));
+
+	return connection.Release ();
+}
+
+WorkerStats::WorkerStats ()
+	: frames (0), bytesSent (0), bytesReceived (0), seconds (0), lost (false)
+{
+}
+
+std::size_t CoordinateFrames (int listener, std::size_t workerCount,
+	const std::vector<std::string>& inputs, const std::vector<std::string>& outputs,
+	std::size_t window, std::vector<WorkerStats>& stats)
+{
+	// A worker which goes away shows up as an error of send or sendfile
+	std::signal (SIGPIPE, SIG_IGN);
+
+	// Workers which do not connect in time count as lost, the others go
+	// ahead without them
+	stats.assign (workerCount, WorkerStats ());
+	std::vector<Connection> workers (workerCount);
+	std::size_t connections = 0;
+	for (; connections < workerCount; ++connections) {
+		pollfd ready = { listener, POLLIN, 0 };
+		const int polled = poll (&ready, 1, ConnectTimeout);
+		if (polled < 0) {
+			throw MakeError ("poll");
+		} else if (polled == 0) {
+			break;
+		}
+
+		Connection& worker = workers [connections];
+		worker.socket.reset (new FileDescriptor (accept4 (listener, nullptr, nullptr, SOCK_CLOEXEC)));
+		if (worker.socket->Get () < 0) {
+			throw MakeError ("accept4");
+		}
+	}
+
+	if (connections == 0) {
+		throw std::runtime_error ("No worker connected");
+	}
+	for (std::size_t w = connections; w < workerCount; ++w) {
+		std::cerr << "Worker " << w << " did not connect" << std::endl;
+		stats [w].lost = true;
+	}
+
+	SplicePipe pipe;
+	std::deque<std::size_t> pending;
+	for (std::size_t i = 0; i < inputs.size (); ++i) {
+		pending.push_back (i);
+	}
+	std::size_t finished = 0, failed = 0;
+
+	auto fail = [&] (const std::string& message) {
+		std::cerr << message << std::endl;
+		++finished;
+		++failed;
+	};
+
+	// Its frames in flight go back to the front of the queue
+	auto lose = [&] (std::size_t w, const std::exception& e) {
+		std::cerr << "Lost worker " << w << ": " << e.what () << std::endl;
+		Connection& worker = workers [w];
+		pending.insert (pending.begin (), worker.inFlight.begin (), worker.inFlight.end ());
+		worker.inFlight.clear ();
+		worker.socket.reset ();
+		stats [w].lost = true;
+	};
+
+	while (finished < inputs.size ()) {
+		bool connected = false;
+		for (std::size_t w = 0; w < workers.size (); ++w) {
+			Connection& worker = workers [w];
+			while (worker.socket && worker.inFlight.size () < window && !pending.empty ()) {
+				const std::size_t index = pending.front ();
+				pending.pop_front ();
+
+				InputFrame frame;
+				try {
+					frame = OpenInput (inputs [index]);
+				} catch (const std::exception& e) {
+					fail (e.what ());
+					continue;
+				}
+
+				try {
+					MessageHeader header;
+					header.type = FrameMessage;
+					header.index = static_cast<std::uint32_t> (index);
+					header.width = frame.width;
+					header.height = frame.height;
+					header.payloadBytes = frame.payload;
+					SendHeader (worker.socket->Get (), header);
+					SendFileRange (worker.socket->Get (), frame.file->Get (), frame.offset, frame.payload);
+				} catch (const std::exception& e) {
+					pending.push_front (index);
+					lose (w, e);
+					break;
+				}
+
+				if (worker.inFlight.empty ()) {
+					worker.busySince = std::chrono::steady_clock::now ();
+				}
+				worker.inFlight.push_back (index);
+				stats [w].bytesSent += frame.payload;
+			}
+			connected = connected || worker.socket != nullptr;
+		}
+
+		if (!connected) {
+			throw std::runtime_error ("All workers were lost");
+		}
+
+		// Wait for the next results
+		std::vector<pollfd> ready;
+		std::vector<std::size_t> polled;
+		for (std::size_t w = 0; w < workers.size (); ++w) {
+			if (workers [w].socket && !workers [w].inFlight.empty ()) {
+				const pollfd entry = { workers [w].socket->Get (), POLLIN, 0 };
+				ready.push_back (entry);
+				polled.push_back (w);
+			}
+		}
+		if (ready.empty ()) {
+			continue;
+		}
+		if (poll (ready.data (), ready.size (), -1) < 0 && errno != EINTR) {
+			throw MakeError ("poll");
+		}
+
+		for (std::size_t i = 0; i < ready.size (); ++i) {
+			if (!ready [i].revents) {
+				continue;
+			}
+
+			const std::size_t w = polled [i];
+			Connection& worker = workers [w];
+			try {
+				const MessageHeader header = ReceiveHeader (worker.socket->Get ());
+				const std::size_t index = worker.inFlight.front ();
+				if (header.index != index
+					|| (header.type != ResultMessage && header.type != ErrorMessage)) {
+					throw std::runtime_error ("Unexpected message");
+				}
+
+				if (header.type == ErrorMessage) {
+					std::string message (std::size_t (header.payloadBytes), '\0');
+					ReceiveAll (worker.socket->Get (), &message [0], message.size ());
+					fail (inputs [index] + ": " + message);
+				} else {
+					const int output = open (outputs [index].c_str (),
+						O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+					int error = output < 0 ? errno : 0;
+					FileDescriptor file (output);
+
+					const std::string ppmHeader = FormatPPMHeader (header.width, header.height);
+					if (!error && write (output, ppmHeader.data (), ppmHeader.size ())
+						!= ssize_t (ppmHeader.size ())) {
+						error = errno ? errno : EIO;
+					}
+
+					const int received = pipe.Receive (worker.socket->Get (),
+						error ? -1 : output, header.payloadBytes);
+					error = error ? error : received;
+					stats [w].bytesReceived += header.payloadBytes;
+
+					if (error) {
+						fail (std::system_error (error, std::generic_category (),
+							outputs [index]).what ());
+					} else {
+						++stats [w].frames;
+						++finished;
+					}
+				}
+
+				worker.inFlight.pop_front ();
+				if (worker.inFlight.empty ()) {
+					const std::chrono::duration<double> busy =
+						std::chrono::steady_clock::now () - worker.busySince;
+					stats [w].seconds += busy.count ();
+				}
+			} catch (const std::exception& e) {
+				lose (w, e);
+			}
+		}
+	}
+
+	for (Connection& worker : workers) {
+		if (worker.socket) {
+			MessageHeader done = MessageHeader ();
+			done.type = DoneMessage;
+			try {
+				SendHeader (worker.socket->Get (), done);
+			} catch (const std::exception&) {
+				// It has nothing left to do anyway
+			}
+		}
+	}
+
+	return failed;
+}
+
+void ServeFrames (int socket, Engine& engine, const FilterParams& params,
+	std::size_t window)
+{
+	struct Frame
+	{
+		std::uint32_t index;
+		Image image;
+	};
+	SpscRing<Frame> frames (std::max<std::size_t> (window, 1));
+	std::exception_ptr error;
+
+	std::thread receiver ([&] () {
+		try {
+			for (;;) {
+				const MessageHeader header = ReceiveHeader (socket);
+				if (header.type == DoneMessage) {
+					break;
+				}
+
+				if (header.type != FrameMessage || header.width <= 0 || header.height <= 0
+					|| header.payloadBytes != std::uint64_t (header.width) * header.height * 3) {
+					throw std::runtime_error ("Unexpected message");
+				}
+
+				Frame frame;
+				frame.index = header.index;
+				frame.image.width = header.width;
+				frame.image.height = header.height;
+				frame.image.pixel.resize (std::size_t (header.payloadBytes));
+				ReceiveAll (socket, frame.image.pixel.data (), frame.image.pixel.size ());
+				frames.Push (std::move (frame));
+			}
+		} catch (...) {
+			error = std::current_exception ();
+		}
+		frames.Close ();
+	});
+
+	try {
+		Frame frame;
+		while (frames.Pop (frame)) {
+			MessageHeader header = MessageHeader ();
+			header.index = frame.index;
+
+			Image result;
+			std::string message;
+			try {
+				engine.Filter (frame.image, result, params);
+			} catch (const std::exception& e) {
+				message = e.what ();
+			}
+
+			if (message.empty ()) {
+				header.type = ResultMessage;
+				header.width = result.width;
+				header.height = result.height;
+				header.payloadBytes = result.pixel.size ();
+				SendHeader (socket, header);
+				SendAll (socket, result.pixel.data (), result.pixel.size ());
+			} else {
+				header.type = ErrorMessage;
+				header.payloadBytes = message.size ();
+				SendHeader (socket, header);
+				SendAll (socket, message.data (), message.size ());
+			}
+		}
+	} catch (...) {
+		// Wakes the receiver from its recv
+		shutdown (socket, SHUT_RDWR);
+		receiver.join ();
+		throw;
+	}
+
+	receiver.join ();
+	if (error) {
+		std::rethrow_exception (error);
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef CLTUT_REMOTE_H
+#define CLTUT_REMOTE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Engine;
+struct FilterParams;
+
+// Coordinator and workers exchange length-prefixed messages over TCP: a
+// header of MessageHeaderSize bytes, little-endian whatever the host is,
+// then payloadBytes of payload.
+//
+//   Frame   coordinator -> worker  RGB pixels of frame index, width x height
+//   Result  worker -> coordinator  the filtered RGB pixels of frame index
+//   Error   worker -> coordinator  why frame index failed, as text
+//   Done    coordinator -> worker  no more frames, no payload
+//
+// A worker answers its frames in the order they came.
+enum MessageType
+{
+	FrameMessage = 1,
+	ResultMessage,
+	ErrorMessage,
+	DoneMessage
+};
+
+struct MessageHeader
+{
+	MessageType type;
+	std::uint32_t index;
+	std::int32_t width;
+	std::int32_t height;
+	std::uint64_t payloadBytes;
+};
+
+const std::size_t MessageHeaderSize = 24;
+
+// Throw std::system_error if the socket fails. ReceiveHeader throws
+// std::runtime_error if the connection was closed or the header is not one
+// of the messages above.
+void SendHeader (int socket, const MessageHeader& header);
+MessageHeader ReceiveHeader (int socket);
+
+// Sockets on 127.0.0.1. ListenLoopback takes any free port if port is 0
+// and sets it to the one it got. Both throw std::system_error.
+int ListenLoopback (std::uint16_t& port);
+int ConnectLoopback (std::uint16_t port);
+
+// What the coordinator saw of a worker
+struct WorkerStats
+{
+	WorkerStats ();
+
+	std::size_t frames;
+	std::uint64_t bytesSent;
+	std::uint64_t bytesReceived;
+
+	// Time the worker had frames in flight
+	double seconds;
+
+	// Set once the worker disconnected or broke the protocol; its frames
+	// in flight went to the others
+	bool lost;
+};
+
+// Accepts workerCount workers on listener and filters the PPM files of
+// inputs on them into outputs, with up to window frames in flight on each.
+// The pixels go from the input files into the sockets with sendfile, and
+// out of the sockets into the output files with splice, so they never pass
+// through the coordinator's memory. Frames which fail are reported on
+// std::cerr and counted in the result. Workers which do not connect within
+// a while are reported as lost, and the frames go to those which did.
+// Throws std::runtime_error if none connects, or if all were lost.
+std::size_t CoordinateFrames (int listener, std::size_t workerCount,
+	const std::vector<std::string>& inputs, const std::vector<std::string>& outputs,
+	std::size_t window, std::vector<WorkerStats>& stats);
+
+// The worker side: filters the frames which come in over socket until the
+// coordinator is done. A thread of its own receives them, so the
+// coordinator's sends never wait for the filter; window must be at least
+// the coordinator's. Frames which fail are answered with an Error message.
+// Throws if the connection fails.
+void ServeFrames (int socket, Engine& engine, const FilterParams& params,
+	std::size_t window);
+
+#endif
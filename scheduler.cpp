@@ -0,0 +1,195 @@
+#include "scheduler.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+const char* JobClassName (JobClass jobClass)
+{
+	switch (jobClass) {
+	case InteractiveJob:
+		return "interactive";
+	case NormalJob:
+		return "normal";
+	case BatchJob:
+		return "batch";
+	default:
+		return "unknown";
+	}
+}
+
+FilterScheduler::FilterScheduler (Engine& engine, int tileSize)
+	: engine_ (engine), tileSize_ (std::max (tileSize, 16)), sequence_ (0),
+	stop_ (false)
+{
+	for (int c = 0; c < JobClassCount; ++c) {
+		const std::string labels = std::string ("class=\"")
+			+ JobClassName (static_cast<JobClass> (c)) + "\"";
+		latency_ [c] = &engine.Metrics ().GetHistogram ("clfilter_job_seconds",
+			"Seconds from submitting a scheduled job to its result", labels);
+		deadlineMisses_ [c] = &engine.Metrics ().GetCounter ("clfilter_deadline_misses_total",
+			"Scheduled jobs which finished after their deadline", labels);
+	}
+
+	dispatcher_ = std::thread (&FilterScheduler::Dispatch, this);
+}
+
+FilterScheduler::~FilterScheduler ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		stop_ = true;
+	}
+	wakeup_.notify_all ();
+	dispatcher_.join ();
+}
+
+std::future<Image> FilterScheduler::Submit (Image source, const FilterParams& params,
+	JobClass jobClass, Clock::time_point deadline)
+{
+	if (jobClass < 0 || jobClass >= JobClassCount) {
+		throw std::invalid_argument ("Unknown job class");
+	}
+
+	// A job without tiles would never be dispatched, nor finished
+	const std::size_t pixelCount = source.width > 0 && source.height > 0
+		? std::size_t (source.width) * source.height : 0;
+	if (pixelCount == 0 || (source.pixel.size () != pixelCount * 3
+		&& source.pixel.size () != pixelCount * 4)) {
+		throw std::invalid_argument ("Scheduled images need RGB or RGBA pixels");
+	}
+
+	std::shared_ptr<Job> job = std::make_shared<Job> ();
+	job->submitted = Clock::now ();
+	job->rgb = source.pixel.size () == pixelCount * 3;
+	job->rgba = job->rgb ? RGBtoRGBA (source, engine_.HostPool ()) : std::move (source);
+	job->params = params;
+	job->params.tileSize = 0;
+	job->params.planar = false;
+	job->jobClass = jobClass;
+	job->deadline = deadline;
+	job->next = 0;
+
+	for (int y = 0; y < job->rgba.height; y += tileSize_) {
+		for (int x = 0; x < job->rgba.width; x += tileSize_) {
+			const Rect tile = { x, y, std::min (tileSize_, job->rgba.width - x),
+				std::min (tileSize_, job->rgba.height - y) };
+			job->tiles.push_back (tile);
+		}
+	}
+
+	job->result.width = job->rgba.width;
+	job->result.height = job->rgba.height;
+	job->result.pixel.resize (job->rgba.pixel.size ());
+
+	std::future<Image> result = job->done.get_future ();
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		job->sequence = sequence_++;
+		jobs_.push_back (job);
+	}
+	wakeup_.notify_one ();
+
+	return result;
+}
+
+bool FilterScheduler::Before (const Job& a, const Job& b)
+{
+	if (a.jobClass != b.jobClass) {
+		return a.jobClass < b.jobClass;
+	} else if (a.deadline != b.deadline) {
+		return a.deadline < b.deadline;
+	}
+	return a.sequence < b.sequence;
+}
+
+void FilterScheduler::Dispatch ()
+{
+	for (;;) {
+		std::shared_ptr<Job> job;
+		Rect tile;
+		{
+			std::unique_lock<std::mutex> lock (mutex_);
+			wakeup_.wait (lock, [this] () { return stop_ || !jobs_.empty (); });
+
+			// Drain the remaining jobs before stopping
+			if (jobs_.empty ()) {
+				return;
+			}
+
+			// Picked again for every tile, so a more urgent job which came in
+			// meanwhile goes next
+			const auto next = std::min_element (jobs_.begin (), jobs_.end (),
+				[] (const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b) {
+					return Before (*a, *b);
+				});
+			job = *next;
+			tile = job->tiles [job->next++];
+			if (job->next == job->tiles.size ()) {
+				jobs_.erase (next);
+			}
+		}
+
+		try {
+			FilterTile (*job, tile);
+		} catch (...) {
+			// The tiles left are not dispatched
+			{
+				std::lock_guard<std::mutex> lock (mutex_);
+				jobs_.erase (std::remove (jobs_.begin (), jobs_.end (), job), jobs_.end ());
+			}
+			Finish (*job, std::current_exception ());
+			continue;
+		}
+
+		// Only this thread moves next on
+		if (job->next == job->tiles.size ()) {
+			Finish (*job, nullptr);
+		}
+	}
+}
+
+void FilterScheduler::FilterTile (Job& job, const Rect& tile)
+{
+	TraceSpan span ("ScheduledTile");
+
+	// A job of a single tile needs no halo copy
+	if (job.tiles.size () == 1) {
+		engine_.Filter (job.rgba, job.result, job.params);
+		return;
+	}
+
+	const int f = job.params.FilterSize ();
+	Image filtered;
+	engine_.Filter (CropImage (job.rgba, tile, f, job.params.borderMode),
+		filtered, job.params);
+
+	for (int y = 0; y < tile.height; ++y) {
+		std::memcpy (&job.result.pixel [(std::size_t (tile.y + y) * job.result.width + tile.x) * 4],
+			&filtered.pixel [(std::size_t (y + f) * filtered.width + f) * 4],
+			std::size_t (tile.width) * 4);
+	}
+}
+
+void FilterScheduler::Finish (Job& job, std::exception_ptr error)
+{
+	const Clock::time_point now = Clock::now ();
+	latency_ [job.jobClass]->Record (now - job.submitted);
+	if (now > job.deadline) {
+		deadlineMisses_ [job.jobClass]->Add ();
+	}
+
+	if (error) {
+		job.done.set_exception (error);
+		return;
+	}
+
+	try {
+		job.done.set_value (job.rgb ? RGBAtoRGB (job.result, engine_.HostPool ())
+			: std::move (job.result));
+	} catch (...) {
+		job.done.set_exception (std::current_exception ());
+	}
+}
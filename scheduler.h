@@ -0,0 +1,111 @@
+#ifndef CLTUT_SCHEDULER_H
+#define CLTUT_SCHEDULER_H
+
+#include "engine.h"
+#include "filter.h"
+#include "image.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Urgency of a job, most urgent first
+enum JobClass
+{
+	InteractiveJob,
+	NormalJob,
+	BatchJob,
+	JobClassCount
+};
+
+const char* JobClassName (JobClass jobClass);
+
+// Runs filter jobs of mixed urgency on one engine. Every job is split into
+// tiles, and a dispatcher thread sends one tile at a time to the device:
+// always the next tile of the most urgent class, and within a class of the
+// job with the earliest deadline. So a preview submitted while a large
+// batch frame is running waits for one tile of it, not for all of it.
+//
+// Each tile goes to the engine with its filter size halo read from the
+// whole frame (see CropImage), so the tiles add up to exactly the image a
+// single Filter call makes. The latency from Submit to the result is
+// recorded per class in clfilter_job_seconds, jobs which finish after
+// their deadline in clfilter_deadline_misses_total.
+class FilterScheduler
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	FilterScheduler (Engine& engine, int tileSize);
+
+	// Finishes every submitted job first
+	~FilterScheduler ();
+
+	FilterScheduler (const FilterScheduler&) = delete;
+	FilterScheduler& operator= (const FilterScheduler&) = delete;
+
+	// Filters an RGB or RGBA image, the result has the same layout. The
+	// tile size of params is ignored, the scheduler's applies. Throws
+	// std::invalid_argument for an empty image or one whose pixels are
+	// neither RGB nor RGBA.
+	std::future<Image> Submit (Image source, const FilterParams& params,
+		JobClass jobClass, Clock::time_point deadline = Clock::time_point::max ());
+
+	const Histogram& Latency (JobClass jobClass) const
+	{
+		return *latency_ [jobClass];
+	}
+
+	std::uint64_t DeadlineMisses (JobClass jobClass) const
+	{
+		return deadlineMisses_ [jobClass]->Value ();
+	}
+
+private:
+	struct Job
+	{
+		Image rgba;
+		bool rgb;
+		FilterParams params;
+		JobClass jobClass;
+		Clock::time_point deadline;
+		Clock::time_point submitted;
+		std::uint64_t sequence;
+
+		std::vector<Rect> tiles;
+		std::size_t next;
+		Image result;
+		std::promise<Image> done;
+	};
+
+	// Whether a's next tile goes before b's
+	static bool Before (const Job& a, const Job& b);
+
+	void Dispatch ();
+	void FilterTile (Job& job, const Rect& tile);
+	void Finish (Job& job, std::exception_ptr error);
+
+	Engine& engine_;
+	int tileSize_;
+	Histogram* latency_ [JobClassCount];
+	Counter* deadlineMisses_ [JobClassCount];
+
+	// Jobs with tiles left to dispatch
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	std::vector<std::shared_ptr<Job>> jobs_;
+	std::uint64_t sequence_;
+	bool stop_;
+
+	// Last, so it goes first
+	std::thread dispatcher_;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include "sharding.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <sched.h>
+#endif
+
+namespace {
+// Parses a kernel CPU or node list like "0-3,8-11"
+std::vector<int> ParseList (const std::string& list)
+{
+	std::vector<int> result;
+	std::istringstream in (list);
+	std::string range;
+	while (std::getline (in, range, ',')) {
+		if (range.empty () || range == "\n") {
+			continue;
+		}
+
+		const std::size_t dash = range.find ('-');
+		const int first = std::atoi (range.c_str ());
+		const int last = dash == std::string::npos ? first
+			: std::atoi (range.c_str () + dash + 1);
+		for (int i = first; i <= last; ++i) {
+			result.push_back (i);
+		}
+	}
+
+	return result;
+}
+
+std::string ReadLine (const std::string& path)
+{
+	std::ifstream in (path);
+	std::string line;
+	std::getline (in, line);
+	return line;
+}
+}
+
+std::vector<NumaNode> GetNumaNodes ()
+{
+	std::vector<NumaNode> nodes;
+
+	const std::string root = "/sys/devices/system/node/";
+	for (const int id : ParseList (ReadLine (root + "online"))) {
+		NumaNode node;
+		node.id = id;
+		node.cpus = ParseList (ReadLine (root + "node" + std::to_string (id) + "/cpulist"));
+
+		// Memory-only nodes have no CPUs to run a worker on
+		if (!node.cpus.empty ()) {
+			nodes.push_back (node);
+		}
+	}
+
+	if (nodes.empty ()) {
+		NumaNode node;
+		node.id = 0;
+		const unsigned cpus = std::max (1u, std::thread::hardware_concurrency ());
+		for (unsigned i = 0; i < cpus; ++i) {
+			node.cpus.push_back (int (i));
+		}
+		nodes.push_back (node);
+	}
+
+	return nodes;
+}
+
+void PinToCpus (const std::vector<int>& cpus)
+{
+#ifdef __linux__
+	// http://man7.org/linux/man-pages/man2/sched_setaffinity.2.html
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	for (const int cpu : cpus) {
+		if (cpu >= 0 && cpu < CPU_SETSIZE) {
+			CPU_SET (cpu, &set);
+		}
+	}
+
+	if (sched_setaffinity (0, sizeof (set), &set) != 0) {
+		throw std::system_error (errno, std::generic_category (), "sched_setaffinity");
+	}
+#else
+	(void) cpus;
+#endif
+}
+
+ShardQueue::ShardQueue (std::size_t shardCount, std::size_t workerCount)
+	: shardCount_ (shardCount), workerCount_ (workerCount)
+{
+	const std::size_t bytes = sizeof (std::atomic<std::size_t>) * (1 + workerCount);
+
+	// Shared, so the children see the counters of the parent and each other
+	void* const memory = mmap (nullptr, bytes, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		throw std::system_error (errno, std::generic_category (), "mmap");
+	}
+
+	next_ = new (memory) std::atomic<std::size_t> (0);
+	done_ = next_ + 1;
+	for (std::size_t i = 0; i < workerCount; ++i) {
+		new (done_ + i) std::atomic<std::size_t> (0);
+	}
+
+	// Only lock-free atomics are plain memory operations that work across
+	// processes
+	if (!next_->is_lock_free ()) {
+		munmap (memory, bytes);
+		throw std::runtime_error ("ShardQueue needs lock-free atomics");
+	}
+}
+
+ShardQueue::~ShardQueue ()
+{
+	munmap (next_, sizeof (std::atomic<std::size_t>) * (1 + workerCount_));
+}
+
+bool ShardQueue::Next (std::size_t& shard)
+{
+	// Never past the end, so the counter cannot wrap however often the
+	// workers ask
+	std::size_t next = next_->load ();
+	do {
+		if (next >= shardCount_) {
+			return false;
+		}
+	} while (!next_->compare_exchange_weak (next, next + 1));
+
+	shard = next;
+	return true;
+}
+
+void ShardQueue::Done (std::size_t worker, std::size_t items)
+{
+	done_ [worker].fetch_add (items);
+}
+
+std::vector<pid_t> StartWorkers (std::size_t workerCount,
+	const std::function<int (std::size_t worker)>& work)
+{
+	// Anything buffered would be written by every child as well
+	std::cout.flush ();
+	std::cerr.flush ();
+
+	std::vector<pid_t> children;
+	int forkError = 0;
+	for (std::size_t i = 0; i < workerCount; ++i) {
+		// http://man7.org/linux/man-pages/man2/fork.2.html
+		const pid_t pid = fork ();
+		if (pid < 0) {
+			forkError = errno;
+			break;
+		}
+
+		if (pid == 0) {
+			int status = 1;
+			try {
+				status = work (i);
+			} catch (const std::exception& e) {
+				std::cerr << "Worker " << i << ": " << e.what () << std::endl;
+			}
+
+			// _exit skips the parent's atexit handlers and static
+			// destructors, which are not the child's to run
+			std::cout.flush ();
+			_exit (status);
+		}
+
+		children.push_back (pid);
+	}
+
+	if (forkError) {
+		WaitWorkers (children);
+		throw std::system_error (forkError, std::generic_category (), "fork");
+	}
+
+	return children;
+}
+
+std::size_t WaitWorkers (const std::vector<pid_t>& workers)
+{
+	std::size_t failed = 0;
+	for (const pid_t child : workers) {
+		int status = 0;
+		pid_t waited;
+		do {
+			waited = waitpid (child, &status, 0);
+		} while (waited < 0 && errno == EINTR);
+
+		if (waited < 0 || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+			++failed;
+		}
+	}
+
+	return failed;
+}
+
+std::size_t RunWorkers (std::size_t workerCount,
+	const std::function<int (std::size_t worker)>& work)
+{
+	return WaitWorkers (StartWorkers (workerCount, work));
+}
@@ -0,0 +1,82 @@
+#ifndef CLTUT_SHARDING_H
+#define CLTUT_SHARDING_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include <sys/types.h>
+
+// A NUMA node and the CPUs on it
+struct NumaNode
+{
+	int id;
+	std::vector<int> cpus;
+};
+
+// The online NUMA nodes, from /sys/devices/system/node. Without NUMA
+// information, a single node with all CPUs.
+std::vector<NumaNode> GetNumaNodes ();
+
+// Pins the calling thread, and the threads it starts afterwards, to cpus.
+// Memory they touch first is then allocated on the node of the CPUs by the
+// kernel's default policy. Does nothing where affinity is not supported.
+// Throws std::system_error on failure.
+void PinToCpus (const std::vector<int>& cpus);
+
+// Hands out shard indices 0 .. shardCount - 1 to processes forked after it
+// was created, from an atomic counter in shared anonymous memory, so a
+// worker which is faster takes more of them. Also counts the items each
+// worker finished, for the coordinator to report.
+class ShardQueue
+{
+public:
+	ShardQueue (std::size_t shardCount, std::size_t workerCount);
+	~ShardQueue ();
+
+	ShardQueue (const ShardQueue&) = delete;
+	ShardQueue& operator= (const ShardQueue&) = delete;
+
+	// Takes the next shard, false once all were handed out. Safe from any
+	// process and thread.
+	bool Next (std::size_t& shard);
+
+	void Done (std::size_t worker, std::size_t items);
+
+	std::size_t Items (std::size_t worker) const
+	{
+		return done_ [worker].load ();
+	}
+
+	std::size_t ShardCount () const
+	{
+		return shardCount_;
+	}
+
+private:
+	std::size_t shardCount_;
+	std::size_t workerCount_;
+
+	// In the shared mapping: the next shard, then a count per worker
+	std::atomic<std::size_t>* next_;
+	std::atomic<std::size_t>* done_;
+};
+
+// Runs work (worker) in workerCount child processes and returns their
+// process ids. The exit status of a child is what work returned, or 1 if
+// it threw. Has to be called before the process starts threads or touches
+// OpenCL, neither of which survive fork. Throws std::system_error if a
+// process cannot be started, after waiting for those which were.
+std::vector<pid_t> StartWorkers (std::size_t workerCount,
+	const std::function<int (std::size_t worker)>& work);
+
+// Waits for the processes of StartWorkers and returns how many failed,
+// by exiting with a non-zero status or dying
+std::size_t WaitWorkers (const std::vector<pid_t>& workers);
+
+// StartWorkers, then WaitWorkers
+std::size_t RunWorkers (std::size_t workerCount,
+	const std::function<int (std::size_t worker)>& work);
+
+#endif
@@ -0,0 +1,39 @@
+#include "spscring.h"
+
+#ifdef __linux__
+	#include <climits>
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#else
+	#include <chrono>
+	#include <thread>
+#endif
+
+// std::atomic<std::uint32_t> is a plain 32 bit word on Linux, which is what
+// the futex calls take
+//
+// https://man7.org/linux/man-pages/man2/futex.2.html
+void WaitOnAddress (std::atomic<std::uint32_t>& word, std::uint32_t expected)
+{
+#ifdef __linux__
+	// Returns at once with EAGAIN if word no longer holds expected, and may
+	// return with EINTR; both just send the caller around its loop again
+	syscall (SYS_futex, reinterpret_cast<std::uint32_t*> (&word),
+		FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+	if (word.load () == expected) {
+		std::this_thread::sleep_for (std::chrono::microseconds (50));
+	}
+#endif
+}
+
+void WakeAll (std::atomic<std::uint32_t>& word)
+{
+#ifdef __linux__
+	syscall (SYS_futex, reinterpret_cast<std::uint32_t*> (&word),
+		FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+	(void) word;
+#endif
+}
@@ -0,0 +1,151 @@
+#ifndef CLTUT_SPSCRING_H
+#define CLTUT_SPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Sleeps while word holds expected, until WakeAll on it. May return early,
+// callers check their condition again.
+void WaitOnAddress (std::atomic<std::uint32_t>& word, std::uint32_t expected);
+void WakeAll (std::atomic<std::uint32_t>& word);
+
+// Bounded lock-free ring between exactly one producer and one consumer
+// thread. Push and Pop only read the other side's index when the ring
+// looks full or empty, and the indices sit on cache lines of their own, so
+// the two threads do not share a line while items flow. A side which has
+// to wait sleeps on a futex, and the other side only makes the system call
+// to wake it if it announced the wait, so a busy ring makes none.
+//
+// The indices count items modulo 2^32, capacity is rounded up to a power
+// of two.
+template <typename T>
+class SpscRing
+{
+public:
+	explicit SpscRing (std::size_t capacity)
+		: head_ (0), tail_ (0), headCache_ (0), tailCache_ (0),
+		producerWaiting_ (0), producerWakeups_ (0),
+		consumerWaiting_ (0), consumerWakeups_ (0), closed_ (false)
+	{
+		if (capacity == 0 || capacity > (std::size_t (1) << 31)) {
+			throw std::invalid_argument ("SpscRing capacity out of range");
+		}
+
+		std::size_t size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		items_.resize (size);
+		mask_ = static_cast<std::uint32_t> (size - 1);
+	}
+
+	SpscRing (const SpscRing&) = delete;
+	SpscRing& operator= (const SpscRing&) = delete;
+
+	// Producer: adds item, waiting while the ring is full
+	void Push (T item)
+	{
+		const std::uint32_t tail = tail_.load (std::memory_order_relaxed);
+
+		while (tail - headCache_ > mask_) {
+			headCache_ = head_.load (std::memory_order_acquire);
+			if (tail - headCache_ <= mask_) {
+				break;
+			}
+
+			// Announce the wait before the last look at head_; the consumer
+			// moves head_ before it checks for waiters, so one of the two
+			// sees the other
+			producerWaiting_.store (1, std::memory_order_seq_cst);
+			const std::uint32_t wakeups = producerWakeups_.load (std::memory_order_seq_cst);
+			headCache_ = head_.load (std::memory_order_seq_cst);
+			if (tail - headCache_ > mask_) {
+				WaitOnAddress (producerWakeups_, wakeups);
+			}
+			producerWaiting_.store (0, std::memory_order_relaxed);
+		}
+
+		items_ [tail & mask_] = std::move (item);
+		tail_.store (tail + 1, std::memory_order_seq_cst);
+		if (consumerWaiting_.load (std::memory_order_seq_cst)) {
+			consumerWakeups_.fetch_add (1, std::memory_order_seq_cst);
+			WakeAll (consumerWakeups_);
+		}
+	}
+
+	// Producer: no more items will come, Pop returns false once the ring
+	// is empty
+	void Close ()
+	{
+		closed_.store (true, std::memory_order_seq_cst);
+		consumerWakeups_.fetch_add (1, std::memory_order_seq_cst);
+		WakeAll (consumerWakeups_);
+	}
+
+	// Consumer: takes the oldest item, waiting while the ring is empty.
+	// Returns false if it is empty and closed.
+	bool Pop (T& item)
+	{
+		const std::uint32_t head = head_.load (std::memory_order_relaxed);
+
+		while (head == tailCache_) {
+			tailCache_ = tail_.load (std::memory_order_acquire);
+			if (head != tailCache_) {
+				break;
+			}
+
+			consumerWaiting_.store (1, std::memory_order_seq_cst);
+			const std::uint32_t wakeups = consumerWakeups_.load (std::memory_order_seq_cst);
+			tailCache_ = tail_.load (std::memory_order_seq_cst);
+			const bool closed = closed_.load (std::memory_order_seq_cst);
+			if (head == tailCache_ && closed) {
+				// Close comes after the last Push, which this load of
+				// tail_ has seen
+				consumerWaiting_.store (0, std::memory_order_relaxed);
+				return false;
+			} else if (head == tailCache_) {
+				WaitOnAddress (consumerWakeups_, wakeups);
+			}
+			consumerWaiting_.store (0, std::memory_order_relaxed);
+		}
+
+		item = std::move (items_ [head & mask_]);
+		head_.store (head + 1, std::memory_order_seq_cst);
+		if (producerWaiting_.load (std::memory_order_seq_cst)) {
+			producerWakeups_.fetch_add (1, std::memory_order_seq_cst);
+			WakeAll (producerWakeups_);
+		}
+		return true;
+	}
+
+	std::size_t Capacity () const
+	{
+		return items_.size ();
+	}
+
+private:
+	static const std::size_t CacheLine = 64;
+
+	// Each index is written by one side only, and each side keeps its last
+	// look at the other's index next to its own
+	alignas (CacheLine) std::atomic<std::uint32_t> head_;
+	alignas (CacheLine) std::atomic<std::uint32_t> tail_;
+	alignas (CacheLine) std::uint32_t headCache_;
+	alignas (CacheLine) std::uint32_t tailCache_;
+
+	// Only touched when a side has to wait: the flag tells the other side
+	// to bump the counter and wake the futex on it
+	alignas (CacheLine) std::atomic<std::uint32_t> producerWaiting_;
+	std::atomic<std::uint32_t> producerWakeups_;
+	alignas (CacheLine) std::atomic<std::uint32_t> consumerWaiting_;
+	std::atomic<std::uint32_t> consumerWakeups_;
+	std::atomic<bool> closed_;
+
+	alignas (CacheLine) std::uint32_t mask_;
+	std::vector<T> items_;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+namespace {
+// The pool and queue of the current thread, if it is a worker
+thread_local const ThreadPool* currentPool = nullptr;
+thread_local std::size_t currentQueue = 0;
+}
+
+ThreadPool::ThreadPool (std::size_t threadCount)
+	: next_ (0), pending_ (0), stop_ (false)
+{
+	if (threadCount == 0) {
+		threadCount = 1;
+	}
+
+	for (std::size_t i = 0; i < threadCount; ++i) {
+		queues_.emplace_back (new Queue);
+	}
+
+	for (std::size_t i = 0; i < threadCount; ++i) {
+		threads_.emplace_back (&ThreadPool::Worker, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		stop_ = true;
+	}
+	wakeup_.notify_all ();
+
+	for (auto& thread : threads_) {
+		thread.join ();
+	}
+}
+
+void ThreadPool::ParallelFor (std::size_t count, std::size_t grain,
+	const std::function<void (std::size_t begin, std::size_t end)>& body)
+{
+	if (count == 0) {
+		return;
+	}
+
+	// A few bands per thread, so the stealing can even out slow ones
+	const std::size_t bands = std::max<std::size_t> (1,
+		std::min (count / std::max<std::size_t> (grain, 1), 4 * Size ()));
+	const std::size_t bandSize = (count + bands - 1) / bands;
+
+	struct State
+	{
+		std::atomic<std::size_t> remaining;
+		std::mutex mutex;
+		std::exception_ptr error;
+	};
+	auto state = std::make_shared<State> ();
+	state->remaining = (count + bandSize - 1) / bandSize;
+
+	for (std::size_t begin = 0; begin < count; begin += bandSize) {
+		const std::size_t end = std::min (count, begin + bandSize);
+		Push ([state, &body, begin, end] () {
+			try {
+				body (begin, end);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock (state->mutex);
+				if (!state->error) {
+					state->error = std::current_exception ();
+				}
+			}
+			--state->remaining;
+		});
+	}
+
+	const std::size_t self = currentPool == this ? currentQueue : 0;
+	while (state->remaining > 0) {
+		if (!RunOne (self)) {
+			std::this_thread::yield ();
+		}
+	}
+
+	if (state->error) {
+		std::rethrow_exception (state->error);
+	}
+}
+
+void ThreadPool::Push (Task task)
+{
+	const std::size_t index = currentPool == this ? currentQueue
+		: next_++ % queues_.size ();
+
+	// Counted before it is visible, so a RunOne which takes it at once
+	// never decrements below zero
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		++pending_;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock (queues_ [index]->mutex);
+		queues_ [index]->tasks.push_back (std::move (task));
+	}
+	wakeup_.notify_one ();
+}
+
+bool ThreadPool::RunOne (std::size_t self)
+{
+	Task task;
+
+	for (std::size_t i = 0; i < queues_.size () && !task; ++i) {
+		Queue& queue = *queues_ [(self + i) % queues_.size ()];
+		std::lock_guard<std::mutex> lock (queue.mutex);
+		if (queue.tasks.empty ()) {
+			continue;
+		}
+
+		if (i == 0) {
+			task = std::move (queue.tasks.back ());
+			queue.tasks.pop_back ();
+		} else {
+			task = std::move (queue.tasks.front ());
+			queue.tasks.pop_front ();
+		}
+	}
+
+	if (!task) {
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		--pending_;
+	}
+
+	task ();
+	return true;
+}
+
+void ThreadPool::Worker (std::size_t index)
+{
+	currentPool = this;
+	currentQueue = index;
+
+	for (;;) {
+		if (RunOne (index)) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock (mutex_);
+		wakeup_.wait (lock, [this] () { return stop_ || pending_ > 0; });
+
+		// Drain the remaining work before shutting down
+		if (stop_ && pending_ == 0) {
+			return;
+		}
+	}
+}
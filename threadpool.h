@@ -0,0 +1,84 @@
+#ifndef CLTUT_THREADPOOL_H
+#define CLTUT_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool of worker threads. Every worker has a deque of its own:
+// tasks submitted from a worker go to the back of its deque and it takes
+// its newest task first, while idle workers steal the oldest tasks from the
+// front of the others. Tasks from other threads are dealt out in turn.
+class ThreadPool
+{
+public:
+	explicit ThreadPool (std::size_t threadCount =
+		std::thread::hardware_concurrency ());
+	~ThreadPool ();
+
+	ThreadPool (const ThreadPool&) = delete;
+	ThreadPool& operator= (const ThreadPool&) = delete;
+
+	template <typename F>
+	auto Submit (F&& f) -> std::future<decltype (f ())>
+	{
+		typedef decltype (f ()) R;
+
+		// std::function needs a copyable target, packaged_task is move-only
+		auto task = std::make_shared<std::packaged_task<R ()>> (
+			std::forward<F> (f));
+		std::future<R> result = task->get_future ();
+
+		Push ([task] () { (*task) (); });
+
+		return result;
+	}
+
+	// Runs body over [0, count) in bands of at least grain items, on the
+	// workers and on the calling thread, and returns once all are done.
+	// Rethrows the first exception of a band. The caller runs queued tasks
+	// while it waits, so this may also be called from a task.
+	void ParallelFor (std::size_t count, std::size_t grain,
+		const std::function<void (std::size_t begin, std::size_t end)>& body);
+
+	std::size_t Size () const
+	{
+		return threads_.size ();
+	}
+
+private:
+	typedef std::function<void ()> Task;
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void Push (Task task);
+
+	// Runs one task, the newest of queue self if there is one, otherwise
+	// the oldest of another queue. Returns false if all were empty.
+	bool RunOne (std::size_t self);
+
+	void Worker (std::size_t index);
+
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> threads_;
+	std::atomic<std::size_t> next_;
+
+	// Guards pending_, the number of queued tasks, which idle workers
+	// sleep on
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	std::size_t pending_;
+	bool stop_;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "tilecache.h"
+
+#include <iterator>
+
+TileCache::TileCache (std::size_t capacity)
+	: capacity_ (capacity), size_ (0), hits_ (0), misses_ (0)
+{
+}
+
+const std::vector<char>* TileCache::Find (std::uint64_t key,
+	const std::vector<char>& input)
+{
+	const auto it = index_.find (key);
+	if (it == index_.end () || it->second->input != input) {
+		++misses_;
+		return nullptr;
+	}
+
+	++hits_;
+	entries_.splice (entries_.begin (), entries_, it->second);
+	return &it->second->output;
+}
+
+void TileCache::Insert (std::uint64_t key, std::vector<char> input,
+	std::vector<char> output)
+{
+	const std::size_t size = input.size () + output.size ();
+	if (size > capacity_) {
+		return;
+	}
+
+	const auto existing = index_.find (key);
+	if (existing != index_.end ()) {
+		Erase (existing->second);
+	}
+
+	while (size_ + size > capacity_) {
+		Erase (std::prev (entries_.end ()));
+	}
+
+	Entry entry = { key, std::move (input), std::move (output) };
+	entries_.push_front (std::move (entry));
+	index_ [key] = entries_.begin ();
+	size_ += size;
+}
+
+void TileCache::Erase (std::list<Entry>::iterator entry)
+{
+	size_ -= entry->input.size () + entry->output.size ();
+	index_.erase (entry->key);
+	entries_.erase (entry);
+}
@@ -0,0 +1,54 @@
+#ifndef CLTUT_TILECACHE_H
+#define CLTUT_TILECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Least recently used cache of filtered tiles. Entries are keyed by a hash
+// of the tile's input (including its halo) and the filter parameters; the
+// input is kept as well, so a hash collision is a miss rather than a wrong
+// result.
+class TileCache
+{
+public:
+	// capacity is the total size of inputs and outputs kept, in bytes
+	explicit TileCache (std::size_t capacity);
+
+	// Returns the cached output for this input, or nullptr
+	const std::vector<char>* Find (std::uint64_t key, const std::vector<char>& input);
+
+	void Insert (std::uint64_t key, std::vector<char> input, std::vector<char> output);
+
+	std::size_t Hits () const
+	{
+		return hits_;
+	}
+
+	std::size_t Misses () const
+	{
+		return misses_;
+	}
+
+private:
+	struct Entry
+	{
+		std::uint64_t key;
+		std::vector<char> input;
+		std::vector<char> output;
+	};
+
+	void Erase (std::list<Entry>::iterator entry);
+
+	// Most recently used first
+	std::list<Entry> entries_;
+	std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index_;
+	std::size_t capacity_;
+	std::size_t size_;
+	std::size_t hits_;
+	std::size_t misses_;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "trace.h"
+
+#include "profiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Span
+{
+	const char* name;
+	std::int64_t begin, end;
+	int thread;
+};
+
+std::atomic<bool> active (false);
+std::int64_t start = 0;
+
+std::mutex mutex;
+std::vector<Span> spans;
+
+// Small numbers in order of the first span of each thread
+std::map<std::thread::id, int> threads;
+
+std::string Escape (const std::string& s)
+{
+	std::string result;
+	for (const char c : s) {
+		if (c == '"' || c == '\\') {
+			result += '\\';
+		}
+		if (static_cast<unsigned char> (c) >= 0x20) {
+			result += c;
+		}
+	}
+
+	return result;
+}
+
+// Microseconds since StartTrace, the unit of the trace format
+double Microseconds (std::int64_t time)
+{
+	return (time - start) / 1000.0;
+}
+}
+
+void StartTrace ()
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	spans.clear ();
+	threads.clear ();
+	start = TraceClock ();
+	active = true;
+}
+
+bool TraceActive ()
+{
+	return active;
+}
+
+std::int64_t TraceClock ()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds> (
+		std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+void TraceHostSpan (const char* name, std::int64_t begin, std::int64_t end)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	const auto thread = threads.insert (std::make_pair (std::this_thread::get_id (),
+		static_cast<int> (threads.size () + 1))).first;
+
+	const Span span = { name, begin, end, thread->second };
+	spans.push_back (span);
+}
+
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+void WriteTrace (const std::string& path, const Profiler* profiler,
+	const std::string& deviceName)
+{
+	std::ofstream out (path);
+	if (!out) {
+		throw std::runtime_error (path + ": cannot write trace");
+	}
+
+	std::lock_guard<std::mutex> lock (mutex);
+
+	// Microseconds to the nanosecond, never in exponent notation, which
+	// would round away the overlaps a second into the run
+	out << std::fixed << std::setprecision (3);
+
+	// Complete ("X") events, one process for the host and one for the device
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"host\"}},\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\""
+		<< Escape (deviceName) << "\"}}";
+
+	for (const auto& span : spans) {
+		out << ",\n{\"name\":\"" << span.name << "\",\"cat\":\"host\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+			<< span.thread << ",\"ts\":" << Microseconds (span.begin)
+			<< ",\"dur\":" << (span.end - span.begin) / 1000.0 << "}";
+	}
+
+	if (profiler) {
+		const std::int64_t offset = profiler->HostOffset ();
+		for (const auto& command : profiler->Commands ()) {
+			const std::int64_t begin = static_cast<std::int64_t> (command.start) + offset;
+			const std::int64_t wait = static_cast<std::int64_t> (command.queued) + offset;
+
+			out << ",\n{\"name\":\"" << Escape (command.name) << "\",\"cat\":\"device\",\"ph\":\"X\",\"pid\":2,\"tid\":1"
+				<< ",\"ts\":" << Microseconds (begin)
+				<< ",\"dur\":" << (command.end - command.start) / 1000.0
+				<< ",\"args\":{\"queued_us\":" << (begin - wait) / 1000.0 << "}}";
+		}
+	}
+
+	out << "\n]}\n";
+}
@@ -0,0 +1,51 @@
+#ifndef CLTUT_TRACE_H
+#define CLTUT_TRACE_H
+
+#include <cstdint>
+#include <string>
+
+class Profiler;
+
+// Process wide timeline of host activity which WriteTrace combines with the
+// device commands of a Profiler into a Chrome trace, for chrome://tracing
+// or Perfetto. Nothing is recorded until StartTrace is called.
+void StartTrace ();
+bool TraceActive ();
+
+// std::chrono::steady_clock in nanoseconds, the clock of all trace times
+std::int64_t TraceClock ();
+
+// Records a span on the calling thread. name must outlive the trace.
+void TraceHostSpan (const char* name, std::int64_t begin, std::int64_t end);
+
+// Writes the host spans and, if profiler is not null, its device commands
+// on a timeline of their own. Throws std::runtime_error if the file cannot
+// be written.
+void WriteTrace (const std::string& path, const Profiler* profiler,
+	const std::string& deviceName);
+
+// Records the time from construction to destruction as a host span
+class TraceSpan
+{
+public:
+	explicit TraceSpan (const char* name)
+		: name_ (name), begin_ (TraceActive () ? TraceClock () : 0)
+	{
+	}
+
+	~TraceSpan ()
+	{
+		if (begin_) {
+			TraceHostSpan (name_, begin_, TraceClock ());
+		}
+	}
+
+	TraceSpan (const TraceSpan&) = delete;
+	TraceSpan& operator= (const TraceSpan&) = delete;
+
+private:
+	const char* name_;
+	std::int64_t begin_;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include "variants.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+// Up to which relative error weights count as separable
+const float SeparableTolerance = 1e-5f;
+
+// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetDeviceInfo.html
+std::string GetDeviceString (cl_device_id device, cl_device_info info)
+{
+	std::size_t size = 0;
+	CheckError (clGetDeviceInfo (device, info, 0, nullptr, &size));
+
+	std::string result (size, '\0');
+	CheckError (clGetDeviceInfo (device, info, size, &result [0], nullptr));
+
+	// Without the terminator, and without tabs, which separate the fields
+	// of the store
+	result.erase (std::find (result.begin (), result.end (), '\0'), result.end ());
+	std::replace (result.begin (), result.end (), '\t', ' ');
+	return result;
+}
+}
+
+const std::vector<FilterVariant>& FilterVariants ()
+{
+	// path, name, images, local tile, separable
+	static const std::vector<FilterVariant> variants = {
+		{ ImagePath, "image", true, false, false },
+		{ BufferPath, "buffer", false, false, false },
+		{ BufferFloatPath, "float", false, false, false },
+		{ LocalTiledPath, "local", false, true, false },
+		{ RegisterBlockedPath, "blocked", false, false, false },
+		{ SeparablePath, "separable", false, false, true }
+	};
+	return variants;
+}
+
+const FilterVariant& GetFilterVariant (FilterPath path)
+{
+	for (const FilterVariant& variant : FilterVariants ()) {
+		if (variant.path == path) {
+			return variant;
+		}
+	}
+
+	throw std::invalid_argument ("Unknown filter path");
+}
+
+const FilterVariant* FindFilterVariant (const std::string& name)
+{
+	for (const FilterVariant& variant : FilterVariants ()) {
+		if (name == variant.name) {
+			return &variant;
+		}
+	}
+
+	return nullptr;
+}
+
+const char* VariantConstraint (const FilterVariant& variant,
+	cl_device_id device, const FilterKernels& kernels)
+{
+	if (variant.needsImages) {
+		cl_bool imageSupport = CL_FALSE;
+		CheckError (clGetDeviceInfo (device, CL_DEVICE_IMAGE_SUPPORT, sizeof (cl_bool),
+			&imageSupport, nullptr));
+		if (!imageSupport) {
+			return "no image support";
+		}
+	}
+
+	if (variant.needsLocalTile && !kernels.local.Get ()) {
+		return "the tile does not fit into local memory";
+	}
+
+	if (variant.needsSeparable && !kernels.separable) {
+		return "the weights are not separable";
+	}
+
+	return nullptr;
+}
+
+bool LocalTileFits (cl_device_id device, int filterSize)
+{
+	cl_ulong localMemory = 0;
+	std::size_t workGroupSize = 0;
+	CheckError (clGetDeviceInfo (device, CL_DEVICE_LOCAL_MEM_SIZE,
+		sizeof (localMemory), &localMemory, nullptr));
+	CheckError (clGetDeviceInfo (device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+		sizeof (workGroupSize), &workGroupSize, nullptr));
+
+	const std::size_t span = LocalTileSize + 2 * filterSize;
+	return span * span * 4 <= localMemory
+		&& std::size_t (LocalTileSize) * LocalTileSize <= workGroupSize;
+}
+
+bool SeparateWeights (const std::vector<float>& weights,
+	std::vector<float>& row, std::vector<float>& column)
+{
+	const std::size_t side = static_cast<std::size_t> (
+		std::sqrt (double (weights.size ())) + 0.5);
+	if (side * side != weights.size () || weights.empty ()) {
+		return false;
+	}
+
+	// The largest weight gives the most accurate factors: its row is the
+	// row factor, and its column divided by it the column factor
+	const std::size_t pivot = std::max_element (weights.begin (), weights.end (),
+		[] (float a, float b) { return std::fabs (a) < std::fabs (b); }) - weights.begin ();
+	const float largest = weights [pivot];
+	if (largest == 0) {
+		return false;
+	}
+
+	const std::size_t py = pivot / side, px = pivot % side;
+	row.assign (weights.begin () + py * side, weights.begin () + (py + 1) * side);
+	column.resize (side);
+	for (std::size_t y = 0; y < side; ++y) {
+		column [y] = weights [y * side + px] / largest;
+	}
+
+	for (std::size_t y = 0; y < side; ++y) {
+		for (std::size_t x = 0; x < side; ++x) {
+			if (std::fabs (column [y] * row [x] - weights [y * side + x])
+				> SeparableTolerance * std::fabs (largest)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int SizeClass (int width, int height)
+{
+	double pixels = double (width) * height;
+	int sizeClass = 0;
+	while (pixels >= 4) {
+		pixels /= 4;
+		++sizeClass;
+	}
+	return sizeClass;
+}
+
+VariantStore::VariantStore (const std::string& path)
+	: path_ (path)
+{
+	if (path_.empty ()) {
+		return;
+	}
+
+	std::ifstream in (path_);
+	std::string line;
+	while (std::getline (in, line)) {
+		// key \t name \t time, the key itself has no tabs
+		const std::size_t nameStart = line.rfind ('\t', line.rfind ('\t') - 1);
+		const std::size_t timeStart = line.rfind ('\t');
+		if (nameStart == std::string::npos || timeStart == std::string::npos
+			|| nameStart >= timeStart) {
+			continue;
+		}
+
+		const FilterVariant* variant = FindFilterVariant (
+			line.substr (nameStart + 1, timeStart - nameStart - 1));
+		if (variant) {
+			const Choice choice = { variant->path,
+				std::atof (line.c_str () + timeStart + 1) };
+			choices_ [line.substr (0, nameStart)] = choice;
+		}
+	}
+}
+
+std::string VariantStore::Key (cl_device_id device, const FilterKernels& kernels,
+	int width, int height)
+{
+	std::ostringstream key;
+	key << GetDeviceString (device, CL_DEVICE_NAME)
+		<< " / " << GetDeviceString (device, CL_DRIVER_VERSION)
+		<< " / filter " << kernels.filterSize
+		<< " border " << kernels.borderMode
+		<< (kernels.separable ? " separable" : "")
+		<< " / size class " << SizeClass (width, height);
+	return key.str ();
+}
+
+bool VariantStore::Find (const std::string& key, FilterPath& path) const
+{
+	const auto choice = choices_.find (key);
+	if (choice == choices_.end ()) {
+		return false;
+	}
+
+	path = choice->second.path;
+	return true;
+}
+
+void VariantStore::Store (const std::string& key, FilterPath path, double time)
+{
+	const Choice choice = { path, time };
+	choices_ [key] = choice;
+
+	if (path_.empty ()) {
+		return;
+	}
+
+	// Written next to the file and renamed over it, so a run which stops
+	// half way does not lose the earlier choices
+	const std::string temporary = path_ + ".tmp";
+	{
+		std::ofstream out (temporary);
+		for (const auto& entry : choices_) {
+			out << entry.first << '\t' << GetFilterVariant (entry.second.path).name
+				<< '\t' << entry.second.time << '\n';
+		}
+		if (!out.flush ()) {
+			throw std::runtime_error (temporary + ": cannot write variant choices");
+		}
+	}
+
+	if (std::rename (temporary.c_str (), path_.c_str ()) != 0) {
+		std::remove (temporary.c_str ());
+		throw std::runtime_error (path_ + ": cannot replace variant choices");
+	}
+}
@@ -0,0 +1,92 @@
+#ifndef CLTUT_VARIANTS_H
+#define CLTUT_VARIANTS_H
+
+#include "clhandle.h"
+#include "filter.h"
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// One implementation of the RGBA filter and what it needs to run
+struct FilterVariant
+{
+	FilterPath path;
+
+	// As given to clTut --kernel
+	const char* name;
+
+	// The device has to support image2d_t
+	bool needsImages;
+
+	// The program has to be built with LOCAL_TILE, which it only is if the
+	// tile and its halo fit the local memory of every device, see
+	// LocalTileFits
+	bool needsLocalTile;
+
+	// The weights have to be an outer product of a column and a row, see
+	// SeparateWeights
+	bool needsSeparable;
+};
+
+// Every variant, in the order CalibrateFilterPath tries them
+const std::vector<FilterVariant>& FilterVariants ();
+
+// The variant of a path, and the one with a name (null if there is none)
+const FilterVariant& GetFilterVariant (FilterPath path);
+const FilterVariant* FindFilterVariant (const std::string& name);
+
+// Why variant cannot run on device with kernels, or null if it can
+const char* VariantConstraint (const FilterVariant& variant,
+	cl_device_id device, const FilterKernels& kernels);
+
+// True if a LocalTileSize work-group fits on device: the tile with its
+// filterSize halo in local memory, and the work items in a group
+bool LocalTileFits (cl_device_id device, int filterSize);
+
+// Splits (2 * radius + 1)^2 weights into column [y] * row [x] if they are
+// separable, up to float rounding. Returns false otherwise.
+bool SeparateWeights (const std::vector<float>& weights,
+	std::vector<float>& row, std::vector<float>& column);
+
+// Frames whose pixel counts are within a factor of 4 share a class, which
+// is the base 4 logarithm of the pixels: 1 MPix is class 10
+int SizeClass (int width, int height);
+
+// The best variant per device, filter and size class, kept in a text file
+// so later runs skip the benchmarks. Each line is the key, the variant's
+// name and its time in ms, separated by tabs. The key includes the device's
+// name and driver version, so a driver update benchmarks again.
+class VariantStore
+{
+public:
+	// Reads path if it exists; an empty path keeps the choices in memory
+	explicit VariantStore (const std::string& path);
+
+	static std::string Key (cl_device_id device, const FilterKernels& kernels,
+		int width, int height);
+
+	bool Find (const std::string& key, FilterPath& path) const;
+
+	// Adds or replaces a choice and rewrites the file. Throws
+	// std::runtime_error if that fails.
+	void Store (const std::string& key, FilterPath path, double time);
+
+	const std::string& Path () const
+	{
+		return path_;
+	}
+
+private:
+	struct Choice
+	{
+		FilterPath path;
+		double time;
+	};
+
+	std::string path_;
+	std::map<std::string, Choice> choices_;
+};
+
+#endif